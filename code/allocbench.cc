@@ -0,0 +1,295 @@
+/*
+ * allocbench.cc - compare the malloclab heap with the default allocator
+ * on standard container workloads
+ *
+ * Each workload runs once per allocator: std::allocator, mm_allocator,
+ * and polymorphic_allocator over new_delete_resource and over
+ * mm_resource.  The heap is linked in its driver build, so the default
+ * allocator is still glibc's.  Fixed-size objects are then allocated with
+ * mm_malloc and with mm_malloc_const, and records made of a node and two
+ * buffers with three mm_malloc calls and with one mm_comalloc.
+ *
+ * usage: allocbench [-K] [-r <rounds>]
+ *   -K  enable the per-CPU caches of the heap
+ *   -r  repeat each workload this many times (default 5)
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "memlib.h"
+}
+#include "mm_allocator.h"
+#include "mm_const.h"
+
+namespace {
+
+int rounds = 5;
+
+/* Deterministic pseudo random numbers, identical for every allocator */
+struct rng {
+  std::uint64_t state;
+  std::uint32_t next() {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<std::uint32_t>(state >> 33);
+  }
+};
+
+/* Many short vectors growing one element at a time */
+template <template <class> class A> std::uint64_t vector_growth() {
+  std::uint64_t sum = 0;
+  rng r{1};
+  for (int i = 0; i < 2000; i++) {
+    std::vector<std::vector<int, A<int>>, A<std::vector<int, A<int>>>> vs(64);
+    for (auto &v : vs) {
+      int n = r.next() % 2048;
+      for (int j = 0; j < n; j++) {
+        v.push_back(j);
+      }
+      sum += v.size();
+    }
+  }
+  return sum;
+}
+
+/* Insert random keys into an ordered map and erase most of them again */
+template <template <class> class A> std::uint64_t map_churn() {
+  using value = std::pair<const int, int>;
+  std::map<int, int, std::less<int>, A<value>> m;
+  std::uint64_t sum = 0;
+  rng r{2};
+  for (int i = 0; i < 2000000; i++) {
+    int key = r.next() % 65536;
+    if (r.next() % 3 == 0) {
+      sum += m.erase(key);
+    } else {
+      m[key] = i;
+    }
+  }
+  return sum + m.size();
+}
+
+/* The same churn on a hash map, whose buckets grow and shrink as well */
+template <template <class> class A> std::uint64_t unordered_map_churn() {
+  using value = std::pair<const int, int>;
+  std::uint64_t sum = 0;
+  rng r{3};
+  for (int i = 0; i < 20; i++) {
+    std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                       A<value>>
+        m;
+    for (int j = 0; j < 100000; j++) {
+      int key = r.next() % 65536;
+      if (r.next() % 3 == 0) {
+        sum += m.erase(key);
+      } else {
+        m[key] = j;
+      }
+    }
+    sum += m.size();
+  }
+  return sum;
+}
+
+/* Build strings longer than the small string buffer piece by piece */
+template <template <class> class A> std::uint64_t string_building() {
+  using string = std::basic_string<char, std::char_traits<char>, A<char>>;
+  std::uint64_t sum = 0;
+  rng r{4};
+  for (int i = 0; i < 200; i++) {
+    std::vector<string, A<string>> words;
+    for (int j = 0; j < 1000; j++) {
+      string s;
+      int n = r.next() % 256;
+      for (int k = 0; k < n; k += 8) {
+        s += "abcdefgh";
+      }
+      words.push_back(std::move(s));
+    }
+    string all;
+    for (const auto &w : words) {
+      all += w;
+    }
+    sum += all.size();
+  }
+  return sum;
+}
+
+/* Objects of three fixed sizes (a cluster, an exact list and a larger
+ * one) replacing each other at random */
+template <bool constant> std::uint64_t fixed_churn() {
+  constexpr int slots = 4096;
+  static void *p[slots];
+  std::uint64_t sum = 0;
+  rng r{5};
+  for (int i = 0; i < 4000000; i++) {
+    int k = r.next() % slots;
+    if (p[k] != nullptr) {
+      mm_free(p[k]);
+    }
+    switch (k % 3) {
+    case 0:
+      p[k] = constant ? mm_malloc_const<14>() : mm_malloc(14);
+      break;
+    case 1:
+      p[k] = constant ? mm_malloc_const<40>() : mm_malloc(40);
+      break;
+    default:
+      p[k] = constant ? mm_malloc_const<120>() : mm_malloc(120);
+      break;
+    }
+    sum += (reinterpret_cast<std::uintptr_t>(p[k]) >> 4) & 0xff;
+  }
+  for (auto &q : p) {
+    mm_free(q);
+    q = nullptr;
+  }
+  return sum;
+}
+
+/* A record: a list node followed by a key and a value buffer */
+struct record {
+  record *next;
+  char *key;
+  char *value;
+  std::uint32_t key_size;
+  std::uint32_t value_size;
+};
+
+/* Records built in a heap fragmented by freed objects of random sizes,
+ * then walked a few times and freed one object at a time */
+template <bool co> std::uint64_t record_walk() {
+  constexpr int count = 1 << 16;
+  static void *junk[count];
+  rng r{7};
+  for (auto &j : junk) {
+    j = mm_malloc(16 + r.next() % 240);
+  }
+  record *head = nullptr;
+  for (int i = 0; i < count; i++) {
+    void *&j = junk[r.next() % count];
+    mm_free(j);
+    j = nullptr;
+    std::size_t sizes[3] = {sizeof(record), 8 + r.next() % 24,
+                            16 + r.next() % 112};
+    void *obj[3];
+    if (co) {
+      mm_comalloc(3, sizes, obj);
+    } else {
+      for (int k = 0; k < 3; k++) {
+        obj[k] = mm_malloc(sizes[k]);
+      }
+    }
+    record *rec = static_cast<record *>(obj[0]);
+    rec->next = head;
+    rec->key = static_cast<char *>(obj[1]);
+    rec->value = static_cast<char *>(obj[2]);
+    rec->key_size = std::uint32_t(sizes[1]);
+    rec->value_size = std::uint32_t(sizes[2]);
+    std::memset(rec->key, i, rec->key_size);
+    std::memset(rec->value, i >> 8, rec->value_size);
+    head = rec;
+  }
+  std::uint64_t sum = 0;
+  for (int pass = 0; pass < 8; pass++) {
+    for (record *rec = head; rec != nullptr; rec = rec->next) {
+      sum += std::uint8_t(rec->key[rec->key_size - 1]) +
+             std::uint8_t(rec->value[rec->value_size - 1]);
+    }
+  }
+  while (head != nullptr) {
+    record *next = head->next;
+    mm_free(head->key);
+    mm_free(head->value);
+    mm_free(head);
+    head = next;
+  }
+  for (auto &j : junk) {
+    mm_free(j);
+    j = nullptr;
+  }
+  return sum;
+}
+
+template <class F> double run(F workload, std::uint64_t &check) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    check += workload();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+template <template <class> class A>
+void run_all(const char *name, std::pmr::memory_resource *resource) {
+  std::uint64_t check = 0;
+  std::pmr::set_default_resource(resource);
+  double t1 = run(vector_growth<A>, check);
+  double t2 = run(map_churn<A>, check);
+  double t3 = run(unordered_map_churn<A>, check);
+  double t4 = run(string_building<A>, check);
+  std::pmr::set_default_resource(nullptr);
+  std::printf("%-16s %10.1f %10.1f %10.1f %10.1f   %llx\n", name, t1, t2, t3,
+              t4, static_cast<unsigned long long>(check));
+}
+
+template <class T> using pmr_allocator = std::pmr::polymorphic_allocator<T>;
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bool cpu_cache = false;
+  int c;
+  while ((c = getopt(argc, argv, "Kr:h")) != -1) {
+    switch (c) {
+    case 'K':
+      cpu_cache = true;
+      break;
+    case 'r':
+      rounds = std::atoi(optarg);
+      break;
+    default:
+      std::fprintf(stderr, "usage: %s [-K] [-r <rounds>]\n", argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  mem_init(false);
+  if (!mm_init()) {
+    std::fprintf(stderr, "mm_init failed\n");
+    return 1;
+  }
+  if (cpu_cache && !mm_cpu_cache_start()) {
+    std::fprintf(stderr, "per-CPU caches unavailable\n");
+  }
+
+  std::printf("%-16s %10s %10s %10s %10s   (ms, %d rounds)\n", "allocator",
+              "vector", "map", "unordered", "string", rounds);
+  run_all<std::allocator>("std::allocator", std::pmr::new_delete_resource());
+  run_all<mm_allocator>("mm_allocator", std::pmr::new_delete_resource());
+  run_all<pmr_allocator>("pmr new_delete", std::pmr::new_delete_resource());
+  run_all<pmr_allocator>("pmr mm_resource", mm_resource());
+
+  std::uint64_t check = 0;
+  double t1 = run(fixed_churn<false>, check);
+  double t2 = run(fixed_churn<true>, check);
+  std::printf("\n%-16s %10.1f\n%-16s %10.1f   %llx\n", "mm_malloc", t1,
+              "mm_malloc_const", t2, static_cast<unsigned long long>(check));
+
+  check = 0;
+  t1 = run(record_walk<false>, check);
+  t2 = run(record_walk<true>, check);
+  std::printf("\n%-16s %10.1f\n%-16s %10.1f   %llx\n", "records malloc", t1,
+              "records comalloc", t2, static_cast<unsigned long long>(check));
+  return 0;
+}
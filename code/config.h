@@ -124,15 +124,46 @@
 
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
- * Maximum heap size in bytes
+ * Memory budget in bytes.  The sparse emulation sizes its page pool after it
  */
 #define MAX_DENSE_HEAP (100*(1<<20))  /* 100 MB */
 
+/*
+ * Maximum heap size in bytes.  This much address space is reserved with
+ * PROT_NONE up front and only committed as the break grows
+ */
+#define DENSE_HEAP_RESERVE (1UL<<36)  /* 64 GB */
+
+/*
+ * Maximum number of heap segments.  The reserved heap (dense or sparse) is
+ * divided into this many equal slots, one per segment, each with a break of
+ * its own
+ */
+#define HEAP_SEGMENTS 8
+
+/*
+ * Granularity in bytes of committing (mprotect) and decommitting
+ * (MADV_DONTNEED) the reserved dense heap
+ */
+#define DENSE_COMMIT_CHUNK (1<<21)  /* 2 MB */
+
+/*
+ * Committed bytes kept above the break when the heap is trimmed, so that a
+ * heap that shrinks and grows again does not fault its pages back in
+ */
+#define DENSE_DECOMMIT_SLACK (16*DENSE_COMMIT_CHUNK)  /* 32 MB */
+
 /*
  * Starting address of the memory allocated for the heap by mmap
  */
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
+/*
+ * Size of a transparent huge page.  When huge pages are requested the dense
+ * heap starts on a boundary of this size.
+ */
+#define HUGE_PAGE_SIZE (1<<21)  /* 2 MB */
+
 
 /*********** Parameters controlling sparse memory version of heap ***********/
 
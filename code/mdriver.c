@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <linux/perf_event.h>
 #include <math.h>
 #include <setjmp.h>
 #include <signal.h>
@@ -18,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,6 +38,15 @@
 /* Misc */
 #define MAXLINE 1024 /* max string size */
 #define HDRLINES 4   /* number of header lines in a trace file */
+/* Oracle hints: long-lived blocks outlive 1/ORACLE_LONG_LIVED_DIV of a trace */
+#define ORACLE_LONG_LIVED_DIV 2
+/* Movable mode: bytes mm_compact may move after each free */
+#define COMPACT_BUDGET (1 << 12)
+/* ...and the smallest block it treats as movable when a trace marks none */
+#define MOVABLE_MIN_SIZE 512
+/* ...and in the validity check, every this many stay locked and must not move */
+#define COMPACT_PIN_EVERY 8
+#define PINNED(index) ((index) % COMPACT_PIN_EVERY == 0)
 #define LINENUM(i)                                                             \
     (i + HDRLINES + 1) /* cnvt trace request nums to linenums (origin 1) */
 
@@ -98,6 +111,8 @@ typedef struct
     } type;      /* type of request */
     long index;  /* index for free() to use later */
     size_t size; /* byte size of alloc/realloc request */
+    int hint;    /* lifetime hint for mm_malloc_hint, 0 if none */
+    bool movable; /* allocate through mm_halloc in movable mode */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -107,11 +122,14 @@ typedef struct
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
+    bool has_hints;       /* did the trace file supply lifetime hints? */
+    bool has_movable;     /* did the trace file mark movable blocks? */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+    mm_handle_t *handles; /* handles of the movable blocks in movable mode */
 } trace_t;
 
 /*
@@ -140,6 +158,8 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double rss_util; /* same, but relative to the peak resident size */
+    size_t peak_rss; /* peak resident heap bytes, only set with -R */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -184,6 +204,23 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+/* If set, report the address distance between consecutive allocations */
+static bool locality_mode = false;
+/* If set, pass lifetime hints to mm_malloc_hint (oracle if trace has none) */
+static bool hint_mode = false;
+/* If set, allocate blocks marked movable (large ones if none are) through
+ * handles */
+static bool movable_mode = false;
+/* If set, back the dense heap with transparent huge pages */
+static bool hugepage_mode = false;
+/* If set, compare dTLB misses with base pages and with huge pages */
+static bool tlb_mode = false;
+/* If set, report utilization relative to resident heap pages as well */
+static bool rss_mode = false;
+/* If set, run the mm package's background maintenance thread */
+static bool maintenance_mode = false;
+/* If set, enable the mm package's per-CPU caches */
+static bool cpu_cache_mode = false;
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -219,6 +256,14 @@ static sum_stats_t global_mm_sum_stats;
 
 /* Performance statistics for driver */
 
+/*
+ * Address distance histogram collected by eval_mm_util in locality mode.
+ * Bucket k counts distances in (2^(k-1), 2^k] bytes; bucket 0 counts 0 and 1.
+ */
+#define DIST_BUCKETS 64
+static size_t dist_hist[DIST_BUCKETS];
+static char *dist_last; /* payload returned by the previous allocation */
+
 /*********************
  * Function prototypes
  *********************/
@@ -237,11 +282,15 @@ static void free_range_set(range_set_t *ranges);
 static void init_random_data(void);
 static bool check_index(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
+static bool check_handles(trace_t *trace, int opnum, bool all);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
+static void set_oracle_hints(trace_t *trace);
+static void mark_movable(trace_t *trace);
+static char *trace_malloc(const traceop_t *op);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -251,8 +300,13 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
+static void record_distance(char *p);
+static void touch_payload(char *p, size_t size);
+static void print_locality(const trace_t *trace);
 static void eval_mm_speed(void *ptr);
+static void compare_tlb(speed_t *speed_params);
+static void start_mm_options(void);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
@@ -300,6 +354,10 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+        if (hint_mode && !trace->has_hints)
+            set_oracle_hints(trace);
+        if (movable_mode && !trace->has_movable)
+            mark_movable(trace);
         strcpy(mm_stats[i].filename, trace->filename);
         mm_stats[i].ops = trace->num_ops;
 
@@ -332,7 +390,13 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+            if (locality_mode)
+                print_locality(trace);
+            if (rss_mode)
+                printf("\n%s: peak RSS %zu KB, RSS util %.1f%%\n",
+                       trace->filename, mm_stats[i].peak_rss / 1024,
+                       mm_stats[i].rss_util * 100.0);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -340,6 +404,8 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (tlb_mode && !sparse_mode)
+                compare_tlb(speed_params);
         }
 
 #if 0
@@ -351,6 +417,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         free_range_set(ranges);
 
         /* clean up memory system */
+        mm_maintenance_stop();
         mem_deinit();
     }
 }
@@ -384,7 +451,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpBCKOVAlDHLMPRTm")) != EOF)
     {
         switch (c)
         {
@@ -445,6 +512,39 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'L':
+            locality_mode = true;
+            break;
+
+        case 'H':
+            hint_mode = true;
+            break;
+
+        case 'm':
+            movable_mode = true;
+            break;
+
+        case 'P':
+            hugepage_mode = true;
+            mem_set_hugepages(true);
+            break;
+
+        case 'M':
+            tlb_mode = true;
+            break;
+
+        case 'R':
+            rss_mode = true;
+            break;
+
+        case 'B':
+            maintenance_mode = true;
+            break;
+
+        case 'K':
+            cpu_cache_mode = true;
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -456,6 +556,17 @@ int main(int argc, char **argv)
     }
 #endif /* !REF_ONLY */
 
+    if (maintenance_mode && sparse_mode)
+    {
+        fprintf(stderr, "WARNING: -B needs the dense heap, ignored\n");
+        maintenance_mode = false;
+    }
+    if (cpu_cache_mode && sparse_mode)
+    {
+        fprintf(stderr, "WARNING: -K needs the dense heap, ignored\n");
+        cpu_cache_mode = false;
+    }
+
     if (num_global_tracefiles == 0)
     {
         int i;
@@ -593,6 +704,7 @@ int main(int argc, char **argv)
 
     /* temporaries used to compute the performance index */
     double avg_mm_util = 0.0;
+    double avg_mm_rss_util = 0.0;
     double avg_mm_harm_throughput = 0.0;
     double p1, p1_checkpoint; // util index
     double p2, p2_checkpoint; // throughput index
@@ -606,6 +718,7 @@ int main(int argc, char **argv)
     double secs = 0.0;
     double ops = 0.0;
     double util = 0.0;
+    double rss_util = 0.0;
     double tput_harm = 0.0;
     int numcorrect = 0;
 
@@ -627,6 +740,7 @@ int main(int argc, char **argv)
         if (mm_stats[i].weight == WALL || mm_stats[i].weight == WUTIL)
         {
             util += mm_stats[i].util;
+            rss_util += mm_stats[i].rss_util;
             util_weight++;
         }
         if (mm_stats[i].valid)
@@ -656,6 +770,7 @@ int main(int argc, char **argv)
     else
     {
         avg_mm_util = util / util_weight;
+        avg_mm_rss_util = rss_util / util_weight;
     }
 
     /*
@@ -695,6 +810,9 @@ int main(int argc, char **argv)
         printf("%.0f\n", avg_mm_harm_throughput);
 #else /* !REF_ONLY */
         printf("Average utilization = %.1f%%.\n", avg_mm_util * 100);
+        if (rss_mode)
+            printf("Average RSS utilization = %.1f%%.\n",
+                   avg_mm_rss_util * 100);
 
         // Don't measure throughput in sparse mode
         if (!sparse_mode)
@@ -1000,6 +1118,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
+    char hint[3];
     int index;
     size_t size;
     int max_index = 0;
@@ -1052,9 +1171,16 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* and the handles of the blocks allocated through mm_halloc */
+    if ((trace->handles = calloc(trace->num_ids, sizeof(mm_handle_t))) ==
+        NULL)
+        unix_error("malloc 6 failed in read_trace");
+
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->has_hints = false;
+    trace->has_movable = false;
     while (fscanf(tracefile, "%s", type) != EOF)
     {
         switch (type[0])
@@ -1064,6 +1190,27 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = ALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->ops[op_index].hint = 0;
+            trace->ops[op_index].movable = false;
+            /* Optional fields: 's' (short-lived) or 'l' (long-lived), and
+             * 'm' (movable) */
+            if (fscanf(tracefile, "%*[ \t]%2[slm]", hint) == 1)
+            {
+                for (char *h = hint; *h != '\0'; h++)
+                {
+                    if (*h == 'm')
+                    {
+                        trace->ops[op_index].movable = true;
+                        trace->has_movable = true;
+                    }
+                    else
+                    {
+                        trace->ops[op_index].hint =
+                            (*h == 'l') ? MM_LONG_LIVED : MM_SHORT_LIVED;
+                        trace->has_hints = true;
+                    }
+                }
+            }
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
@@ -1071,12 +1218,16 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = REALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->ops[op_index].hint = 0;
+            trace->ops[op_index].movable = false;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
             ignore += fscanf(tracefile, "%u", &index);
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
+            trace->ops[op_index].hint = 0;
+            trace->ops[op_index].movable = false;
             break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
@@ -1105,19 +1256,79 @@ static void reinit_trace(trace_t *trace)
 {
     memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
     memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
+    memset(trace->handles, 0, trace->num_ids * sizeof(*trace->handles));
     /* block_rand_base is unused if size is zero */
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
+ * set_oracle_hints - Derive lifetime hints from the trace itself: a block is
+ *    long-lived if it is never freed or outlives 1/ORACLE_LONG_LIVED_DIV of
+ *    the trace. This is a heuristic reference for lifetime hints, not a
+ *    bound on what they can gain: it can lower utilization.
+ */
+static void set_oracle_hints(trace_t *trace)
+{
+    int i;
+    int *alloc_op;
+    int threshold = trace->num_ops / ORACLE_LONG_LIVED_DIV;
+
+    if ((alloc_op = malloc(trace->num_ids * sizeof(int))) == NULL)
+        unix_error("malloc failed in set_oracle_hints");
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        traceop_t *op = &trace->ops[i];
+        if (op->type == ALLOC)
+        {
+            op->hint = MM_LONG_LIVED; /* until a free shows otherwise */
+            alloc_op[op->index] = i;
+        }
+        else if (op->type == FREE && op->index >= 0 &&
+                 i - alloc_op[op->index] <= threshold)
+        {
+            trace->ops[alloc_op[op->index]].hint = MM_SHORT_LIVED;
+        }
+    }
+    free(alloc_op);
+}
+
+/*
+ * mark_movable - Mark the allocations of at least MOVABLE_MIN_SIZE bytes
+ *    of a trace without movable fields as movable.  Smaller blocks stay
+ *    plain, since a handle would add a good part of their size again.
+ */
+static void mark_movable(trace_t *trace)
+{
+    int i;
+
+    for (i = 0; i < trace->num_ops; i++)
+        if (trace->ops[i].type == ALLOC &&
+            trace->ops[i].size >= MOVABLE_MIN_SIZE)
+            trace->ops[i].movable = true;
+}
+
+/*
+ * trace_malloc - Perform the allocation request OP, passing its lifetime
+ *    hint to mm_malloc_hint in hint mode.
+ */
+static char *trace_malloc(const traceop_t *op)
+{
+    if (hint_mode && op->hint != 0)
+        return mm_malloc_hint(op->size, op->hint);
+    return mm_malloc(op->size);
+}
+
+/*
+ * free_trace - Free the trace record and the five arrays it points
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
+    free(trace->ops); /* free the arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->handles);
     free(trace); /* and the trace record itself... */
 }
 
@@ -1128,6 +1339,12 @@ static void free_trace(trace_t *trace)
 
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
+ *   With -m the blocks marked movable are allocated through mm_halloc and
+ *   compacted at the same points as in eval_mm_util; after each compaction
+ *   that moves anything, every movable block is looked up again through its
+ *   handle and the data of those that moved checked.  Movable blocks are only
+ *   in the range list while locked: every COMPACT_PIN_EVERY-th one stays
+ *   locked for its whole life and must not move.
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
@@ -1137,9 +1354,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     char *newp;
     char *oldp;
     char *p;
+    mm_handle_t h;
+    bool compact;
     bool allCheck = true;
 
     /* Reset the heap and free any records in the range list */
+    mm_maintenance_stop();
     mem_reset_brk();
     reinit_trace(trace);
 
@@ -1149,6 +1369,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
+    start_mm_options();
 
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++)
@@ -1177,15 +1398,28 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 }
                 r = r->next;
             }
+            if (movable_mode && !check_handles(trace, i, true))
+                allCheck = false;
         }
 
+        compact = false;
         switch (trace->ops[i].type)
         {
 
         case ALLOC: /* mm_malloc */
 
-            /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL)
+            /* Call the student's malloc, or mm_halloc for a movable block */
+            if (movable_mode && trace->ops[i].movable)
+            {
+                if ((h = mm_halloc(size)) == NULL)
+                {
+                    malloc_error(trace, i, "mm_halloc failed.");
+                    return false;
+                }
+                trace->handles[index] = h;
+                p = mm_hlock(h);
+            }
+            else if ((p = trace_malloc(&trace->ops[i])) == NULL)
             {
                 malloc_error(trace, i, "mm_malloc failed.");
                 return false;
@@ -1205,6 +1439,13 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+
+            /* An unlocked movable block leaves the range list */
+            if (trace->handles[index] != NULL && !PINNED(index))
+            {
+                remove_range(ranges, p);
+                mm_hunlock(trace->handles[index]);
+            }
             break;
 
         case REALLOC: /* mm_realloc */
@@ -1215,9 +1456,34 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Call the student's realloc */
             oldp = trace->blocks[index];
-            setUBCheck(false);
-            newp = mm_realloc(oldp, size);
-            setUBCheck(true);
+            if (trace->handles[index] != NULL)
+            {
+                /* Handles have no realloc: move to a new block */
+                newp = NULL;
+                h = NULL;
+                if (size != 0)
+                {
+                    if ((h = mm_halloc(size)) == NULL)
+                    {
+                        malloc_error(trace, i, "mm_halloc failed.");
+                        return false;
+                    }
+                    newp = mm_hlock(h);
+                    mem_memcpy(newp, oldp,
+                               size < trace->block_sizes[index]
+                                   ? size
+                                   : trace->block_sizes[index]);
+                }
+                mm_hfree(trace->handles[index]);
+                trace->handles[index] = h;
+                compact = true;
+            }
+            else
+            {
+                setUBCheck(false);
+                newp = mm_realloc(oldp, size);
+                setUBCheck(true);
+            }
             if ((newp == NULL) && (size != 0))
             {
                 malloc_error(trace, i, "mm_realloc failed.");
@@ -1259,6 +1525,12 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
+
+            if (trace->handles[index] != NULL && !PINNED(index))
+            {
+                remove_range(ranges, newp);
+                mm_hunlock(trace->handles[index]);
+            }
             break;
 
         case FREE: /* mm_free */
@@ -1277,30 +1549,81 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (index >= 0 && trace->handles[index] != NULL)
+            {
+                mm_hfree(trace->handles[index]);
+                trace->handles[index] = NULL;
+                compact = true;
+            }
+            else
+                mm_free(p);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
+
+        /* Compact as eval_mm_util does, then check what may have moved */
+        if (compact && mm_compact(COMPACT_BUDGET) != 0 &&
+            !check_handles(trace, i, false))
+            allCheck = false;
     }
     /* As far as we know, this is a valid malloc package */
     return allCheck;
 }
 
+/*
+ * check_handles - Look every movable block up again through its handle,
+ *    as request opnum may have let mm_compact move it, and check the data
+ *    of those that moved, or of all of them if all is set.  A block that
+ *    stays locked (see PINNED) must be where it was.
+ */
+static bool check_handles(trace_t *trace, int opnum, bool all)
+{
+    int index;
+    bool ok = true;
+
+    for (index = 0; index < trace->num_ids; index++)
+    {
+        mm_handle_t h = trace->handles[index];
+        if (h == NULL)
+            continue;
+        char *p = mm_hlock(h);
+        if (PINNED(index) && p != trace->blocks[index])
+        {
+            malloc_error(trace, opnum, "locked block %d moved from %p to %p",
+                         index, trace->blocks[index], p);
+            ok = false;
+        }
+        if (all || p != trace->blocks[index])
+        {
+            trace->blocks[index] = p;
+            if (!check_index(trace, opnum, index))
+                ok = false;
+        }
+        mm_hunlock(h);
+    }
+    return ok;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. mem_sbrk() allows the students to trim the
+ *   heap, so the high water mark is taken from mem_peak_heapsize()
+ *   rather than the final brk.  With -R the heap starts without resident
+ *   pages, every payload is touched like a program using all of it would,
+ *   and hwm is also compared with the peak resident size of the heap.
+ *   The results go to stats->peak_rss and stats->rss_util.  With -m the
+ *   blocks marked movable are allocated through mm_halloc, and after each
+ *   free mm_compact slides them down by at most COMPACT_BUDGET bytes.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
@@ -1309,13 +1632,23 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     size_t total_size = 0;
     char *p;
     char *newp, *oldp;
+    mm_handle_t *handles = trace->handles;
+    mm_handle_t h;
+    size_t moved = 0;
 
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
+    mm_maintenance_stop();
     mem_reset_brk();
+    if (rss_mode)
+        mem_reset_resident();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    start_mm_options();
+
+    memset(dist_hist, 0, sizeof(dist_hist));
+    dist_last = NULL;
 
     for (i = 0; i < trace->num_ops; i++)
     {
@@ -1326,11 +1659,24 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL)
+            if (movable_mode && trace->ops[i].movable)
+            {
+                if ((handles[index] = mm_halloc(size)) == NULL)
+                    app_error("trace %d: mm_halloc failed in eval_mm_util",
+                              tracenum);
+                p = mm_hlock(handles[index]);
+            }
+            else if ((p = trace_malloc(&trace->ops[i])) == NULL)
             {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
+            if (locality_mode)
+                record_distance(p);
+            if (rss_mode)
+                touch_payload(p, size);
+            if (movable_mode && handles[index] != NULL)
+                mm_hunlock(handles[index]);
 
             /* Remember region and size */
             trace->blocks[index] = p;
@@ -1345,13 +1691,41 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             oldsize = trace->block_sizes[index];
 
             oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            if (movable_mode && handles[index] != NULL)
             {
-                app_error("trace %d: mm_realloc failed in eval_mm_util",
-                          tracenum);
+                /* Handles have no realloc: move to a new block */
+                newp = NULL;
+                h = NULL;
+                if (newsize != 0)
+                {
+                    if ((h = mm_halloc(newsize)) == NULL)
+                        app_error("trace %d: mm_halloc failed in "
+                                  "eval_mm_util", tracenum);
+                    newp = mm_hlock(h);
+                    mem_memcpy(newp, mm_hlock(handles[index]),
+                               oldsize < newsize ? oldsize : newsize);
+                }
+                mm_hfree(handles[index]);
+                handles[index] = h;
+                moved += mm_compact(COMPACT_BUDGET);
             }
-            setUBCheck(true);
+            else
+            {
+                setUBCheck(false);
+                if ((newp = mm_realloc(oldp, newsize)) == NULL &&
+                    newsize != 0)
+                {
+                    app_error("trace %d: mm_realloc failed in eval_mm_util",
+                              tracenum);
+                }
+                setUBCheck(true);
+            }
+            if (locality_mode && newp != NULL)
+                record_distance(newp);
+            if (rss_mode && newp != NULL)
+                touch_payload(newp, newsize);
+            if (movable_mode && handles[index] != NULL)
+                mm_hunlock(handles[index]);
 
             /* Remember region and size */
             trace->blocks[index] = newp;
@@ -1373,7 +1747,14 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (movable_mode && index >= 0 && handles[index] != NULL)
+            {
+                mm_hfree(handles[index]);
+                handles[index] = NULL;
+                moved += mm_compact(COMPACT_BUDGET);
+            }
+            else
+                mm_free(p);
 
             total_size -= size;
             break;
@@ -1392,7 +1773,179 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (rss_mode)
+    {
+        stats->peak_rss = mem_peak_resident_size();
+        stats->rss_util = (double)max_total_size / (double)stats->peak_rss;
+    }
+    if (movable_mode)
+    {
+        printf("\n%s: %zu bytes moved by mm_compact\n", trace->filename,
+               moved);
+    }
+    return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+/*
+ * touch_payload - Write a byte to every page of the payload at P, so that
+ *    the pages a program would fault in count towards the resident size.
+ */
+static void touch_payload(char *p, size_t size)
+{
+    size_t page = mem_pagesize();
+    char *end = p + size;
+    char *q;
+
+    if (size == 0)
+        return;
+    mem_write(p, 0, 1);
+    q = (char *)(((uintptr_t)p + page) & ~(uintptr_t)(page - 1));
+    for (; q < end; q += page)
+        mem_write(q, 0, 1);
+}
+
+/*
+ * record_distance - Add the distance between P and the payload returned by
+ *    the previous allocation to the locality histogram.
+ */
+static void record_distance(char *p)
+{
+    size_t dist, bucket = 0;
+
+    if (dist_last != NULL)
+    {
+        dist = (p > dist_last) ? (size_t)(p - dist_last)
+                               : (size_t)(dist_last - p);
+        if (dist > 1)
+            bucket = 64 - __builtin_clzl(dist - 1);
+        dist_hist[bucket]++;
+    }
+    dist_last = p;
+}
+
+/*
+ * print_locality - Summarize the histogram filled in by the last call to
+ *    eval_mm_util: the fraction of allocations that landed within a cache
+ *    line, a page and a huge page of the previous one, plus the median.
+ */
+static void print_locality(const trace_t *trace)
+{
+    /* Upper bucket of each printed range: 64 bytes, 4 KiB, 2 MiB */
+    static const int limits[] = {6, 12, 21};
+    size_t total = 0, cum = 0;
+    int i, j = 0, median = -1;
+
+    for (i = 0; i < DIST_BUCKETS; i++)
+        total += dist_hist[i];
+    if (total == 0)
+        return;
+
+    printf("\n%s: distance <=64B", trace->filename);
+    for (i = 0; i < DIST_BUCKETS; i++)
+    {
+        cum += dist_hist[i];
+        if (median < 0 && 2 * cum >= total)
+            median = i;
+        if (j < 3 && i == limits[j])
+        {
+            printf("%s %5.1f%%", j == 0 ? "" : j == 1 ? " <=4K" : " <=2M",
+                   100.0 * cum / total);
+            j++;
+        }
+    }
+    printf("  median <=2^%d\n", median);
+}
+
+/*
+ * count_tlb_misses - Run f(argp) once and return the number of user-mode
+ *    dTLB load misses it caused, or -1 if the counter is unavailable.
+ *    The number of minor page faults is returned in *faults.
+ */
+static long long count_tlb_misses(test_funct f, void *argp, long *faults)
+{
+    struct perf_event_attr attr;
+    struct rusage before, after;
+    long long count = -1;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+    getrusage(RUSAGE_SELF, &before);
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    f(argp);
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+        close(fd);
+    }
+    getrusage(RUSAGE_SELF, &after);
+    *faults = after.ru_minflt - before.ru_minflt;
+    return count;
+}
+
+/*
+ * start_mm_options - Turn on the optional parts of the mm package asked for
+ *    on the command line.  Called after every mm_init.
+ */
+static void start_mm_options(void)
+{
+    if (maintenance_mode && !mm_maintenance_start())
+        unix_error("mm_maintenance_start failed");
+    if (cpu_cache_mode && !mm_cpu_cache_start())
+    {
+        fprintf(stderr, "WARNING: restartable sequences unavailable, "
+                        "-K ignored\n");
+        cpu_cache_mode = false;
+    }
+}
+
+/*
+ * compare_tlb - Run the trace once on a fresh heap backed by base pages and
+ *    once on a fresh heap backed by huge pages, and print the dTLB misses
+ *    and page faults of each run.  Leaves a fresh heap set up as -P asks.
+ */
+static void compare_tlb(speed_t *speed_params)
+{
+    long long misses[2];
+    long faults[2];
+    int huge;
+
+    mm_maintenance_stop();
+    for (huge = 0; huge < 2; huge++)
+    {
+        mem_deinit();
+        mem_set_hugepages(huge);
+        mem_init(false);
+        misses[huge] =
+            count_tlb_misses(eval_mm_speed, speed_params, &faults[huge]);
+        mm_maintenance_stop();
+    }
+    mem_deinit();
+    mem_set_hugepages(hugepage_mode);
+    mem_init(false);
+
+    printf("\n%s: ", speed_params->trace->filename);
+    if (misses[0] < 0 || misses[1] < 0)
+        printf("dTLB misses n/a");
+    else
+        printf("dTLB misses 4K %lld THP %lld (%.2fx)", misses[0], misses[1],
+               misses[1] == 0 ? 0.0 : (double)misses[0] / misses[1]);
+    printf("  faults 4K %ld THP %ld\n", faults[0], faults[1]);
 }
 
 /*
@@ -1402,15 +1955,17 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 static void eval_mm_speed(void *ptr)
 {
     int i, index;
-    size_t size, newsize;
+    size_t newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
+    mm_maintenance_stop();
     mem_reset_brk();
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
+    start_mm_options();
 
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
@@ -1419,8 +1974,7 @@ static void eval_mm_speed(void *ptr)
 
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = trace_malloc(&trace->ops[i])) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -2013,5 +2567,20 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-L         Report address distance between "
+                    "consecutive allocations.\n");
+    fprintf(stderr, "\t-H         Pass lifetime hints to mm_malloc_hint "
+                    "(oracle hints if the trace has none).\n");
+    fprintf(stderr, "\t-m         Allocate movable blocks through handles "
+                    "and compact after frees.\n");
+    fprintf(stderr, "\t-P         Back the heap with transparent huge "
+                    "pages.\n");
+    fprintf(stderr, "\t-M         Compare dTLB misses with base pages and "
+                    "huge pages.\n");
+    fprintf(stderr, "\t-R         Report peak RSS and utilization relative "
+                    "to it.\n");
+    fprintf(stderr, "\t-B         Run the allocator's background maintenance "
+                    "thread.\n");
+    fprintf(stderr, "\t-K         Enable the allocator's per-CPU caches.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
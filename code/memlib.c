@@ -31,6 +31,27 @@
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *
+ * The dense heap reserves DENSE_HEAP_RESERVE bytes of address space with
+ *  PROT_NONE once, in mem_init.  mem_sbrk commits it with mprotect in
+ *  DENSE_COMMIT_CHUNK steps as the break grows, so most growth steps make no
+ *  system call, and trimming the heap far enough decommits the pages above
+ *  the break with MADV_DONTNEED.  Touching the heap beyond the committed
+ *  range faults.
+ *
+ * Resident heap bytes are counted per page: with mincore over the committed
+ *  range in dense mode, and as the number of emulation pages handed out in
+ *  sparse mode.  Pages only stop being resident when they are decommitted,
+ *  so sampling just before each decommit and when asked is enough to know
+ *  the peak exactly.
+ *
+ * The heap consists of up to HEAP_SEGMENTS segments.  The reservation is
+ *  divided into HEAP_SEGMENTS equal slots; each segment owns one slot, or as
+ *  many consecutive ones as it was created to hold, and has its own break, so
+ *  an allocator can keep independent heaps, or carry on in a fresh segment
+ *  when one cannot grow any further.  Segment 0 always exists, owns slot 0
+ *  and is what mem_sbrk extends.  mem_heap_lo and mem_heap_hi bound all
+ *  segments in use, gaps included.
  */
 #include <assert.h>
 #include <errno.h>
@@ -54,11 +75,27 @@ typedef struct MBLK
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A heap segment: one slot of the reserved heap with a break of its own */
+typedef struct
+{
+    unsigned char *lo;         /* Starting address of the segment */
+    unsigned char *brk;        /* Current position of its break */
+    unsigned char *max_addr;   /* Maximum allowable address in it */
+    unsigned char *commit_brk; /* End of its committed dense pages */
+} mem_segment_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
-static unsigned char *mem_brk;      /* Current position of break */
-static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static mem_segment_t segments[HEAP_SEGMENTS]; /* Slots of the heap */
+static int num_segments;            /* Segments in use, 1 after a reset */
+static size_t segment_span;         /* Size of one slot of the heap */
+static size_t mem_size;             /* Bytes below the breaks of all segments */
+static size_t mem_peak_size;        /* Largest mem_size since the last reset */
+static size_t mem_peak_rss;         /* Most resident heap bytes seen */
+static void *mmap_addr;             /* Address returned by mmap */
+static bool want_hugepages = false; /* Back the dense heap with huge pages? */
+static bool hugepages = false;      /* Is the current heap using huge pages */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -80,12 +117,24 @@ void setUBCheck(bool val)
     checkUB = val;
 }
 
+void mem_set_hugepages(bool val)
+{
+    want_hugepages = val;
+}
+
 /*
  * Forward declarations
  */
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static mem_segment_t *find_segment(const void *addr);
+static bool in_heap(const void *addr, size_t len);
+static bool commit_to(mem_segment_t *seg, unsigned char *addr);
+static void decommit_from(mem_segment_t *seg, unsigned char *addr);
+static void release_segment(mem_segment_t *seg);
+static size_t free_slots(size_t size);
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi);
 static void print_stats();
 
 /*
@@ -116,17 +165,34 @@ void mem_init(bool do_sparse)
         num_pages = 0;
         page_table = NULL;
         num_buckets = 0;
-        mmap_length = MAX_DENSE_HEAP;
+        mmap_length = DENSE_HEAP_RESERVE;
+        /* Over-reserve so that the heap can start on a huge page boundary */
+        if (want_hugepages)
+            mmap_length += HUGE_PAGE_SIZE;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    void *addr;
+    if (sparse)
+    {
+        int dev_zero = open("/dev/zero", O_RDWR);
+        addr = mmap(NULL,                   /* suggested start*/
+                    mmap_length,            /* length */
+                    PROT_READ | PROT_WRITE, /* permissions */
+                    MAP_PRIVATE,            /* private or shared? */
+                    dev_zero,               /* fd */
+                    0);                     /* offset */
+        close(dev_zero);
+    }
+    else
+    {
+        /* Only reserve the address space.  mem_sbrk commits it on demand */
+        addr = mmap(TRY_DENSE_HEAP_START,                       /* start */
+                    mmap_length,                                /* length */
+                    PROT_NONE,                                  /* perms */
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, /* flags */
+                    -1,                                          /* fd */
+                    0);                                          /* offset */
+    }
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
@@ -137,15 +203,35 @@ void mem_init(bool do_sparse)
         /* Use initial space for page table */
         page_table = (mem_block_t **)addr;
         heap = SPARSE_HEAP_START;
-        mem_max_addr = heap + MAX_SPARSE_HEAP;
+        segment_span = MAX_SPARSE_HEAP / HEAP_SEGMENTS;
     }
     else
     {
         heap = addr;
-        mem_max_addr = heap + MAX_DENSE_HEAP;
+        hugepages = false;
+        if (want_hugepages)
+        {
+            uintptr_t a = (uintptr_t)addr;
+            heap = (unsigned char *)((a + HUGE_PAGE_SIZE - 1) &
+                                     ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            hugepages = madvise(heap, DENSE_HEAP_RESERVE, MADV_HUGEPAGE) == 0;
+            if (!hugepages)
+                fprintf(stderr, "WARNING: madvise(MADV_HUGEPAGE) failed, "
+                                "using base pages\n");
+        }
+        segment_span = DENSE_HEAP_RESERVE / HEAP_SEGMENTS;
     }
+    mmap_addr = addr;
+    int i;
+    for (i = 0; i < HEAP_SEGMENTS; i++)
+    {
+        segments[i].lo = heap + i * segment_span;
+        segments[i].brk = segments[i].lo;
+        segments[i].max_addr = segments[i].lo + segment_span;
+        segments[i].commit_brk = segments[i].lo;
+    }
+    num_segments = 1;
     stats_printed = false;
-    mem_brk = heap;
     mem_reset_brk();
 }
 
@@ -155,7 +241,9 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
-    munmap(heap, mmap_length);
+    munmap(mmap_addr, mmap_length);
+    num_segments = 0;
+    hugepages = false;
     next_free_page = NULL;
     num_free_pages = 0;
     page_table = NULL;
@@ -164,6 +252,9 @@ void mem_deinit(void)
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * Only segment 0 stays in use.  The dense heap stays committed, so that
+ * running the same trace again (as the throughput measurement does) does not
+ * fault all of its pages back in.
  */
 void mem_reset_brk()
 {
@@ -177,47 +268,126 @@ void mem_reset_brk()
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
         num_free_pages = num_pages;
     }
-    mem_brk = heap;
+    int i;
+    for (i = 0; i < num_segments; i++)
+        segments[i].brk = segments[i].lo;
+    num_segments = 1;
+    mem_size = 0;
+    mem_peak_size = 0;
+    mem_peak_rss = 0;
+}
+
+/*
+ * mem_reset_resident - drop every page of an empty heap, so that resident
+ *                      accounting starts from zero as in a fresh process
+ */
+void mem_reset_resident()
+{
+    assert(mem_size == 0);
+    int i;
+    for (i = 0; !sparse && i < HEAP_SEGMENTS; i++)
+    {
+        mem_segment_t *seg = &segments[i];
+        if (seg->commit_brk > seg->lo)
+            madvise(seg->lo, seg->commit_brk - seg->lo, MADV_DONTNEED);
+    }
+    mem_peak_rss = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * The heap here is segment 0; see mem_segment_sbrk for the details.
  */
 void *mem_sbrk(intptr_t incr)
 {
-    unsigned char *old_brk = mem_brk;
+    return mem_segment_sbrk(0, incr);
+}
+
+/*
+ * mem_segment_create - start a new, empty segment after the ones in use that
+ *                      can grow to at least size bytes, and return its
+ *                      number, or -1 if the reservation has no room for it
+ * The segment takes as many free slots as size needs, at least one.  A
+ *  segment laid out differently than the last time its number was in use
+ *  gives back the pages still committed there, and so do the ones after it.
+ */
+int mem_segment_create(size_t size)
+{
+    size_t slots = free_slots(size);
+    if (slots == 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    mem_segment_t *seg = &segments[num_segments];
+    unsigned char *lo = segments[num_segments - 1].max_addr;
+    unsigned char *max_addr = lo + slots * segment_span;
+    if (seg->lo != lo || seg->max_addr != max_addr)
+    {
+        int i;
+        for (i = num_segments; i < HEAP_SEGMENTS; i++)
+            release_segment(&segments[i]);
+        seg->lo = lo;
+        seg->max_addr = max_addr;
+        seg->commit_brk = lo;
+    }
+    seg->brk = lo;
+    return num_segments++;
+}
+
+/*
+ * mem_segment_sbrk - extend segment seg by incr bytes and return the start
+ *                    address of the new area.
+ * A negative incr trims the top of the segment, but never below its start.
+ * Running out of room is only reported when a new segment could not hold
+ *  incr either, since an allocator carries on in one otherwise.
+ * The high water mark of the total heap size is remembered in mem_peak_size.
+ * The dense heap is committed before the break moves up and decommitted
+ * after it moves down.
+ */
+void *mem_segment_sbrk(int seg_id, intptr_t incr)
+{
+    assert(seg_id >= 0 && seg_id < num_segments);
+    mem_segment_t *seg = &segments[seg_id];
+    unsigned char *old_brk = seg->brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)(-incr) > (size_t)(seg->brk - seg->lo))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink segment %d by %ld "
+                "bytes below its start\n",
+                seg_id, (long)-incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (incr > 0 && (size_t)incr > (size_t)(seg->max_addr - seg->brk))
     {
         ok = false;
-        size_t alloc = mem_brk - heap + incr;
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed. Ran out of memory.  Would require "
-                "heap size of %zd (0x%zx) bytes\n",
-                alloc, alloc);
+        size_t alloc = seg->brk - seg->lo + incr;
+        if (free_slots(incr) == 0)
+            fprintf(stderr,
+                    "ERROR: mem_sbrk failed. Ran out of memory.  Would "
+                    "require segment %d size of %zd (0x%zx) bytes\n",
+                    seg_id, alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && !commit_to(seg, seg->brk + incr))
     {
         ok = false;
-        fprintf(
-            stderr,
-            "ERROR: mem_sbrk failed.  Could not allocate more heap space ( incr: %ld, sparse: %s )\n", incr, sparse == true ? "true" : "false");
+        fprintf(stderr,
+                "ERROR: mem_sbrk failed.  Could not commit more heap space "
+                "( incr: %ld, errno: %d )\n",
+                (long)incr, errno);
     }
 
     if (ok)
     {
-        mem_brk += incr;
+        seg->brk += incr;
+        mem_size += incr;
+        if (!sparse && incr < 0)
+            decommit_from(seg, seg->brk);
+        if (mem_size > mem_peak_size)
+            mem_peak_size = mem_size;
         return (void *)old_brk;
     }
     else
@@ -227,6 +397,19 @@ void *mem_sbrk(intptr_t incr)
     }
 }
 
+/*
+ * mem_purge - drop the pages in [addr, addr + len) of the dense heap, which
+ *             read as zero afterwards.  addr and len must be page aligned.
+ *             Sparse emulation cannot drop pages and returns false
+ */
+bool mem_purge(void *addr, size_t len)
+{
+    if (sparse || !in_heap(addr, len))
+        return false;
+    mem_peak_resident_size();
+    return madvise(addr, len, MADV_DONTNEED) == 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -236,19 +419,93 @@ void *mem_heap_lo()
 }
 
 /*
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the last segment
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(segments[num_segments - 1].brk - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all segments
  */
 size_t mem_heapsize()
 {
-    return (size_t)(mem_brk - heap);
+    return mem_size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since the
+ *                       last reset, i.e. the high water mark of mem_size
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak_size;
+}
+
+/*
+ * mem_segment_count() - returns the number of segments in use
+ */
+int mem_segment_count()
+{
+    return num_segments;
+}
+
+/*
+ * mem_segment_lo() - returns the address of the first byte of a segment
+ */
+void *mem_segment_lo(int seg_id)
+{
+    assert(seg_id >= 0 && seg_id < num_segments);
+    return (void *)segments[seg_id].lo;
+}
+
+/*
+ * mem_segment_hi() - returns the address of the last byte of a segment
+ */
+void *mem_segment_hi(int seg_id)
+{
+    assert(seg_id >= 0 && seg_id < num_segments);
+    return (void *)(segments[seg_id].brk - 1);
+}
+
+/*
+ * mem_segment_of() - returns the number of the segment holding addr below
+ *                    its break, or -1 if addr is not in any of them
+ */
+int mem_segment_of(const void *addr)
+{
+    mem_segment_t *seg = find_segment(addr);
+    if (seg == NULL || (unsigned char *)addr >= seg->brk)
+        return -1;
+    return (int)(seg - segments);
+}
+
+/*
+ * mem_resident_size() - returns the number of heap bytes currently
+ *                       resident in memory, counted in whole pages
+ */
+size_t mem_resident_size()
+{
+    if (sparse)
+        return (num_pages - num_free_pages) * SPARSE_PAGE_SIZE;
+    size_t rss = 0;
+    int i;
+    for (i = 0; i < HEAP_SEGMENTS; i++)
+        rss += resident_bytes(segments[i].lo, segments[i].commit_brk);
+    return rss;
+}
+
+/*
+ * mem_peak_resident_size() - returns the largest number of resident heap
+ *                            bytes since the last reset
+ */
+size_t mem_peak_resident_size()
+{
+    size_t rss = mem_resident_size();
+    if (rss > mem_peak_rss)
+        mem_peak_rss = rss;
+    return mem_peak_rss;
 }
 
 /*
@@ -259,6 +516,15 @@ size_t mem_pagesize()
     return (size_t)getpagesize();
 }
 
+/*
+ * mem_hugepagesize() - returns the huge page size backing the heap, or 0
+ *                      if the heap uses base pages
+ */
+size_t mem_hugepagesize()
+{
+    return hugepages ? HUGE_PAGE_SIZE : 0;
+}
+
 /*************** Memory emulation  *******************/
 
 __int128 mem_read128(const void *addr)
@@ -279,8 +545,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && in_heap(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -323,8 +588,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && in_heap(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -455,12 +719,18 @@ static void print_stats()
         printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
                "(%.4f%% density).  Max address = %p\n",
                ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes,
-               mem_brk);
+               segments[num_segments - 1].brk);
     }
     else
     {
-        printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
-               mem_brk);
+        size_t committed = 0;
+        int i;
+        for (i = 0; i < HEAP_SEGMENTS; i++)
+            committed += segments[i].commit_brk - segments[i].lo;
+        printf("Allocated %zu heap bytes (%zu committed) in %d segment(s).  "
+               "Max address = %p\n",
+               vbytes, committed, num_segments,
+               segments[num_segments - 1].brk);
     }
     stats_printed = true;
 }
@@ -479,6 +749,117 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/* Find the segment whose slots contain addr, or NULL if there is none */
+static mem_segment_t *find_segment(const void *addr)
+{
+    const unsigned char *a = (const unsigned char *)addr;
+    int i;
+    for (i = 0; i < num_segments; i++)
+        if (a >= segments[i].lo && a < segments[i].max_addr)
+            return &segments[i];
+    return NULL;
+}
+
+/* Check that [addr, addr + len) lies below the break of a single segment */
+static bool in_heap(const void *addr, size_t len)
+{
+    mem_segment_t *seg = find_segment(addr);
+    return seg != NULL && (const unsigned char *)addr + len <= seg->brk;
+}
+
+/* Round an address in a dense segment up to a commit chunk boundary */
+static unsigned char *chunk_round_up(mem_segment_t *seg, unsigned char *addr)
+{
+    size_t offset = addr - seg->lo;
+    offset = (offset + DENSE_COMMIT_CHUNK - 1) &
+             ~(size_t)(DENSE_COMMIT_CHUNK - 1);
+    return seg->lo + offset;
+}
+
+/* Commit whole chunks of a dense segment so that it is accessible up to addr */
+static bool commit_to(mem_segment_t *seg, unsigned char *addr)
+{
+    if (addr <= seg->commit_brk)
+        return true;
+    unsigned char *end = chunk_round_up(seg, addr);
+    if (end > seg->max_addr)
+        end = seg->max_addr;
+    if (mprotect(seg->commit_brk, end - seg->commit_brk,
+                 PROT_READ | PROT_WRITE) != 0)
+        return false;
+    seg->commit_brk = end;
+    return true;
+}
+
+/*
+ * Give the pages of a dense segment above addr back to the kernel.  The first
+ *  DENSE_DECOMMIT_SLACK bytes above the break stay committed, so that a heap
+ *  that trims and grows again does not pay for refaulting them every time.
+ *  If decommitting fails the pages simply stay committed.
+ */
+static void decommit_from(mem_segment_t *seg, unsigned char *addr)
+{
+    unsigned char *keep = chunk_round_up(seg, addr) + DENSE_DECOMMIT_SLACK;
+    if (keep >= seg->commit_brk)
+        return;
+    size_t len = seg->commit_brk - keep;
+    mem_peak_resident_size();
+    if (madvise(keep, len, MADV_DONTNEED) == 0 &&
+        mprotect(keep, len, PROT_NONE) == 0)
+        seg->commit_brk = keep;
+}
+
+/*
+ * Number of slots a new segment holding size bytes takes, or 0 if all
+ *  segments are in use or the slots left cannot hold it
+ */
+static size_t free_slots(size_t size)
+{
+    unsigned char *end = heap + HEAP_SEGMENTS * segment_span;
+    unsigned char *lo = segments[num_segments - 1].max_addr;
+    size_t slots = size == 0 ? 1 : (size - 1) / segment_span + 1;
+    if (num_segments == HEAP_SEGMENTS ||
+        slots > (size_t)(end - lo) / segment_span)
+        return 0;
+    return slots;
+}
+
+/*
+ * Give back all committed pages of a dense segment that is not in use, so
+ *  that its slots can be laid out again.  If that fails the pages stay
+ *  committed and are only counted as resident.
+ */
+static void release_segment(mem_segment_t *seg)
+{
+    if (seg->commit_brk == seg->lo)
+        return;
+    size_t len = seg->commit_brk - seg->lo;
+    madvise(seg->lo, len, MADV_DONTNEED);
+    mprotect(seg->lo, len, PROT_NONE);
+    seg->commit_brk = seg->lo;
+}
+
+/* Count the resident bytes in [lo, hi), a page-aligned part of the heap */
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi)
+{
+    static unsigned char vec[4096];
+    size_t page = mem_pagesize();
+    size_t pages = 0;
+    while (lo < hi)
+    {
+        size_t len = (size_t)(hi - lo);
+        if (len > sizeof(vec) * page)
+            len = sizeof(vec) * page;
+        if (mincore(lo, len, vec) != 0)
+            break;
+        size_t i;
+        for (i = 0; i < len / page; i++)
+            pages += vec[i] & 1;
+        lo += len;
+    }
+    return pages * page;
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite)
 {
@@ -24,15 +24,56 @@ void mem_deinit(void);
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative `incr`
+ * trims the top of the heap; the heap can never shrink below its start.
+ * The dense heap lives in a PROT_NONE reservation that is committed as the
+ * break grows, so only the bytes below the break may be touched.
  *
- * @param[in] incr The amount of bytes by which to extend the heap
+ * This is the same as `mem_segment_sbrk(0, incr)`.
+ *
+ * @param[in] incr The amount of bytes by which to extend (or trim) the heap
  * @return The start address of the new heap area (i.e. the previous break point)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Starts a new, empty heap segment that can grow to at least size
+ *        bytes.
+ *
+ * Segments are numbered in the order they are created, starting with
+ * segment 0, which always exists. Each one lies above the previous ones and
+ * grows independently of them, but never into the next one. A segment takes
+ * one slot of the reserved heap, or as many consecutive slots as size needs.
+ * mem_reset_brk() drops all segments but segment 0.
+ *
+ * @param[in] size The least number of bytes the segment must be able to hold
+ * @return The number of the new segment, or -1 if HEAP_SEGMENTS are in use
+ *         or the remaining slots cannot hold size bytes
+ */
+int mem_segment_create(size_t size);
+
+/**
+ * @brief Extends one heap segment by incr bytes, like mem_sbrk().
+ * @param[in] seg  The number of the segment
+ * @param[in] incr The amount of bytes by which to extend (or trim) it
+ * @return The previous break point of the segment, or `(void *)-1` if the
+ *         segment cannot grow that far
+ */
+void *mem_segment_sbrk(int seg, intptr_t incr);
+
+/**
+ * @brief Gives the pages of a part of the heap back to the system.
+ *
+ * The pages read as zero afterwards. The peak resident size is sampled
+ * first, so that mem_peak_resident_size() still sees them.
+ *
+ * @param[in] addr Start of the range, aligned to mem_pagesize()
+ * @param[in] len  Length of the range, a multiple of mem_pagesize()
+ * @return Whether the pages were dropped; always false in sparse emulation
+ */
+bool mem_purge(void *addr, size_t len);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
@@ -49,6 +90,8 @@ void *mem_heap_lo(void);
  *
  * Note that this address may not be aligned: if the heap is 8 bytes large,
  * then the value returned will be 7 bytes from the start of the heap.
+ * With several segments it lies in the last one, and the gaps between the
+ * segments are not valid even though they are between the two bounds.
  *
  * @return The address of the last valid byte in the heap.
  */
@@ -56,16 +99,89 @@ void *mem_heap_hi(void);
 
 /**
  * @brief Returns the number of bytes being used by the heap.
- * @return The size of the heap, in bytes
+ * @return The size of the heap summed over all segments, in bytes
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the number of heap segments in use.
+ * @return The number of segments, at least 1
+ */
+int mem_segment_count(void);
+
+/**
+ * @brief Finds the low address of a heap segment.
+ * @param[in] seg The number of the segment
+ * @return The address of the first byte of the segment
+ */
+void *mem_segment_lo(int seg);
+
+/**
+ * @brief Finds the high address of a heap segment.
+ * @param[in] seg The number of the segment
+ * @return The address of the last valid byte of the segment, which is one
+ *         below mem_segment_lo() if the segment is empty
+ */
+void *mem_segment_hi(int seg);
+
+/**
+ * @brief Finds the heap segment that holds an address.
+ * @param[in] addr Any address
+ * @return The number of the segment in which addr is valid, or -1 if there
+ *         is none
+ */
+int mem_segment_of(const void *addr);
+
+/**
+ * @brief Returns the largest size the heap has reached since the last reset.
+ *
+ * Trimming with a negative mem_sbrk() lowers mem_heapsize() but not this.
+ *
+ * @return The high water mark of the heap, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
+/**
+ * @brief Returns the number of heap bytes resident in memory.
+ *
+ * Counted in whole pages, including committed pages above the break.
+ *
+ * @return The resident size of the heap, in bytes
+ */
+size_t mem_resident_size(void);
+
+/**
+ * @brief Returns the largest resident size of the heap since the last reset.
+ * @return The peak resident size of the heap, in bytes
+ */
+size_t mem_peak_resident_size(void);
+
+/**
+ * @brief Drops all pages of the heap so that its resident size is zero.
+ *
+ * Unlike mem_reset_brk(), which keeps the pages for the next run, this
+ * makes the next run start out like a fresh process.
+ *
+ * @pre The heap is empty, i.e. mem_reset_brk() was just called
+ */
+void mem_reset_resident(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
  */
 size_t mem_pagesize(void);
 
+/**
+ * @brief Returns the size of the huge pages backing the heap.
+ *
+ * The heap then starts on a boundary of this size, so allocators can align
+ * large blocks to it.
+ *
+ * @return The huge page size in bytes, or 0 if the heap uses base pages
+ */
+size_t mem_hugepagesize(void);
+
 
 /* Functions used for memory emulation */
 
@@ -117,3 +233,9 @@ void hprobe(void *ptr, int offset, size_t count);
  * @brief Set whether the driver should check for UB
  */
 void setUBCheck(bool);
+
+/**
+ * @brief Set whether later calls to mem_init() back the dense heap with
+ * transparent huge pages (madvise(MADV_HUGEPAGE))
+ */
+void mem_set_hugepages(bool);
@@ -6,9 +6,13 @@
  *
  * Segregate List实现：
  *
- * Placement policy：best fit
+ * Placement policy：best fit，大小相同时选择离该链表rover最近的Block
+ * Lifetime hint：长生命周期对象（MM_LONG_LIVED）位于单独的Region，
+ *                拥有自己的Segregate List，不与其他Region的Block合并
  * Splitting policy：不少于最小块的大小即可
  * Coalescing policy：immediate coalesce
+ * Per-CPU cache：可选，小Block经由当前CPU的cache分配和释放（rseq）
+ * Locking：每个链表一把锁，较小Block的分配不获取heap_lock，见malloc_list
  * Insertion policy：LIFO & Address order
  * Eliminating Footers：yes
  *
@@ -25,15 +29,31 @@
  * @author Your Name <andrewid@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+/** @brief 能否借助glibc注册的restartable sequence实现per-CPU cache */
+#define CPU_CACHE_RSEQ 1
+#else
+#define CPU_CACHE_RSEQ 0
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -51,6 +71,18 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+/* interposition构建额外提供的函数在mdriver中同样使用mm_前缀 */
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define malloc_usable_size mm_malloc_usable_size
+#define free_sized mm_free_sized
+#define free_aligned_sized mm_free_aligned_sized
+#endif
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -81,32 +113,63 @@
 /* Basic constants */
 
 typedef uint64_t word_t;
+typedef uint32_t tag_t;
 typedef uint8_t byte_t;
 
 /** @brief 用于作为链表末尾的标识符，链表最后一个元素的next字段是这个东西 */
 #define END_OF_LIST ((void *)~0x0)
 
+/**
+ * @brief 压缩链接中END_OF_LIST的编码，END_OF_LIST的低32 Bit恰好也是它，
+ * 因此两种链接模式下都可以直接用END_OF_LIST初始化链表头节点
+ */
+#define NARROW_END_OF_LIST UINT32_MAX
+
 /** @brief 一个Cluster中Cluster Block的数目 */
 #define CLUSTER_BLOCK_COUNT 6
 
-/** @brief Word and header size (bytes) */
+/** @brief Word size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
+/** @brief Header and footer size (bytes) */
+static const size_t tag_size = sizeof(tag_t);
+
 /** @brief Double word size (bytes) */
 static const size_t dsize = 2 * wsize;
 
 /** @brief Minimum block size (bytes)
  *
- * header + prev pointer + next pointer + footer
- * 不允许Payload为0
+ * header + 压缩的next & prev（narrow_elem_t），还剩下4 Byte
+ * 不允许Payload为0；这样大小的Free Block没有Footer，
+ * 由后一个Block Header中的front tiny bit标识
  */
-static const size_t min_block_size = 4 * wsize;
+static const size_t min_block_size = dsize;
 
 /**
  * @brief header
  *
  */
-static const size_t overhead_size = wsize;
+static const size_t overhead_size = tag_size;
+
+/**
+ * @brief Huge Block的header：tag + 64 Bit的size + 对齐用的空隙 + 位于Payload
+ * 之前、只有huge bit的标记，Payload因此依然对齐16 Byte
+ *
+ */
+static const size_t huge_overhead_size = dsize + tag_size;
+
+/**
+ * @brief 压缩链接保存的是相对heap_meta的偏移右移这么多位，即16 Byte粒度
+ *
+ */
+static const uint8_t narrow_link_shift = 4;
+
+/**
+ * @brief 压缩链接可以表示的最大偏移（不含），约64 GiB，
+ * 堆超过这个大小之后切换为宽链接，见widen_links
+ */
+static const size_t narrow_link_range = (size_t)NARROW_END_OF_LIST
+                                        << narrow_link_shift;
 
 /**
  * sbrk一次移动的最小长度，现在是4KB
@@ -116,6 +179,114 @@ static const size_t overhead_size = wsize;
  */
 static const size_t chunksize = (1 << 12);
 
+/**
+ * @brief extend_heap单次增长量的上限
+ *
+ * 增长量从chunksize开始，每次因find_fit失败而拓展堆时翻倍，直到此上限
+ */
+static const size_t max_extend_size = (1 << 18);
+
+/**
+ * @brief 单次增长量同时不超过当前堆大小的 1 / 2^extend_heap_shift，
+ * 以免小堆在起步阶段一次拓展过多的空间
+ */
+static const uint8_t extend_heap_shift = 5;
+
+/**
+ * @brief 增长级别的上限，chunksize << max_extend_level == max_extend_size
+ */
+static const uint8_t max_extend_level = 6;
+
+/**
+ * @brief 每一个增长级别对应的extend_credit，也即free多少次之后下降一级
+ */
+static const uint8_t extend_credit_shift = 4;
+
+/**
+ * @brief 堆顶的Free Block不小于此大小时，将其多余的部分归还给memlib
+ *
+ * 取max_extend_size的两倍，避免在拓展与归还之间来回抖动
+ */
+static const size_t trim_threshold = 2 * max_extend_size;
+
+/**
+ * @brief 不小于此大小的Free Block才会被purge，这样的Block放得下
+ * dirty_elem_t，并且至少包含一个完整的页面
+ */
+static const size_t purge_min_size = 2 * (1 << 12);
+
+/**
+ * @brief Block进入dirty list之后，至少再经过这么多次free才会被purge
+ *
+ * 短暂释放随即又被分配出去的Block不会被purge，以免反复缺页；
+ * 取1 << 12时syn-array因为反复purge和缺页而慢了数倍
+ */
+static const word_t purge_decay = 1 << 16;
+
+/**
+ * @brief 每次free最多purge多少个Block，限制单次free的工作量
+ */
+static const uint8_t purge_batch = 1;
+
+/**
+ * @brief 后台维护线程每隔这么多纳秒尝试一次获取heap_lock，见maintainer_main
+ */
+static const long maintain_interval = 1000 * 1000;
+
+/**
+ * @brief 后台维护线程落后超过这么多次free时，free不再把trim和purge留给它，
+ * 而是像没有后台线程时一样自己完成
+ */
+static const word_t maintain_lag = 1 << 16;
+
+/**
+ * @brief 各CPU的cache与depot每交换这么多次magazine，或者cache每这么多次
+ * 未能满足分配，就把depot中工作集之外的magazine归还给list_table，
+ * 见reclaim_depot
+ */
+static const word_t depot_interval = 1 << 8;
+
+/**
+ * @brief cache未能满足分配时，malloc_refill在同一次heap_lock之内额外
+ * 取出这么多个同一大小类的Payload装入cache
+ *
+ * @note 只取半个magazine：装入cache的Payload在堆中依然是已分配的
+ */
+static const uint32_t refill_count = 8;
+
+/**
+ * @brief depot中每个大小类最多保留这么多个装满的magazine，再多时
+ * cpu_cache_unload直接把cache中的Payload释放回list_table
+ *
+ * @note 只靠reclaim_depot时，一长串free在两次reclaim之间最多能压入
+ * depot_interval个magazine，这些Payload无法合并，会抬高堆的峰值
+ */
+static const uint32_t depot_full_max = 2;
+
+/**
+ * @brief depot栈顶指针中版本号的起始Bit，用户空间的地址不超过47 Bit
+ *
+ * @note 每次压入或者弹出都增加版本号，以免比较交换遇到ABA问题
+ */
+static const uint8_t depot_tag_shift = 48;
+
+/**
+ * @brief 是否总是获取heap_lock：interposition构建会被多个线程调用，
+ * mdriver则只在后台维护线程运行时才需要
+ */
+#ifdef DRIVER
+static const bool always_lock = false;
+#else
+static const bool always_lock = true;
+#endif
+
+/**
+ * @brief find_near_fit在链表头部最多检查多少个Block
+ *
+ * 只在这些Block之中按照与rover的距离挑选，以免为了局部性遍历整个链表
+ */
+static const uint8_t near_fit_window = 8;
+
 /**
  * @brief cluster 整体的大小
  *
@@ -144,42 +315,91 @@ static const uint8_t flag_bit_count = 4;
  * @brief Header中被用作size字段的Bit的开始位置n
  *
  */
-static const uint8_t size_bit_count = 64 - flag_bit_count;
+static const uint8_t size_bit_count = 32 - flag_bit_count;
 
 /**
- * @brief Cluster Block Header中被用作num字段的Bit的开始位置
+ * @brief Cluster Block标记中num字段的开始位置，与front tiny bit、front alloc
+ * bit以及alloc bit重叠，但避开了huge bit
  *
  */
-const uint8_t num_bit_count = size_bit_count - flag_bit_count;
+static const uint8_t num_bit_count = size_bit_count - 1;
+
+/**
+ * @brief Cluster Block的Header是一个Word，其高32 Bit恰好位于Payload之前，
+ * 可以当成tag_t读取
+ *
+ */
+static const uint8_t cluster_tag_shift = 32;
 
 /**
  * @brief Flag字段的低位（0），用于计算当前Block是否被分配
  */
-static const word_t alloc_mask = (word_t)0x1 << size_bit_count;
+static const tag_t alloc_mask = (tag_t)0x1 << size_bit_count;
 
 /**
  * @brief Flag字段的低位（1），用于计算当前Block之前的Block是否被分配
  *
  */
-static const word_t front_alloc_mask = (word_t)0x2 << size_bit_count;
+static const tag_t front_alloc_mask = (tag_t)0x2 << size_bit_count;
 
 /**
  * @brief Flag字段中第三位的掩码
  *
  */
-static const word_t cluster_mask = (word_t)0x4 << size_bit_count;
+static const tag_t cluster_mask = (tag_t)0x4 << size_bit_count;
+
+/**
+ * @brief Flag字段中第四位的掩码，标识Block所属的Region
+ *
+ */
+static const tag_t region_mask = (tag_t)0x8 << size_bit_count;
+
+/**
+ * @brief Size字段的最高位，标识前一个Block是大小为min_block_size的Free
+ * Block，此时前一个Block没有Footer
+ *
+ * @note 只有在front alloc bit为0时才有意义
+ */
+static const tag_t front_tiny_mask = (tag_t)0x1 << num_bit_count;
+
+/**
+ * @brief Size字段的次高位，标识Block大小超出了size_field_mask的表示范围，
+ * 真正的大小是紧随Header之后的一个Word，见huge_overhead_size
+ *
+ */
+static const tag_t huge_mask = front_tiny_mask >> 1;
 
 /**
- * @brief word最后一个Byte的前四个Bit的mask
+ * @brief 普通Header中真正的Size字段（右移了flag_bit_count位）
  *
  */
-static const word_t cluster_num_mask = (word_t)0xF << num_bit_count;
+static const tag_t size_field_mask = huge_mask - 1;
+
+/**
+ * @brief 可以直接保存在32 Bit Header中的最大Block，约1 GiB
+ *
+ */
+static const size_t max_normal_size = (size_t)size_field_mask
+                                      << flag_bit_count;
+
+/**
+ * @brief Cluster Block标记中num字段的mask
+ *
+ */
+static const tag_t cluster_num_mask = (tag_t)0x7 << num_bit_count;
+
+/**
+ * @brief Cluster Block 0的Header中低56 Bit用于保存链表的prev，
+ * 最高的Byte是Cluster Block的标记
+ *
+ */
+static const word_t cluster_prev_mask = ~(word_t)0 >> 8;
 
 /**
  * @brief Cluster中六个Cluster Block的分配情况Bit
  *
  */
-static const word_t cluster_alloc_field_mask = 0x000000000000003F;
+static const tag_t cluster_alloc_field_mask = 0x0000003F;
 
 /**
  * @brief Flag field为word的最后四个Bit
@@ -198,9 +418,6 @@ static const word_t low_four_bit_mask = (word_t)0xF;
  */
 // static const word_t size_mask = ~flag_field_mask;
 
-/** @brief 用于定位ASIZE中间8（0~255）位的掩码（需要先进行移动位置操作）*/
-static const uint8_t group_mask = 0xFF;
-
 /** @brief 从Header的第一个Byte开始，每一个Bit对应一个Cluster Block的分配情况 */
 #define CLUSTER_B1 0x0000000000000001
 #define CLUSTER_B2 0x0000000000000002
@@ -239,84 +456,69 @@ static const uint8_t cluster_alloc_to_bit_count[] = {
     3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4,
     3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6};
 
-#define G_EMPTY 255
+/**
+ * @brief 大小为min_block_size的Free Block所在的链表
+ *
+ * @note 宽链接模式下这些Block只放得下next，因此这个链表退化为单向链表
+ */
 #define G_16 0
-#define G_32 1
-#define G_48 2
-#define G_64 3
-#define G_128 4
-#define G_192 5
-#define G_256 6
-#define G_384 7
-#define G_512 8
-#define G_1024 9
-#define G_1536 10
-#define G_2048 11
-#define G_4096 12
-#define G_INF 13
-
-/** @brief 如果ASIZE比这个数大，那么该Block就有多种不同大小的Block */
-#define MAX_SINGLE_BLOCK_GROUP 64
-#define MAX_BLOCK_GROUP 4096
-
-/**
- * @brief ASIZE与list_table的INDEX之间映射的数组，
- *        映射完毕后可以在list_table寻址对应list的root
- *
- * @note 执行映射操作之前需要先查看ASIZE是不是大于1024。
- *       ASIZE必须对齐16Byte之后截取高4位之后的五位数字（0~63），
- *       左移4位，再到数组中进行寻址
- *
- * @par 数组中各下标含有如下内容：
- * + 0：asize = 4096，为G_4096；
- * + 1：asize = 16，为G_16；
- * + 2：asize = 32，为G_32；
- * + 3：asize = 48，为G_48；
- * + 4：asize = 64，为G_64；
- * + 5 ~ 8：asize = (64, 128]，为G_128；
- * + 9 ~ 12：asize = (128, 192]，为G_192；
- * + 13 ~ 16：asize = (192, 256]，为G_256；
- * + 17 ~ 24：asize = (256, 384]，为G_384；
- * + 25 ~ 32：asize = (384, 512]，为G_512；
- * + 33 ~ 64：asize = (768, 1024]，为G_1024；
- * + 65 ~ 96：asize = (1024, 1536]，为G_1536；
- * + 97 ~ 128：asize = (1536, 2048]，为G_2048；
- * + 129 ~ 255：asize = (2048, 4096)，为G_4096；
- *
- */
-static const uint8_t asize_to_index[] = {
-    G_4096, G_16,   G_32,   G_48,   G_64,   G_128,  G_128,  G_128,  G_128,
-    G_192,  G_192,  G_192,  G_192,  G_256,  G_256,  G_256,  G_256,  G_384,
-    G_384,  G_384,  G_384,  G_384,  G_384,  G_384,  G_384,  G_512,  G_512,
-    G_512,  G_512,  G_512,  G_512,  G_512,  G_512,  G_1024, G_1024, G_1024,
-    G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024,
-    G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024,
-    G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024, G_1024,
-    G_1024, G_1024, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536,
-    G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536,
-    G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536,
-    G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_1536, G_2048, G_2048,
-    G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048,
-    G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048,
-    G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048, G_2048,
-    G_2048, G_2048, G_2048, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096, G_4096,
-    G_4096, G_4096, G_4096, G_4096};
-
-static const uint16_t index_to_asize[] = {128, 32,  48,   64,   128,  192, 256,
-                                          384, 512, 1024, 1536, 2048, 4096};
+
+/**
+ * @brief 精确链表的数目，每个链表只容纳一种大小的Block，
+ * 也即16 Byte ~ 1024 Byte，每16 Byte一个
+ *
+ * @note Cluster不在Segregate List中，而是按占用数目位于cluster_table中
+ */
+#define EXACT_LIST_COUNT 64
+
+/** @brief ASIZE不大于这个数的Block都位于精确链表中 */
+#define MAX_EXACT_BLOCK_GROUP 1024
+
+/* mm_const.h在编译期按照mm.h中的这些常量计算大小类 */
+_Static_assert(MAX_EXACT_BLOCK_GROUP == MM_MAX_EXACT_BLOCK,
+               "mm.h disagrees on the exact lists");
+_Static_assert(sizeof(tag_t) == MM_BLOCK_OVERHEAD,
+               "mm.h disagrees on the header size");
+_Static_assert(2 * sizeof(word_t) == MM_BLOCK_ALIGN,
+               "mm.h disagrees on the block alignment");
+
+/**
+ * @brief 各Region的Segregate List数目：64个精确链表，之后每个2的幂次之间
+ * 等分为4个链表，(192 KiB, 224 KiB]是最后一个有上限的链表，G_INF容纳
+ * 所有大于224 KiB的Block
+ */
+#define LIST_TABLE_SIZE 96
+
+/** @brief 大小没有上限的链表 */
+#define G_INF (LIST_TABLE_SIZE - 1)
+
+/** @brief 每个Region用于标识链表是否为空的Bitmap所占的word数目 */
+#define LIST_MAP_WORDS ((LIST_TABLE_SIZE + 63) / 64)
+
+/** @brief log2(MAX_EXACT_BLOCK_GROUP)，对数链表从这个幂次开始 */
+static const uint8_t exact_group_shift = 10;
+
+/** @brief 每个2的幂次之间等分为 2^log_group_split 个链表 */
+static const uint8_t log_group_split = 2;
+
+/** @brief 默认的Region，未提供hint以及MM_SHORT_LIVED的对象位于此处 */
+#define REGION_SHORT 0
+/** @brief MM_LONG_LIVED的对象所在的Region */
+#define REGION_LONG 1
+/** @brief Region的数目，每个Region都有一组自己的Segregate List */
+#define REGION_COUNT 2
+
+/**
+ * @brief per-CPU cache的大小类数目：0号类缓存Cluster Block，第K号类缓存
+ * K * 16 Byte的普通Block，也即不大于256 Byte的Block
+ */
+#define CPU_CACHE_CLASS_COUNT 17
+
+/** @brief 每个CPU的每个大小类最多缓存多少个Payload */
+#define CPU_CACHE_DEPTH 16
+
+/** @brief mm_compact每一批按地址排序处理的Handle数目 */
+#define COMPACT_BATCH_SIZE 64
 
 typedef struct list_elem {
   /** @brief 指向free list中后一个block的指针 */
@@ -325,10 +527,181 @@ typedef struct list_elem {
   struct list_elem *prev;
 } list_elem_t;
 
+/**
+ * @brief 压缩链接模式下的链表节点，与list_elem_t位于同一位置，只占8 Byte
+ *
+ * @par next和prev是目标节点相对heap_meta的偏移，以16 Byte为单位，
+ * 链表节点（Payload）以及链表头节点都是双字对齐的，因此不会损失精度；
+ * 只能通过get_next等函数访问
+ */
+typedef struct narrow_elem {
+  /** @brief 后一个节点的偏移，NARROW_END_OF_LIST表示链表末尾 */
+  uint32_t next;
+  /** @brief 前一个节点的偏移 */
+  uint32_t prev;
+} narrow_elem_t;
+
+/**
+ * @brief 不小于purge_min_size的Free Block中的第二个节点，位于Body之后
+ * dsize处，跳过宽链接的list_elem_t，将尚未purge的Block按照释放的先后
+ * 串成dirty list
+ *
+ * @note next为NULL代表Block已经purge，deduce_purge_range中的页面都是0；
+ * 只有位于链表中的Free Block的dirty_elem_t才有意义
+ */
+typedef struct dirty_elem {
+  /** @brief 更晚释放的Block，总是宽指针 */
+  struct dirty_elem *next;
+  /** @brief 更早释放的Block */
+  struct dirty_elem *prev;
+  /** @brief Block进入dirty list时的purge_clock */
+  word_t stamp;
+} dirty_elem_t;
+
+/**
+ * @brief Segregate List的头节点，占16 Byte以保证每个头节点都是双字对齐的，
+ * 这样压缩链接也可以指向它
+ */
+typedef struct list_root {
+  /**
+   * @brief 只有next半边的虚拟list_elem_t，宽链接占满这个字段，
+   * 压缩链接只使用其低32 Bit
+   */
+  list_elem_t *head;
+
+  /**
+   * @brief 该链表的roving pointer，指向该链表最近一次放置的Block的末尾，
+   * 也即紧随其后的下一个Block可能出现的位置
+   *
+   * @note 只作为find_near_fit的距离参照，不会被解引用，因此无需在Block
+   * 合并或者trim_heap之后更新
+   */
+  void *rover;
+} list_root_t;
+
+/**
+ * @brief 一个CPU的free object cache，只缓存REGION_SHORT中的小Block
+ *
+ * @par 缓存中的Payload在堆中依然是已分配的，对于堆的其余部分而言与用户
+ * 持有的Block没有区别；count和slot只在restartable sequence中读写，
+ * 见cpu_cache_pop
+ */
+typedef struct cpu_cache {
+  /** @brief 每个大小类缓存的Payload数目 */
+  uint32_t count[CPU_CACHE_CLASS_COUNT];
+  /** @brief 每个大小类缓存的Payload，作为栈使用 */
+  void *slot[CPU_CACHE_CLASS_COUNT][CPU_CACHE_DEPTH];
+} cpu_cache_t;
+
+/**
+ * @brief 一个magazine：装着CPU_CACHE_DEPTH个同一大小类Payload的容器，
+ * 各CPU的cache与depot之间整个交换magazine，而不是逐个交换Payload
+ *
+ * @par 装满的magazine按大小类位于depot_full中，空的magazine位于
+ * depot_empty中，见depot_push；magazine本身是REGION_LONG中的普通Block，
+ * 只在mm_cpu_cache_stop时释放
+ */
+typedef struct magazine {
+  /** @brief depot栈中的下一个magazine */
+  struct magazine *next;
+  /** @brief 压入depot时栈的深度（包括自己），见depot_depth */
+  uint32_t depth;
+  /** @brief 装着的Payload数目 */
+  uint32_t count;
+  /** @brief 装着的Payload */
+  void *round[CPU_CACHE_DEPTH];
+} magazine_t;
+
+/**
+ * @brief 对象池或者Arena的一个Chunk：堆中的普通Block，Payload开头是这个
+ * 结构，之后紧接着对象，见mm_pool_create以及mm_arena_create
+ */
+typedef struct pool_chunk {
+  /** @brief 对象池中下一个（更晚分配的）Chunk，Arena中则是更早的Chunk */
+  struct pool_chunk *next;
+  /** @brief 整个Chunk的字节数，包括这个结构 */
+  size_t size;
+} pool_chunk_t;
+
+/**
+ * @brief 定长对象池，对象没有Header，被释放的对象组成侵入式链表
+ *
+ * @par 对象从Chunk中依次切出（bump），mm_pool_reset之后从第一个Chunk
+ * 重新开始，因此反复使用的池不再向堆申请空间
+ */
+struct mm_object_pool {
+  /** @brief 对象的大小，wsize的倍数 */
+  size_t objsize;
+  /** @brief 下一个新Chunk的大小，从pool_min_chunk翻倍到pool_max_chunk */
+  size_t chunk_size;
+  /** @brief 被释放的对象，每个对象的第一个Word指向下一个 */
+  void *free_list;
+  /** @brief current中尚未切出过的部分 */
+  char *bump;
+  char *bump_end;
+  /** @brief 所有Chunk，按分配的先后顺序 */
+  pool_chunk_t *chunks;
+  /** @brief bump所在的Chunk，之后的Chunk在reset之后尚未用到 */
+  pool_chunk_t *current;
+};
+
+/**
+ * @brief Arena：对象从Chunk中依次切出，没有Header，只能一起释放
+ *
+ * @par 当前Chunk用完时先尝试原地扩大它（见grow_block），因此Arena通常
+ * 只占一个Block，mm_arena_reset只需一次free
+ */
+struct mm_arena {
+  /** @brief 当前Chunk中尚未切出过的部分 */
+  char *bump;
+  char *end;
+  /** @brief 所有Chunk，最新的（也即bump所在的）在最前面 */
+  pool_chunk_t *chunks;
+  /** @brief 所有Chunk的大小之和，决定下一次扩大的量，见arena_grow */
+  size_t capacity;
+};
+
+/**
+ * @brief mm_halloc返回的Handle，程序通过它找到可以被移动的Block
+ *
+ * @par Handle本身位于handle_chunk_t中，永远不会移动；mm_compact移动
+ * Block之后只需改写ptr
+ */
+struct mm_handle {
+  /** @brief Block当前的Payload，空闲的Handle为NULL */
+  void *ptr;
+  union {
+    /** @brief mm_hlock的嵌套次数，不为0时Block不会被移动 */
+    word_t locks;
+    /** @brief 空闲Handle链表中的下一个 */
+    struct mm_handle *next;
+  };
+};
+
+/**
+ * @brief 一批Handle：REGION_SHORT中的普通Block，Payload开头是这个结构，
+ * 之后紧接着COUNT个Handle，直到堆被重新初始化都不会释放
+ *
+ * @note 不放在REGION_LONG中：只有少数Handle的小堆为此单独拓展出的空间
+ * 比Chunk本身大得多；Chunk从很小开始翻倍，挡在整理路上的也就不多
+ */
+typedef struct handle_chunk {
+  /** @brief 更早分配的Chunk */
+  struct handle_chunk *next;
+  /** @brief slots的数目 */
+  size_t count;
+  struct mm_handle slots[];
+} handle_chunk_t;
+
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
-  /** @brief Header contains size + allocation flag */
-  word_t header;
+  /**
+   * @brief Header contains size + allocation flag
+   *
+   * 只有32 Bit，因此Block的起始位置都位于16 Byte边界之前4 Byte处，
+   * 这样Payload依然是双字对齐的
+   */
+  tag_t header;
 
   /**
    * @brief A pointer to the block payload.
@@ -354,9 +727,11 @@ typedef struct block {
    *
    * 不要使用强制类型转换将此字段变为其他类型，最好使用一个Union将其包裹起来
    * 不过Union中的其他成员可以是结构体，可以使用它们来保存一些其他的数据
+   *
+   * Header只有4 Byte，list_elem_t放进Union会使body按8 Byte对齐，
+   * 因此链表节点只能通过get_body获取
    */
   union body {
-    list_elem_t list_elem;
     char payload[0];
   } body;
 
@@ -384,57 +759,281 @@ typedef struct block {
  *       2. 除了32 Byte的Overhead，剩余的96 Byte由6个双字对齐的Implicit
  * Block构成。 15 Byte的Payload后接1
  * Byte的Header作为其所有内容，Header保存Block于集群内的编号；
- *    2. LIFO维护，因此只需要实现链表头部插入函数即可；
- *      1. 一旦释放了集群中的任意一个Block，都需要将集群推入链表头部
- *    3.移除元素有两种情况：
- *      1.分配Block时，只有当集群中没有空Block时才将集群Block从根节点中移除，否则只是操作集群Header
- *         同时，初次在集群内部分配Block时要将集群的allocated bit设置为1；
- *      2.合并Block的时候可能要将集群从链表中移除，只有当allocated
- * bit=0（无任何分配Block）时才可合并 合并时需要检查cluster bit，将其当成128
- * Byte的Block合并；
+ *    2. 按照已分配的Implicit Block数目位于cluster_table的6个链表中，
+ *       满了的集群不在任何链表中，每次分配或释放都将集群换到相邻的链表；
+ *    3. 分配时优先选择最满的集群，被清空的集群只要不是唯一的未满集群，
+ *       就清除cluster bit，当成128 Byte的普通Block释放并合并；
+ *
+ */
+
+/**
+ * @brief 位于堆最前端（prologue之前）的元数据，由mm_init写入
  *
+ * @par 全局变量不能超过128 Byte，因此每个Region的链表以及链表相关的状态
+ * 都放在这里，按照[Region][INDEX]寻址
  */
+typedef struct heap_meta {
+  /**
+   * @brief free list头节点
+   *
+   * @par 链表头结点的操作有些特殊：
+   * 1.向其中插入节点的时候可以将此指针**看成是**位于某个list_elem_t结构体中，
+   *   这样无论是向链表中插入元素还是移除元素，如果遇到需要接收一个
+   *   list_elem_t *进而对其中的prev和next指针进行操作的函数，那么就需要
+   *   获取根节点的地址，把根节点所在的地址当成是一个指向list_elem_t的指针
+   *   就可以像普通节点一样对根节点进行操作了。
+   *
+   *   需要注意的是，无论是移除操作还是插入操作，由于这仅仅是一个有next半边的
+   *   list_elem_t，因此只能调用insert_next函数，被插入者是链表根节点
+   *
+   *   移除操作也只能把其他节点当成是主体，不能把这个虚拟的list_elem_t当成是
+   *   主体
+   *
+   * 2.Check函数也需要适时更新，第一是现在的prev指针有可能指向Block之外，
+   *   也就是这里的地址，第二是需要检查所有链表的最后一个next指针是不是
+   *   END_OF_LIST
+   *
+   * @note 必须是heap_meta_t的第一个字段，以保证各头节点都是双字对齐的
+   */
+  list_root_t list_table[REGION_COUNT][LIST_TABLE_SIZE];
+
+  /**
+   * @brief 用于表示对应链表是否为空的Bitmap，第INDEX个Bit对应第INDEX个链表
+   *
+   * @note 推入Block的时候置1，移除Block的时候不会清零，而是由查找函数在
+   * 遇到空链表时顺便清零，以免remove_list_elem还需要推断Block所在的链表
+   */
+  word_t list_map[REGION_COUNT][LIST_MAP_WORDS];
+
+  /**
+   * @brief 未满的Cluster所在的链表，第COUNT个链表中的Cluster恰好有COUNT个
+   * 已分配的Cluster Block
+   *
+   * @par 分配时优先选择最满的Cluster，几乎为空的Cluster因此不再接收新的
+   * Cluster Block，待其中的Block都被释放后便可以作为普通Block归还到堆中
+   *
+   * @note 链表的prev指针保存在Cluster Block 0的Header的低56 Bit中，
+   * 见get_cluster_prev
+   */
+  list_elem_t *cluster_table[REGION_COUNT][CLUSTER_BLOCK_COUNT];
+
+  /**
+   * @brief 支撑堆的大页大小，为0代表使用普通页面，由mm_init从memlib获取
+   *
+   * @note 不小于这个大小的Block会尽量让Payload对齐大页边界，见align_block
+   */
+  size_t huge_page_size;
+
+  /**
+   * @brief dirty list的头节点，环形双向链表，next是最早进入的Block
+   *
+   * @note Block按照进入的先后排列，因此stamp从头到尾单调不减
+   */
+  dirty_elem_t dirty_list;
+
+  /** @brief free的次数，用来判断dirty list中的Block释放了多久 */
+  word_t purge_clock;
+
+  /** @brief purge的页面大小，由mm_init从memlib获取；为0代表无法purge */
+  size_t page_size;
+
+  /**
+   * @brief 最近一次malloc所取用的Free Block中已经purge的范围，
+   * 其中的字节都是0，calloc不必再清零；为空代表没有
+   */
+  char *zero_lo;
+  /** @brief 已经purge的范围的末尾 */
+  char *zero_hi;
+
+  /**
+   * @brief 最近一次被分配或者被合并的Free Block在dirty list中的前一个节点，
+   * 切分剩下的部分或者合并的结果据此回到原来的位置，见inherit_purge_state；
+   * 为NULL代表没有这样的Block
+   */
+  dirty_elem_t *inherit_prev;
+  /** @brief 上述Block的stamp */
+  word_t inherit_stamp;
 
-/** @brief 14个Segregate List */
-#define LIST_TABLE_SIZE 14
+  /**
+   * @brief 后台维护线程上一次完整执行maintain_heap时的purge_clock，
+   * 用来判断它是否落后太多，见deduce_deferred
+   */
+  word_t maintain_mark;
+
+  /**
+   * @brief 第REGION个Bit代表对应Region最近曾因为没有未满的Cluster而当场
+   * 创建Cluster，后台维护线程据此预先准备一个空的Cluster；
+   * 有Cluster因为清空而被归还时清零
+   */
+  uint8_t cluster_wanted;
+
+  /**
+   * @brief 各CPU的cache，共cpu_count个，相隔cpu_cache_stride；
+   * 为NULL代表没有启用，见mm_cpu_cache_start
+   */
+  cpu_cache_t *cpu_caches;
+
+  /** @brief cpu_caches的数目，CPU编号不小于它时直接使用普通路径 */
+  uint32_t cpu_count;
+
+  /**
+   * @brief depot中装满的magazine，每个大小类一个无锁栈；栈顶指针的高
+   * depot_tag_shift以上的Bit是版本号，见depot_push
+   */
+  _Atomic word_t depot_full[CPU_CACHE_CLASS_COUNT];
+
+  /**
+   * @brief depot中空的magazine，所有大小类共用；只有它为空时才分配新的
+   * magazine，因此数目不超过装满的magazine最多时的数目
+   */
+  _Atomic word_t depot_empty;
+
+  /**
+   * @brief 上一次reclaim_depot以来depot_full各个栈的最小深度，这么多个
+   * magazine在这段时间中从未被取用，不属于工作集
+   */
+  uint32_t depot_full_min[CPU_CACHE_CLASS_COUNT];
+
+  /** @brief magazine的交换次数与cache未能满足的分配次数，见tick_depot */
+  word_t depot_clock;
+
+  /** @brief 所有Handle所在的Chunk，最新的在最前面，见mm_halloc */
+  handle_chunk_t *handle_chunks;
+  /** @brief 空闲的Handle，经由next相连 */
+  struct mm_handle *handle_free;
+  /** @brief 所有Chunk中Handle的总数 */
+  size_t handle_count;
+  /**
+   * @brief mm_compact当前这一批要处理的Handle，按Payload的地址升序排列，
+   * 见start_compact_batch
+   *
+   * @note 固定大小、放在heap_meta中：整理本身不从堆上分配，以免为了
+   * 腾出空间反而抬高堆的峰值
+   */
+  mm_handle_t compact_batch[COMPACT_BATCH_SIZE];
+  /** @brief 这一批的Handle数目，以及下一个要处理的位置 */
+  size_t compact_len;
+  size_t compact_pos;
+  /** @brief 这一轮已经处理到的Payload地址，NULL代表要开始新的一轮 */
+  char *compact_cursor;
+
+  /**
+   * @brief 每个链表一把自旋锁，保护链表本身以及其中Block的Header，
+   * 只在并发模式下使用，见lock_list
+   */
+  atomic_flag list_lock[REGION_COUNT][LIST_TABLE_SIZE];
+} heap_meta_t;
+
+/** @brief heap_meta_t占用的空间，对齐双字以保证之后的Block依然对齐 */
+static const size_t meta_size = (sizeof(heap_meta_t) + 15) & ~(size_t)15;
+
+/** @brief 相邻两个CPU的cache之间的距离，对齐cache line以免false sharing */
+static const size_t cpu_cache_stride =
+    (sizeof(cpu_cache_t) + 63) & ~(size_t)63;
+
+/** @brief pool_chunk_t占用的空间，对齐双字以保证之后的对象依然对齐 */
+static const size_t pool_header_size =
+    (sizeof(pool_chunk_t) + 15) & ~(size_t)15;
+
+/** @brief 对象池的第一个Chunk的大小 */
+static const size_t pool_min_chunk = 1 << 12;
+
+/** @brief 对象池的Chunk最多翻倍到这个大小，仍然远小于purge的页面 */
+static const size_t pool_max_chunk = 1 << 18;
+
+/** @brief 第一个handle_chunk_t中Handle的数目 */
+static const size_t handle_min_chunk = 16;
+
+/** @brief handle_chunk_t中的Handle最多翻倍到这个数目 */
+static const size_t handle_max_chunk = 4096;
+
+/** @brief Arena第一个Chunk的大小，也是每次扩大的最小量 */
+static const size_t arena_min_chunk = 1 << 12;
+
+/** @brief Arena每次扩大的量最多为这个大小 */
+static const size_t arena_max_chunk = 1 << 20;
+
+/**
+ * @brief Arena每次扩大已有容量的几分之一：翻倍会让峰值最多比用到的多出
+ * 一倍，扩大八分之一时最多多出八分之一。reset保留扩大过的第一个Chunk，
+ * 因此只有第一个请求需要多扩大几次
+ */
+static const size_t arena_growth_div = 8;
 
 /**
- * @brief 堆第一个Block的起始位置，类型为block_t *，mem_heap_lo() + prologue
+ * @brief 堆第一个Block的起始位置，类型为block_t *，
+ * mem_heap_lo() + heap_meta_t + 空隙 + prologue
  *
- * @note 不再作为标识堆是否被初始化的依据
+ * @note 不再作为标识堆是否被初始化的依据；这是Segment 0中的第一个Block，
+ * 其余Segment见get_segment_start
  *
  */
-#define HEAP_START (block_t *)(mem_heap_lo() + wsize)
+#define HEAP_START (block_t *)(mem_heap_lo() + meta_size + dsize - tag_size)
 
 /* Global variables */
 
 /**
- * @brief free list头节点
+ * @brief 指向位于堆最前端的heap_meta_t，由mm_init设置
+ *
+ * @note 缓存下来以免每次访问链表都要调用mem_heap_lo()；为NULL代表堆尚未
+ * 初始化
+ */
+static heap_meta_t *heap_meta;
+
+/**
+ * @brief 近期miss率的估计值，右移extend_credit_shift位即为堆的增长级别，
+ * 下一次extend_heap的增长量为chunksize << 增长级别
  *
- * @par 链表头结点的操作有些特殊：
- * 1.向其中插入节点的时候可以将此指针**看成是**位于某个list_elem_t结构体中，
- *   这样无论是向链表中插入元素还是移除元素，如果遇到需要接收一个
- *   list_elem_t *进而对其中的prev和next指针进行操作的函数，那么就需要
- *   获取根节点的地址，把根节点所在的地址当成是一个指向list_elem_t的指针
- *   就可以像普通节点一样对根节点进行操作了。
+ * @par 每次因find_fit失败而拓展堆时增加一级（即近期的miss越多增长越快），
+ * 每次free减一，trim_heap归还空间时减半回退；
+ * 只占1 Byte，全局变量总计不超过128 Byte
+ */
+static uint8_t extend_credit;
+
+/**
+ * @brief 链表是否使用64 Bit的宽链接，为false时使用narrow_elem_t
  *
- *   需要注意的是，无论是移除操作还是插入操作，由于这仅仅是一个有next半边的
- *   list_elem_t，因此只能调用insert_next函数，被插入者是链表根节点
+ * @note 堆超过narrow_link_range时由widen_links单向切换为true，
+ * mm_init时重置为false
+ */
+static bool wide_links;
+
+/**
+ * @brief 分配函数之间以及与后台维护线程之间的锁，见lock_heap
  *
- *   移除操作也只能把其他节点当成是主体，不能把这个虚拟的list_elem_t当成是主体
+ * @par 递归锁：realloc和calloc持有它时还会调用malloc和free
  *
- * 2.Check函数也需要适时更新，第一是现在的prev指针有可能指向堆外，也就是
- *   free_list_root的地址，第二是需要检查所有链表的最后一个next指针是不是
- *   END_OF_LIST
+ * @par 并发模式下较小Block的分配不获取它，只获取所在链表的锁，见
+ * malloc_list；持有它的一方在获取链表锁之后才能修改链表中的Block
  *
+ * @note 连同以下几个变量，全局变量总计依然不超过128 Byte
  */
-static list_elem_t *list_table[LIST_TABLE_SIZE];
+static pthread_mutex_t heap_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/** @brief 后台维护线程，见mm_maintenance_start */
+static pthread_t maintainer;
+
+/** @brief 后台维护线程是否已经创建，之后只暂停和恢复而不再退出 */
+static bool maintainer_created;
+
+/** @brief 后台维护线程是否在运行 */
+static bool maintainer_running;
 
 /**
- * @brief 用于表示对应链表是否为空
+ * @brief 前台正在等待后台维护线程持有的heap_lock，后台线程应当尽快将其
+ * 让出
  *
+ * @note 只是提示，heap_lock本身保证了内存顺序，读写都使用relaxed
+ */
+static atomic_bool yield_request;
+
+/**
+ * @brief 后台维护线程是否持有heap_lock，前台只在这时才设置yield_request
  */
-static bool list_no_empty[LIST_TABLE_SIZE];
+static atomic_bool maintainer_busy;
+
+/** @brief 通知后台维护线程暂停，暂停期间它依然定时醒来，只是不访问堆 */
+static atomic_bool maintainer_paused;
 /*
  *****************************************************************************
  * The functions below are short wrapper functions to perform                *
@@ -459,6 +1058,7 @@ static bool list_no_empty[LIST_TABLE_SIZE];
 
 /* Heap checking function */
 
+static bool check_heap(int);
 static bool check_free_block_aux(block_t *);
 static bool valid_block_format(block_t *);
 static bool check_word_align_dword(word_t);
@@ -466,7 +1066,7 @@ static bool check_word_align_word(word_t);
 static bool check_address_in_heap(word_t);
 static bool check_addr_is_root(list_elem_t *);
 static bool check_size_list(uint8_t, list_elem_t *);
-static bool check_is_node(block_t *);
+static bool check_is_node(list_elem_t *);
 
 /* List pointer operation */
 
@@ -479,17 +1079,33 @@ static inline void set_next(list_elem_t *, list_elem_t *);
 
 static void push_front(list_elem_t *root, list_elem_t *);
 static void push_order(list_elem_t *root, list_elem_t *);
-static void push_single(list_elem_t *root, list_elem_t *);
+static void push_cluster(block_t *);
+static void remove_cluster(block_t *);
 static void push_list(uint8_t table_index, list_elem_t *list_elem);
 static void remove_list_elem(list_elem_t *);
-static list_elem_t *get_list_by_index(uint8_t);
-static list_elem_t *pop_single(list_elem_t *root);
+static inline dirty_elem_t *get_dirty_elem(block_t *);
+static void push_dirty(block_t *);
+static void remove_dirty(block_t *);
+static void record_dirty_position(block_t *);
+static void inherit_purge_state(block_t *);
+static list_elem_t *get_list_by_index(uint8_t, uint8_t);
+static list_elem_t *get_cluster_list(uint8_t, uint8_t);
+static void release_block(block_t *);
+
+/* List locking */
+
+static void lock_list(uint8_t, uint8_t);
+static void unlock_list(uint8_t, uint8_t);
 
 /* Block fit */
 
-static block_t *find_good_fit(size_t, uint8_t);
-static block_t *find_first_fit(size_t, uint8_t);
-static block_t *find_fit(size_t);
+static block_t *find_first_fit(size_t, uint8_t, uint8_t);
+static block_t *find_near_fit(size_t, uint8_t, uint8_t);
+static block_t *find_fit(size_t, uint8_t);
+static block_t *find_aligned_fit(size_t, uint8_t, size_t);
+static bool grow_block(block_t *, size_t);
+static block_t *find_cluster_fit(uint8_t);
+static block_t *claim_block(block_t *, size_t, uint8_t, size_t);
 
 static block_t *find_next(block_t *);
 static block_t *find_heap_by_cmp(block_t *, bool cmp(block_t *, block_t *));
@@ -499,44 +1115,13 @@ static inline bool cmp_back_is_block(block_t *block, block_t *curr);
 static inline bool cmp_insert_after_list_elem(list_elem_t *block,
                                               list_elem_t *curr);
 
-/* Declaration end */
+/* Allocation */
 
-/* Functions table start */
+static void *malloc_region(size_t, uint8_t);
+static void free_payload(void *);
+static bool flush_cpu_caches(void);
 
-/**
- * @brief 用于向链表中push block的函数类型
- *
- */
-typedef void (*push_func_t)(list_elem_t *, list_elem_t *);
-
-/**
- * @brief 用于在INDEX（G_XX）和对应的push函数之间提供映射。
- *        所有链表直接通过push_front实现，不使用push_order
- *        使用该方式对提升内存利用率没有任何提升
- *
- */
-static const push_func_t index_to_push_func[] = {
-    push_single, push_front, push_front, push_front, push_front,
-    push_front,  push_front, push_front, push_front, push_front,
-    push_front,  push_front, push_front, push_front};
-
-/**
- * @brief 用于在链表中寻找合适Block的函数类型
- *
- */
-typedef block_t *(*fit_func_t)(size_t, uint8_t);
-
-/**
- * @brief 根据List的不同，使用此数组选择不同的Fit函数
- *
- */
-static const fit_func_t index_to_fit_func[] = {
-    find_first_fit, find_first_fit, find_first_fit, find_first_fit,
-    find_good_fit,  find_good_fit,  find_good_fit,  find_good_fit,
-    find_good_fit,  find_good_fit,  find_good_fit,  find_good_fit,
-    find_good_fit,  find_first_fit};
-
-/* Functions table end */
+/* Declaration end */
 
 /**
  * @brief Returns the maximum of two integers.
@@ -565,6 +1150,18 @@ static size_t round_up(size_t size, size_t n) {
   return n * ((size + (n - 1)) / n);
 }
 
+/**
+ * @brief 计算BLOCK与地址ADDR之间的距离（Byte）
+ *
+ * @param block
+ * @param addr
+ * @return size_t
+ */
+static inline size_t address_distance(block_t *block, void *addr) {
+  return (void *)block > addr ? (size_t)((void *)block - addr)
+                              : (size_t)(addr - (void *)block);
+}
+
 /**
  * @brief Packs the `size` and `alloc` of a block into a word suitable for
  *        use as a packed value.
@@ -575,18 +1172,25 @@ static size_t round_up(size_t size, size_t n) {
  *
  * The allocation status is packed into the lowest bit of the word.
  *
+ * 超出max_normal_size的Block只置huge bit，大小由write_block另外写入
+ *
  * @param[in] size The size of the block being represented
  * @param[in] alloc True if the block is allocated
+ * @param[in] region Block所属的Region
  * @return The packed value
  */
-static inline word_t pack_regular(size_t size, bool alloc, bool front_alloc) {
-  word_t word = size >> flag_bit_count;
+static inline tag_t pack_regular(size_t size, bool alloc, bool front_alloc,
+                                 uint8_t region) {
+  tag_t word = size > max_normal_size ? huge_mask : size >> flag_bit_count;
   if (alloc) {
     word |= alloc_mask;
   }
   if (front_alloc) {
     word |= front_alloc_mask;
   }
+  if (region == REGION_LONG) {
+    word |= region_mask;
+  }
   return word;
 }
 
@@ -596,11 +1200,11 @@ static inline word_t pack_regular(size_t size, bool alloc, bool front_alloc) {
  * @param alloc 同pack_regular
  * @param front_alloc 同pack_regular
  * @param cluster 用于判断是否需要置cluster bit
- * @return word_t
+ * @return tag_t
  */
-static inline word_t pack_cluster(bool alloc, bool front_alloc) {
+static inline tag_t pack_cluster(bool alloc, bool front_alloc) {
   static const size_t size = cluster_size >> flag_bit_count;
-  word_t word = size;
+  tag_t word = size;
   if (alloc) {
     word |= alloc_mask;
   }
@@ -613,29 +1217,23 @@ static inline word_t pack_cluster(bool alloc, bool front_alloc) {
 
 /**
  * @brief 将NUM打包到一个Word里，作为Cluster
- * Block的Header。NUM将会被放在返回值的第一个Byte的后四个Bit
+ * Block的Header。cluster bit以及NUM都位于返回值的最后一个Byte
  *
  * @param num
  * @return word_t
  */
 static inline word_t pack_cluster_block_header(uint8_t num) {
-  const static word_t num_to_mask[] = {
-      (word_t)0x0 << num_bit_count, (word_t)0x1 << num_bit_count,
-      (word_t)0x2 << num_bit_count, (word_t)0x3 << num_bit_count,
-      (word_t)0x4 << num_bit_count, (word_t)0x5 << num_bit_count};
-  word_t header = 0;
-  header |= cluster_mask;
-  header |= num_to_mask[num];
-  return header;
+  tag_t tag = cluster_mask | (tag_t)num << num_bit_count;
+  return (word_t)tag << cluster_tag_shift;
 }
 
 /**
- * @brief 利用指定HEADER第最后一个Byte的前四个Bit，获取该Cluster Block的标号
+ * @brief 利用指定HEADER最后一个Byte中的num字段，获取该Cluster Block的标号
  *
- * @param header
+ * @param header Cluster Block Header的高32 Bit
  * @return uint8_t
  */
-static inline uint8_t extract_cluster_block_num(word_t header) {
+static inline uint8_t extract_cluster_block_num(tag_t header) {
   return (header & cluster_num_mask) >> num_bit_count;
 }
 
@@ -648,7 +1246,27 @@ static inline uint8_t extract_cluster_block_num(word_t header) {
  * @param[in] word
  * @return The size of the block represented by the word
  */
-static size_t extract_size(word_t word) { return (word << flag_bit_count); }
+static size_t extract_size(tag_t word) {
+  return (word & size_field_mask) << flag_bit_count;
+}
+
+/**
+ * @brief WORD是否是Huge Block的Header、Footer或者Payload之前的标记
+ *
+ * @param word
+ * @return bool
+ */
+static bool extract_huge(tag_t word) { return (word & huge_mask) != 0; }
+
+/**
+ * @brief 获取Huge Block紧随Header之后的64 Bit size字段
+ *
+ * @param block
+ * @return word_t*
+ */
+static inline word_t *huge_size_field(block_t *block) {
+  return (word_t *)block->body.payload;
+}
 
 /**
  * @brief Extracts the size of a block from its header.
@@ -656,24 +1274,40 @@ static size_t extract_size(word_t word) { return (word << flag_bit_count); }
  * @return The size of the block
  */
 static inline size_t get_size(block_t *block) {
+  if (extract_huge(block->header)) {
+    return *huge_size_field(block);
+  }
   return extract_size(block->header);
 }
 
 /**
  * @brief Get the payload object
  *
+ * @note Huge Block的Payload位于其64 Bit size字段以及标记之后
+ *
  * @param block
  * @return void*
  */
-static void inline *get_body(block_t *block) { return (void *)&(block->body); }
+static void inline *get_body(block_t *block) {
+  if (extract_huge(block->header)) {
+    return (void *)block + huge_overhead_size;
+  }
+  return (void *)&(block->body);
+}
 
 /**
  * @brief Given a payload pointer, returns a pointer to the corresponding
  *        block.
+ *
+ * @note Payload之前的tag是Header本身，或者是Huge Block的标记
+ *
  * @param[in] bp A pointer to a block's payload
  * @return The corresponding block
  */
 static block_t *payload_to_header(void *bp) {
+  if (extract_huge(*(tag_t *)((char *)bp - tag_size))) {
+    return (block_t *)((char *)bp - huge_overhead_size);
+  }
   return (block_t *)((char *)bp - offsetof(block_t, body));
 }
 
@@ -687,12 +1321,15 @@ static void *header_to_payload(block_t *block) { return get_body(block); }
 
 /**
  * @brief Given a block pointer, returns a pointer to the corresponding
- *        footer. Block的倒数第一个Word
+ *        footer. Block的最后一个tag
+ *
+ * @note Free Huge Block的64 Bit size字段位于Footer之前的一个Word
+ *
  * @param[in] block
  * @return A pointer to the block's footer
  */
-static word_t *header_to_footer(block_t *block) {
-  return (word_t *)((void *)block + get_size(block) - overhead_size);
+static tag_t *header_to_footer(block_t *block) {
+  return (tag_t *)((void *)block + get_size(block) - tag_size);
 }
 
 /**
@@ -701,9 +1338,10 @@ static word_t *header_to_footer(block_t *block) {
  * @param[in] footer A pointer to the block's footer
  * @return A pointer to the start of the block
  */
-static block_t *footer_to_header(word_t *footer) {
-  size_t size = extract_size(*footer);
-  return (block_t *)((char *)footer + wsize - size);
+static block_t *footer_to_header(tag_t *footer) {
+  size_t size = extract_huge(*footer) ? *(word_t *)((char *)footer - wsize)
+                                      : extract_size(*footer);
+  return (block_t *)((char *)footer + tag_size - size);
 }
 
 /**
@@ -717,7 +1355,8 @@ static block_t *footer_to_header(word_t *footer) {
  */
 static size_t get_body_size(block_t *block) {
   size_t asize = get_size(block);
-  return asize - overhead_size;
+  return asize - (extract_huge(block->header) ? huge_overhead_size
+                                                : overhead_size);
 }
 
 /**
@@ -728,7 +1367,7 @@ static size_t get_body_size(block_t *block) {
  * @param[in] word
  * @return The allocation status correpsonding to the word
  */
-static bool extract_alloc(word_t word) {
+static bool extract_alloc(tag_t word) {
   return (word & alloc_mask) != 0;
   ;
 }
@@ -742,11 +1381,21 @@ static bool extract_alloc(word_t word) {
  * @param word
  * @return The allocation status correpsonding to the word
  */
-static bool extract_front_alloc(word_t word) {
+static bool extract_front_alloc(tag_t word) {
   // 不等于0代表该Bit为1，前一个Block处于Alloc
   return (word & front_alloc_mask) != 0;
 }
 
+/**
+ * @brief 前一个Block是否是没有Footer的最小Free Block
+ *
+ * @param word
+ * @return bool
+ */
+static bool extract_front_tiny(tag_t word) {
+  return (word & front_tiny_mask) != 0;
+}
+
 /**
  * @brief Returns weather the header is a cluster block header.
  *
@@ -755,11 +1404,64 @@ static bool extract_front_alloc(word_t word) {
  * @param word
  * @return bool
  */
-static bool extract_cluster(word_t word) {
+static bool extract_cluster(tag_t word) {
   return (word & cluster_mask) != 0;
   ;
 }
 
+/**
+ * @brief 堆是否可能被多个线程同时访问：interposition构建，或者后台维护
+ * 线程正在运行
+ *
+ * @par 并发模式下，不持有heap_lock的malloc_list会在链表锁的保护下取走
+ * 较小的Free Block，并改写其后一个Block的front bit
+ *
+ * @note 维护线程运行时单线程的mdriver同样属于并发模式：free和
+ * malloc_usable_size不获取heap_lock就读取Block头部，而维护线程可能同时
+ * 改写它的front bits，只有比较交换能让二者不冲突
+ *
+ * @return true
+ * @return false
+ */
+static inline bool deduce_concurrent(void) {
+  return maintainer_running || always_lock;
+}
+
+/**
+ * @brief 读取TAG，并发模式下其他线程可能正在改写它
+ *
+ * @param tag
+ * @return tag_t
+ */
+static inline tag_t load_tag(tag_t *tag) {
+  return __atomic_load_n(tag, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief 将TAG中CLEAR对应的Bit清零，再将SET对应的Bit置1
+ *
+ * @par 并发模式下，Header的front bit由前一个Block的所有者改写，其余部分
+ * 由Block自己的所有者改写，二者可能同时发生，因此使用比较交换
+ *
+ * @param tag
+ * @param clear
+ * @param set
+ * @return tag_t 改写之前的值
+ */
+static tag_t update_tag(tag_t *tag, tag_t clear, tag_t set) {
+  tag_t old;
+  if (!deduce_concurrent()) {
+    old = *tag;
+    *tag = (old & ~clear) | set;
+    return old;
+  }
+  old = __atomic_load_n(tag, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(tag, &old, (old & ~clear) | set, true,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+  }
+  return old;
+}
+
 /**
  * @brief Set the cluster bit of WORD to 1
  *
@@ -767,7 +1469,19 @@ static bool extract_cluster(word_t word) {
  * @return true
  * @return false
  */
-static void set_cluster(word_t *word) { *word |= cluster_mask; }
+static void set_cluster(tag_t *word) { update_tag(word, 0, cluster_mask); }
+
+/**
+ * @brief Returns the region of a given header value.
+ *
+ * This is based on the fourth lowest bit of the flag field.
+ *
+ * @param word
+ * @return uint8_t REGION_SHORT or REGION_LONG
+ */
+static uint8_t extract_region(tag_t word) {
+  return (word & region_mask) != 0 ? REGION_LONG : REGION_SHORT;
+}
 
 /**
  * @brief Returns the allocation status of a block, based on its header.
@@ -787,6 +1501,16 @@ static bool get_front_alloc(block_t *block) {
   return extract_front_alloc(block->header);
 }
 
+/**
+ * @brief 前一个Block是否是大小为min_block_size的Free Block
+ *
+ * @param block
+ * @return bool
+ */
+static bool get_front_tiny(block_t *block) {
+  return extract_front_tiny(block->header);
+}
+
 /**
  * @brief Returns whether the block is a cluster block.
  *
@@ -799,15 +1523,23 @@ static bool get_cluster(block_t *block) {
 }
 
 /**
- * @brief 获取BLOCK的alloc字段（即第一个Cluster的最后一个Word）
+ * @brief Returns the region the block belongs to.
  *
- * TODO 改成2
+ * @param block
+ * @return uint8_t
+ */
+static uint8_t get_region(block_t *block) {
+  return extract_region(block->header);
+}
+
+/**
+ * @brief 获取BLOCK的alloc字段（即Cluster的最后一个tag）
  *
  * @param block
- * @return word_t
+ * @return tag_t
  */
-static word_t *cluster_alloc_field(block_t *block) {
-  return (word_t *)block + 15;
+static tag_t *cluster_alloc_field(block_t *block) {
+  return (tag_t *)((void *)block + cluster_size) - 1;
 }
 
 /**
@@ -880,32 +1612,22 @@ static void set_cluster_block_alloc(block_t *block, uint8_t num, bool alloc) {
     *cluster_alloc_field(block) &= ~(cluster_block_alloc_mask_table[num]);
 }
 
-/**
- * @brief 将TAG指向的字段的front_alloc字段标记为FRONT_ALLOC
- *
- * @param tag 目标TAG
- * @param front_alloc 目标布尔值
- */
-static void set_front_alloc(word_t *tag, bool front_alloc) {
-  if (front_alloc)
-    *tag |= front_alloc_mask;
-  else
-    *tag &= ~front_alloc_mask;
-}
-
 /**
  * @brief 将位于BLOCK后边的邻接Block的front alloc bit设置为FRONT_BLOCK
  *
+ * @note Footer中的front bit不再维护：只有Header中的会被读取，而且并发
+ * 模式下后一个Block可能正被其他线程取走，它的Footer随时会成为Payload
+ *
  * @param block
  * @param front_alloc
- */
-static void set_front_alloc_of_back_block(block_t *block, bool front_alloc) {
-  block_t *next = find_next(block);
-  set_front_alloc(&(next->header), front_alloc);
-  // 只有在邻接的下一个Block未被分配的时候，才设置footer
-  if (!get_alloc(next)) {
-    set_front_alloc(header_to_footer(next), front_alloc);
-  }
+ * @return tag_t 后一个Block改写之前的Header
+ */
+static tag_t set_front_alloc_of_back_block(block_t *block, bool front_alloc) {
+  bool front_tiny = !front_alloc && get_size(block) == min_block_size;
+  return update_tag(&find_next(block)->header,
+                    front_alloc_mask | front_tiny_mask,
+                    (front_alloc ? front_alloc_mask : 0) |
+                        (front_tiny ? front_tiny_mask : 0));
 }
 
 /**
@@ -915,15 +1637,19 @@ static void set_front_alloc_of_back_block(block_t *block, bool front_alloc) {
  */
 static void print_block(block_t *block) {
   printf("\nBlock address:\t\t\t %p\n", block);
-  printf("Block header:\t\t\t 0x%09lx\n", block->header);
-  printf("Block footer:\t\t\t 0x%09lx\n", *header_to_footer(block));
+  printf("Block header:\t\t\t 0x%08" PRIx32 "\n", block->header);
+  printf("Block footer:\t\t\t 0x%08" PRIx32 "\n", *header_to_footer(block));
   printf("Block Size:\t\t\t %ld\n", get_size(block));
   printf("Block alloc:\t\t\t %s\n",
          get_alloc(block) == true ? "true" : "false");
   printf("Block front alloc:\t\t %s\n",
          get_front_alloc(block) == true ? "true" : "false");
+  printf("Block front tiny:\t\t %s\n",
+         get_front_tiny(block) == true ? "true" : "false");
   printf("Block is a cluster:\t\t %s\n",
          get_cluster(block) == true ? "true" : "false");
+  printf("Block region:\t\t\t %s\n",
+         get_region(block) == REGION_LONG ? "long" : "short");
   if (get_cluster(block)) {
     printf("Cluster status:\t\t\t %s\n",
            deduce_cluster_empty(block)
@@ -942,13 +1668,36 @@ static void print_block(block_t *block) {
  * The epilogue header has size 0, and is marked as allocated.
  *
  * @param[out] block The location to write the epilogue header
- * @pre block == mem_heap_hi() - 7
+ * @pre block == mem_segment_hi(所在的Segment) - 3
  */
 static void write_epilogue(block_t *block, bool front_alloc) {
   dbg_requires(block != NULL);
-  dbg_requires((char *)block == mem_heap_hi() - 7);
+  dbg_requires((char *)block ==
+               (char *)mem_segment_hi(mem_segment_of(block)) - 3);
+
+  block->header = pack_regular(0, true, front_alloc, REGION_SHORT);
+}
 
-  block->header = pack_regular(0, true, front_alloc);
+/**
+ * @brief 写入Header之外的部分：Huge Block的size与标记，以及Footer
+ *
+ * @param block
+ * @param header BLOCK的Header
+ * @param size
+ */
+static void write_block_tail(block_t *block, tag_t header, size_t size) {
+  if (extract_huge(header)) {
+    *huge_size_field(block) = size;
+    *((tag_t *)get_body(block) - 1) = huge_mask;
+  }
+  // 只有Free block才有footer，最小的Block除外
+  if (!extract_alloc(header) && size != min_block_size) {
+    tag_t *footerp = header_to_footer(block);
+    *footerp = header;
+    if (extract_huge(header)) {
+      *(word_t *)((char *)footerp - wsize) = size;
+    }
+  }
 }
 
 /**
@@ -965,25 +1714,53 @@ static void write_epilogue(block_t *block, bool front_alloc) {
  *
  * 有一个重要事实是，如果是分配Block的话，footer会被覆盖掉
  *
+ * 大于max_normal_size的Block写成Huge Block：Header之后是64 Bit的size，
+ * Payload之前是只有huge bit的标记；Free的话Footer之前也有一份size
+ *
  * TODO: Are there any preconditions or postconditions?
  *
  * @param[out] block The location to begin writing the block header
  * @param[in] size The size of the new block
  * @param[in] alloc The allocation status of the new block
  * @param[in] front_alloc The allocation status of front block of the new block
+ * @param[in] region The region of the new block
  */
 static void write_block(block_t *block, size_t size, bool alloc,
-                        bool front_alloc) {
+                        bool front_alloc, uint8_t region) {
   dbg_requires(block != NULL);
   dbg_requires(size >= min_block_size);
   dbg_requires(check_word_align_dword((word_t)size));
 
-  block->header = pack_regular(size, alloc, front_alloc);
-  // 只有Free block才有footer
-  if (!alloc) {
-    word_t *footerp = header_to_footer(block);
-    *footerp = pack_regular(size, alloc, front_alloc);
+  tag_t header = pack_regular(size, alloc, front_alloc, region);
+  // 前一个Block仍未分配的话，它的大小没有变，沿用原来的front tiny bit
+  if (!front_alloc) {
+    header |= block->header & front_tiny_mask;
   }
+  block->header = header;
+  write_block_tail(block, header, size);
+}
+
+/**
+ * @brief 改写已有的BLOCK，保留Header中的front bit，其余同write_block
+ *
+ * @note 并发模式下前一个Block的所有者可能同时改写front bit，见update_tag；
+ * 因此已有的Block都经由这个函数改写，而不是读出front bit再写回
+ *
+ * @param block
+ * @param size
+ * @param alloc
+ * @param region
+ */
+static void rewrite_block(block_t *block, size_t size, bool alloc,
+                          uint8_t region) {
+  dbg_requires(block != NULL);
+  dbg_requires(size >= min_block_size);
+  dbg_requires(check_word_align_dword((word_t)size));
+
+  tag_t header = pack_regular(size, alloc, false, region);
+  tag_t front_mask = front_alloc_mask | front_tiny_mask;
+  tag_t old = update_tag(&block->header, ~front_mask, header);
+  write_block_tail(block, header | (old & front_mask), size);
 }
 
 /**
@@ -997,8 +1774,8 @@ static inline void *get_cluster_block(block_t *block, uint8_t num) {
   dbg_requires(block != NULL);
   dbg_assert(get_cluster(block) == true);
   dbg_assert(num < CLUSTER_BLOCK_COUNT);
-  // TODO 优化
-  return (void *)block + dsize + num * dsize;
+  // Cluster Block 0的Header紧随链表节点的next之后
+  return (void *)block->body.payload + wsize + num * dsize;
 }
 
 /**
@@ -1012,7 +1789,15 @@ static inline void *cluster_block_to_payload(void *cluster_block) {
 }
 
 /**
- * @brief 在BLOCK上创建一个Cluster，将其压入G_16链表中
+ * @brief 利用Cluster Block的Payload计算其Header的地址
+ *
+ * @param bp
+ * @return void*
+ */
+static inline void *payload_to_cluster_block(void *bp) { return bp - wsize; }
+
+/**
+ * @brief 在BLOCK上创建一个Cluster，将其压入cluster_table的0号链表中
  *
  * @note BLOCK的大小必须是128 Byte且已分配并不位于任何表中
  *
@@ -1028,7 +1813,7 @@ static void create_cluster(block_t *block) {
 
   // 需要在这个位置就压入链表
   // 设置Cluster Bit
-  set_cluster((word_t *)block);
+  set_cluster(&block->header);
 
   // 清空Allocated field
   *cluster_alloc_field(block) = 0;
@@ -1036,12 +1821,12 @@ static void create_cluster(block_t *block) {
   uint8_t num = 0;
   // 设置每一个cluster block的第2个半字为对应编号
   for (word_t *p = get_cluster_block(block, 0); num != CLUSTER_BLOCK_COUNT;
-       p += 2) {
+       p += dsize / wsize) {
     *p = pack_cluster_block_header(num);
     num++;
   }
 
-  push_list(G_16, (list_elem_t *)get_body(block));
+  push_cluster(block);
   set_front_alloc_of_back_block(block, true);
 }
 /**
@@ -1055,7 +1840,8 @@ static inline block_t *get_cluster_by_cluster_block(void *cluster_block,
                                                     uint8_t num) {
   dbg_assert(check_word_align_word((word_t)cluster_block));
   dbg_assert(num < CLUSTER_BLOCK_COUNT);
-  return (block_t *)(cluster_block - num * cluster_block_size - dsize);
+  return (block_t *)(cluster_block - num * cluster_block_size - wsize -
+                     offsetof(block_t, body));
 }
 
 /**
@@ -1065,7 +1851,8 @@ static inline block_t *get_cluster_by_cluster_block(void *cluster_block,
  * @return uint8_t
  */
 static inline uint8_t get_cluster_block_number(void *cluster_block) {
-  uint8_t result = extract_cluster_block_num(*(word_t *)cluster_block);
+  uint8_t result = extract_cluster_block_num(*(word_t *)cluster_block >>
+                                             cluster_tag_shift);
   dbg_ensures(result < CLUSTER_BLOCK_COUNT);
   return result;
 }
@@ -1077,7 +1864,7 @@ static inline uint8_t get_cluster_block_number(void *cluster_block) {
  * @return uint8_t
  */
 static uint8_t get_free_cluster_block(block_t *block) {
-  word_t alloc_field = get_cluster_alloc_field(block);
+  tag_t alloc_field = get_cluster_alloc_field(block);
   dbg_ensures(alloc_field < CLUSTER_ALLOC_STATUS);
   uint8_t num = cluster_alloc_to_num[alloc_field];
   dbg_ensures(num == CLUSTER_FULL ||
@@ -1100,14 +1887,12 @@ static void *allocate_cluster_block(block_t *block) {
   uint8_t num = get_free_cluster_block(block);
   dbg_ensures(num != CLUSTER_FULL);
 
-  // 直接就是第一个Byte
-  uint8_t cluster_alloc_field = get_cluster_alloc_field(block);
-  if (cluster_alloc_to_bit_count[cluster_alloc_field] ==
-      CLUSTER_BLOCK_COUNT - 1) {
-    // 分配此Block之后Cluster即满，需先将Block中G_16中移除
-    pop_single((list_elem_t *)(list_table + G_16));
-  }
+  // 占用数目改变，需要换到相邻的链表中，满了的Cluster不在任何链表中
+  remove_cluster(block);
   set_cluster_block_alloc(block, num, true);
+  if (!deduce_cluster_full(block)) {
+    push_cluster(block);
+  }
   void *cluster_block = get_cluster_block(block, num);
   void *payload = cluster_block_to_payload(cluster_block);
   dbg_ensures(num != CLUSTER_FULL);
@@ -1118,6 +1903,10 @@ static void *allocate_cluster_block(block_t *block) {
 /**
  * @brief 释放BLOCK中编号为NUM的Cluster Block
  *
+ * @par 释放之后Cluster为空的话，只要同一Region中还有其他未满的Cluster，
+ * 就将这128 Byte作为普通的Free Block与相邻Block合并；否则保留它，
+ * 以免交替分配释放16 Byte Block时反复创建Cluster
+ *
  * @param block
  * @param num
  */
@@ -1128,12 +1917,19 @@ static void free_cluster_block(void *cluster_block) {
   block_t *cluster = get_cluster_by_cluster_block(cluster_block, num);
   dbg_ensures(valid_block_format(cluster));
 
-  if (deduce_cluster_full(cluster)) {
-    // 链表由满变非空，需要将其加入链表中
-    set_cluster_block_alloc(cluster, num, false);
-    push_list(G_16, (list_elem_t *)get_body(cluster));
+  // 满了的Cluster不在链表中
+  if (!deduce_cluster_full(cluster)) {
+    remove_cluster(cluster);
+  }
+  set_cluster_block_alloc(cluster, num, false);
+
+  if (deduce_cluster_empty(cluster) &&
+      find_cluster_fit(get_region(cluster)) != NULL) {
+    // 已经有多余的Cluster，不必再预先准备
+    heap_meta->cluster_wanted &= ~(1 << get_region(cluster));
+    release_block(cluster);
   } else {
-    set_cluster_block_alloc(cluster, num, false);
+    push_cluster(cluster);
   }
 }
 
@@ -1158,8 +1954,8 @@ static block_t *find_next(block_t *block) {
  * @param[in] block A block in the heap
  * @return The location of the previous block's footer
  */
-static word_t *find_prev_footer(block_t *block) {
-  // Compute previous footer position as one word before the header
+static tag_t *find_prev_footer(block_t *block) {
+  // Compute previous footer position as one tag before the header
   return &(block->header) - 1;
 }
 
@@ -1172,20 +1968,43 @@ static word_t *find_prev_footer(block_t *block) {
  * block's footer to determine its size, then calculating the start of the
  * previous block based on its size.
  *
+ * @note 前一个Block是最小Block的话没有Footer，直接根据front tiny bit计算
+ *
  * @param[in] block A block in the heap
  * @return The previous consecutive block in the heap
  * @pre The block is not the first block in the heap
+ * @pre 前一个Block未分配
  */
 static block_t *find_prev(block_t *block) {
   dbg_requires(block != NULL);
-  dbg_requires(get_size(block) != 0);
+  dbg_requires(!get_front_alloc(block));
 
-  word_t *footerp = find_prev_footer(block);
+  if (get_front_tiny(block)) {
+    return (block_t *)((char *)block - min_block_size);
+  }
+  tag_t *footerp = find_prev_footer(block);
   return footer_to_header(footerp);
 }
 
 /**
- * @brief 遍历堆中的所有block，直到CMP返回true为止
+ * @brief 获取第SEG个Segment中的第一个Block
+ *
+ * @par 每个Segment都有自己的prologue和epilogue，Block不会跨越Segment：
+ * - Segment 0：heap_meta_t + 8 Byte空隙 + prologue，即HEAP_START；
+ * - 其余Segment：8 Byte空隙 + prologue，见open_segment；
+ *
+ * @param seg Segment的编号
+ * @return block_t* 可能是epilogue，代表Segment中还没有Block
+ */
+static block_t *get_segment_start(int seg) {
+  if (seg == 0) {
+    return HEAP_START;
+  }
+  return (block_t *)((char *)mem_segment_lo(seg) + dsize - tag_size);
+}
+
+/**
+ * @brief 遍历堆中各个Segment的所有block，直到CMP返回true为止
  *
  * @param block 目标BLOCK
  * @param cmp 接收两个block_t*，前者是BLOCK，后者是每次迭代时变更的block
@@ -1196,10 +2015,12 @@ static block_t *find_heap_by_cmp(block_t *block,
   dbg_requires(block != NULL);
   dbg_requires(get_size(block) != 0);
 
-  for (block_t *curr = HEAP_START; get_size(curr) != 0;
-       curr = find_next(curr)) {
-    if (cmp(block, curr) == true) {
-      return curr;
+  for (int seg = 0; seg != mem_segment_count(); seg++) {
+    for (block_t *curr = get_segment_start(seg); get_size(curr) != 0;
+         curr = find_next(curr)) {
+      if (cmp(block, curr) == true) {
+        return curr;
+      }
     }
   }
   return NULL;
@@ -1227,6 +2048,52 @@ static list_elem_t *find_list_by_cmp(list_elem_t *root, list_elem_t *list_elem,
   return NULL;
 }
 
+/**
+ * @brief 将LIST_ELEM编码为相对heap_meta的压缩链接
+ *
+ * @param list_elem 双字对齐的链表节点或头节点，也可以是END_OF_LIST
+ * @return uint32_t
+ */
+static inline uint32_t encode_link(list_elem_t *list_elem) {
+  if (list_elem == END_OF_LIST) {
+    return NARROW_END_OF_LIST;
+  }
+  size_t offset = (void *)list_elem - (void *)heap_meta;
+  dbg_assert(check_word_align_dword(offset));
+  dbg_assert(offset < narrow_link_range);
+  return (uint32_t)(offset >> narrow_link_shift);
+}
+
+/**
+ * @brief 将压缩链接LINK解码为链表节点的地址
+ *
+ * @param link
+ * @return list_elem_t*
+ */
+static inline list_elem_t *decode_link(uint32_t link) {
+  if (link == NARROW_END_OF_LIST) {
+    return END_OF_LIST;
+  }
+  return (list_elem_t *)((void *)heap_meta +
+                         ((size_t)link << narrow_link_shift));
+}
+
+/**
+ * @brief 宽链接模式下，从G_16链表头开始遍历，找到THIS的前驱
+ *
+ * @param this 位于G_16中的最小Block
+ * @return list_elem_t*
+ */
+static list_elem_t *find_single_prev(list_elem_t *this) {
+  list_elem_t *prev =
+      get_list_by_index(get_region(payload_to_header(this)), G_16);
+  while (prev->next != this) {
+    dbg_assert(prev->next != END_OF_LIST);
+    prev = prev->next;
+  }
+  return prev;
+}
+
 /**
  * @brief Get the prev pointer of THIS
  *
@@ -1235,8 +2102,14 @@ static list_elem_t *find_list_by_cmp(list_elem_t *root, list_elem_t *list_elem,
  */
 static inline list_elem_t *get_prev(list_elem_t *this) {
   dbg_assert(this != NULL);
-  dbg_assert(check_is_node(payload_to_header(this)));
-  return this->prev;
+  dbg_assert(check_is_node(this));
+  if (wide_links) {
+    if (get_size(payload_to_header(this)) == min_block_size) {
+      return find_single_prev(this);
+    }
+    return this->prev;
+  }
+  return decode_link(((narrow_elem_t *)this)->prev);
 }
 
 /**
@@ -1247,8 +2120,15 @@ static inline list_elem_t *get_prev(list_elem_t *this) {
  */
 static inline void set_prev(list_elem_t *this, list_elem_t *block) {
   dbg_assert(this != NULL);
-  dbg_assert(check_is_node(payload_to_header(this)));
-  this->prev = block;
+  dbg_assert(check_is_node(this));
+  if (wide_links) {
+    // 单向链表中的最小Block没有prev字段
+    if (get_size(payload_to_header(this)) != min_block_size) {
+      this->prev = block;
+    }
+  } else {
+    ((narrow_elem_t *)this)->prev = encode_link(block);
+  }
 }
 
 /**
@@ -1258,8 +2138,11 @@ static inline void set_prev(list_elem_t *this, list_elem_t *block) {
  * @return list_elem_t*
  */
 static inline list_elem_t *get_next(list_elem_t *this) {
-  dbg_assert(check_is_node(payload_to_header(this)));
-  return this->next;
+  dbg_assert(check_is_node(this));
+  if (wide_links) {
+    return this->next;
+  }
+  return decode_link(((narrow_elem_t *)this)->next);
 }
 
 /**
@@ -1269,8 +2152,12 @@ static inline list_elem_t *get_next(list_elem_t *this) {
  * @param block
  */
 static inline void set_next(list_elem_t *this, list_elem_t *block) {
-  dbg_assert(check_is_node(payload_to_header(this)));
-  this->next = block;
+  dbg_assert(check_is_node(this));
+  if (wide_links) {
+    this->next = block;
+  } else {
+    ((narrow_elem_t *)this)->next = encode_link(block);
+  }
 }
 
 /**
@@ -1366,38 +2253,74 @@ static void push_order(list_elem_t *root, list_elem_t *list_elem) {
       find_list_by_cmp(root, list_elem, cmp_insert_after_list_elem);
   dbg_assert(prev != NULL);
   insert_after(prev, list_elem);
-  dbg_ensures(mm_checkheap(__LINE__));
+  dbg_ensures(check_heap(__LINE__));
 }
 
 /**
- * @brief 将LIST_ELEM推入**单向链表**ROOT中，因此只会修改list_elem->next字段
+ * @brief 获取Cluster在链表中的前驱，可能是cluster_table中的根节点
  *
- * @param root
- * @param list_elem
+ * @note list_elem_t的prev字段与Cluster Block 0的Header重叠，而这个Header
+ * 只有最高的Byte被使用，因此prev以相对heap_meta的偏移保存在低56 Bit中
+ *
+ * @param block
+ * @return list_elem_t*
  */
-static void push_single(list_elem_t *root, list_elem_t *list_elem) {
-  dbg_assert(root != NULL);
-  dbg_assert(list_elem != NULL);
-  dbg_assert(get_size(payload_to_header(list_elem)) != 0);
-  dbg_assert(get_alloc(payload_to_header(list_elem)) == true);
-  dbg_assert(valid_block_format(payload_to_header(list_elem)) == true);
+static inline list_elem_t *get_cluster_prev(block_t *block) {
+  word_t word = *(word_t *)get_cluster_block(block, 0);
+  return (list_elem_t *)((void *)heap_meta + (word & cluster_prev_mask));
+}
+
+/**
+ * @brief 将Cluster在链表中的前驱设置为PREV，不改变Cluster Block 0的编号
+ *
+ * @param block
+ * @param prev
+ */
+static inline void set_cluster_prev(block_t *block, list_elem_t *prev) {
+  word_t *word = get_cluster_block(block, 0);
+  word_t offset = (word_t)((void *)prev - (void *)heap_meta);
+  dbg_assert((offset & ~cluster_prev_mask) == 0);
+  *word = (*word & ~cluster_prev_mask) | offset;
+}
+
+/**
+ * @brief 按照BLOCK中已分配的Cluster Block数目，将其推入对应链表的头部
+ *
+ * @param block 未满的Cluster，不可位于任何链表中
+ */
+static void push_cluster(block_t *block) {
+  dbg_assert(get_cluster(block));
+  dbg_assert(!deduce_cluster_full(block));
+
+  uint8_t count = cluster_alloc_to_bit_count[get_cluster_alloc_field(block)];
+  list_elem_t *root = get_cluster_list(get_region(block), count);
+  list_elem_t *list_elem = (list_elem_t *)get_body(block);
+  list_elem_t *next = get_next(root);
 
-  set_next(list_elem, get_next(root));
+  set_next(list_elem, next);
+  if (next != END_OF_LIST) {
+    set_cluster_prev(payload_to_header(next), list_elem);
+  }
   set_next(root, list_elem);
+  set_cluster_prev(block, root);
 }
 
 /**
- * @brief 将单向链表ROOT的首个元素弹出
+ * @brief 将Cluster从其所在的链表中移除
  *
- * @param root
+ * @param block 未满的Cluster
  */
-static list_elem_t *pop_single(list_elem_t *root) {
-  dbg_assert(root != NULL);
+static void remove_cluster(block_t *block) {
+  dbg_assert(get_cluster(block));
 
-  list_elem_t *old_head = get_next(root);
-  if (old_head != END_OF_LIST)
-    set_next(root, get_next(old_head));
-  return old_head;
+  list_elem_t *list_elem = (list_elem_t *)get_body(block);
+  list_elem_t *prev = get_cluster_prev(block);
+  list_elem_t *next = get_next(list_elem);
+
+  set_next(prev, next);
+  if (next != END_OF_LIST) {
+    set_cluster_prev(payload_to_header(next), prev);
+  }
 }
 
 /**
@@ -1413,7 +2336,7 @@ static list_elem_t *pop_front(list_elem_t *root) {
   dbg_assert(root != NULL);
   dbg_assert(check_address_in_heap((word_t)root) == false);
 
-  list_elem_t *old_head = root->next;
+  list_elem_t *old_head = get_next(root);
   remove_list_elem(old_head);
   return old_head;
 }
@@ -1429,13 +2352,8 @@ static bool check_remove(list_elem_t *list_elem) {
   dbg_assert(list_elem != NULL);
   block_t *block = payload_to_header(list_elem);
   dbg_assert(get_size(block) != 0);
-  // 直接就是第一个Byte
-  if (get_cluster(block)) {
-    // 如果是Cluster，只只剩一个空位或全空的时候才可将其移除
-    dbg_ensures(cluster_alloc_to_bit_count[get_cluster_alloc_field(block)] ==
-                    CLUSTER_BLOCK_COUNT - 1 ||
-                deduce_cluster_empty(block));
-  }
+  // Cluster只能通过remove_cluster移除
+  dbg_ensures(!get_cluster(block));
   dbg_ensures(check_free_block_aux(block));
   return true;
 }
@@ -1443,7 +2361,7 @@ static bool check_remove(list_elem_t *list_elem) {
 /**
  * @brief 将LIST_ELEM从链表中移出链表
  *
- * @note LIST_ELEM必须位于某个链表中，可以是头节点
+ * @note LIST_ELEM必须位于某个链表中，可以是头节点；调用者持有该链表的锁
  *
  * @param list_elem
  * @return list_elem_t*
@@ -1456,59 +2374,321 @@ static void remove_list_elem(list_elem_t *list_elem) {
     set_prev(get_next(list_elem), get_prev(list_elem));
   }
   set_next(get_prev(list_elem), get_next(list_elem));
+  // 较大的Block同时可能位于dirty list中
+  block_t *block = payload_to_header(list_elem);
+  if (get_size(block) >= purge_min_size) {
+    remove_dirty(block);
+  }
+}
+
+/**
+ * @brief 获取REGION中第INDEX个链表在Bitmap中的状态
+ *
+ * @param region
+ * @param index
+ * @return true 链表可能非空
+ * @return false 链表为空
+ */
+static inline bool get_list_no_empty(uint8_t region, uint8_t index) {
+  word_t *word = &heap_meta->list_map[region][index >> 6];
+  word_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+  return (bits >> (index & 63)) & 1;
+}
+
+/**
+ * @brief 将REGION中第INDEX个链表在Bitmap中的状态设置为NO_EMPTY
+ *
+ * @param region
+ * @param index
+ * @param no_empty
+ */
+static inline void set_list_no_empty(uint8_t region, uint8_t index,
+                                     bool no_empty) {
+  word_t bit = (word_t)1 << (index & 63);
+  word_t *word = &heap_meta->list_map[region][index >> 6];
+  // 同一个Word中的其他链表可能正由其他线程修改，见lock_list
+  if (deduce_concurrent()) {
+    if (no_empty)
+      __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    else
+      __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+  } else if (no_empty) {
+    *word |= bit;
+  } else {
+    *word &= ~bit;
+  }
+}
+
+/**
+ * @brief 利用Bitmap找到REGION中从INDEX开始（包括INDEX）第一个非空的链表
+ *
+ * @note Bitmap中的1只代表链表**可能**非空，见heap_meta_t::list_map
+ *
+ * @param region
+ * @param index
+ * @return uint8_t 链表下标，没有找到的话返回LIST_TABLE_SIZE
+ */
+static uint8_t find_no_empty_list(uint8_t region, uint8_t index) {
+  for (uint8_t w = index >> 6; w < LIST_MAP_WORDS; w++) {
+    word_t bits = __atomic_load_n(&heap_meta->list_map[region][w],
+                                  __ATOMIC_RELAXED);
+    if (w == index >> 6) {
+      bits &= ~(word_t)0 << (index & 63);
+    }
+    if (bits != 0) {
+      return (w << 6) + __builtin_ctzl(bits);
+    }
+  }
+  return LIST_TABLE_SIZE;
 }
 
 /**
  * @brief 根据TABLE_INDEX，将LIST_ELEM放入合适的链表中
  *
+ * @note 所有链表都使用push_front，使用push_order对提升内存利用率没有任何提升
+ *
+ * @par 推入之后Block随时可能被malloc_list取走，因此调用者需要事先设置好
+ * 后一个Block的front bit；推入期间持有链表锁，调用者不能持有其他链表锁
+ *
  * @param table_index
  * @param list_elem
  */
 static void push_list(uint8_t table_index, list_elem_t *list_elem) {
   dbg_assert(table_index < LIST_TABLE_SIZE);
 
-  list_elem_t *root = get_list_by_index(table_index);
-  push_func_t push_func = index_to_push_func[table_index];
-  push_func(root, list_elem);
-  list_no_empty[table_index] = true;
+  // 每个Region都有自己的链表，由Block的Region决定推入哪一组
+  block_t *block = payload_to_header(list_elem);
+  uint8_t region = get_region(block);
+  lock_list(region, table_index);
+  push_front(get_list_by_index(region, table_index), list_elem);
+  set_list_no_empty(region, table_index, true);
+  unlock_list(region, table_index);
+  // 刚释放或者刚合并出来的较大Block总是当作尚未purge
+  if (get_size(block) >= purge_min_size) {
+    push_dirty(block);
+  }
 }
 
 /**
- * @brief Get the list by index
+ * @brief Get the list by region and index
  *
+ * @param region
  * @param index
  * @return list_elem_t*
  */
-static inline list_elem_t *get_list_by_index(uint8_t index) {
-  return (list_elem_t *)(list_table + index);
+static inline list_elem_t *get_list_by_index(uint8_t region, uint8_t index) {
+  return (list_elem_t *)&heap_meta->list_table[region][index].head;
 }
 
 /**
- * @brief 推断最适合大小为ASIZE的block存放的free list
+ * @brief 获取REGION中恰好有COUNT个已分配Cluster Block的Cluster所在的链表
  *
- * @param asize 目标大小
- * @return uint8_t 合适的table index
+ * @param region
+ * @param count
+ * @return list_elem_t*
  */
-static inline uint8_t deduce_list_index(size_t asize) {
-  return asize > MAX_BLOCK_GROUP
-             ? G_INF
-             : asize_to_index[((uint8_t)(asize >> 4)) & group_mask];
+static inline list_elem_t *get_cluster_list(uint8_t region, uint8_t count) {
+  dbg_assert(count < CLUSTER_BLOCK_COUNT);
+  return (list_elem_t *)(heap_meta->cluster_table[region] + count);
 }
 
 /**
- * @brief 比较CURR的后一个邻接的block是不是BLOCK
+ * @brief 推断最适合大小为ASIZE的block存放的free list
  *
- * @param block
- * @param curr
- * @return true
- * @return false
+ * @par 映射规则：
+ * + asize <= 1024：精确链表，32 Byte为1号链表，此后每16 Byte一个链表；
+ * + asize > 1024：设asize - 1的最高位为第b位，那么b - 10决定它位于第几个
+ *   2的幂次，紧随最高位的log_group_split位决定它位于该幂次的第几等分；
+ * + 超出范围的都位于G_INF；
+ *
+ * @param asize 目标大小，对齐16 Byte且不小于min_block_size
+ * @return uint8_t 合适的table index
  */
-static inline bool cmp_back_is_block(block_t *block, block_t *curr) {
-  return find_next(curr) == block;
+static inline uint8_t deduce_list_index(size_t asize) {
+  if (asize <= MAX_EXACT_BLOCK_GROUP) {
+    return (asize >> flag_bit_count) - 1;
+  }
+  uint8_t b = 63 - __builtin_clzl(asize - 1);
+  size_t index = EXACT_LIST_COUNT +
+                 ((size_t)(b - exact_group_shift) << log_group_split) +
+                 (((asize - 1) >> (b - log_group_split)) &
+                  ((1 << log_group_split) - 1));
+  return index < G_INF ? index : G_INF;
 }
 
 /**
- * @brief 检查CURR的next指针是否大于LIST_ELEM
+ * @brief 获取REGION中第INDEX个链表的锁，只在并发模式下生效
+ *
+ * @par 锁的顺序：先heap_lock后链表锁；除了lock_all_lists之外，同一时刻
+ * 最多持有一个链表锁，持有链表锁时也不会再获取heap_lock
+ *
+ * @param region
+ * @param index
+ */
+static void lock_list(uint8_t region, uint8_t index) {
+  if (!deduce_concurrent()) {
+    return;
+  }
+  atomic_flag *lock = &heap_meta->list_lock[region][index];
+  while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+/**
+ * @brief 与lock_list配对，释放REGION中第INDEX个链表的锁
+ *
+ * @param region
+ * @param index
+ */
+static void unlock_list(uint8_t region, uint8_t index) {
+  if (!deduce_concurrent()) {
+    return;
+  }
+  atomic_flag_clear_explicit(&heap_meta->list_lock[region][index],
+                             memory_order_release);
+}
+
+/**
+ * @brief 获取Free Block BLOCK所在链表的锁
+ *
+ * @param block 调用者拥有BLOCK，或者持有heap_lock并确认它不会被取走
+ */
+static void lock_list_of(block_t *block) {
+  lock_list(get_region(block), deduce_list_index(get_size(block)));
+}
+
+/**
+ * @brief 释放Free Block BLOCK所在链表的锁
+ *
+ * @param block
+ */
+static void unlock_list_of(block_t *block) {
+  unlock_list(get_region(block), deduce_list_index(get_size(block)));
+}
+
+/**
+ * @brief 按照固定的顺序获取所有链表的锁，之后整个堆都不会被修改
+ *
+ * @note 调用者持有heap_lock；widen_links、check_heap以及fork时使用
+ */
+static void lock_all_lists(void) {
+  if (heap_meta == NULL) {
+    return;
+  }
+  for (uint8_t region = 0; region != REGION_COUNT; region++) {
+    for (uint8_t index = 0; index != LIST_TABLE_SIZE; index++) {
+      lock_list(region, index);
+    }
+  }
+}
+
+/**
+ * @brief 与lock_all_lists配对
+ */
+static void unlock_all_lists(void) {
+  if (heap_meta == NULL) {
+    return;
+  }
+  for (uint8_t region = 0; region != REGION_COUNT; region++) {
+    for (uint8_t index = 0; index != LIST_TABLE_SIZE; index++) {
+      unlock_list(region, index);
+    }
+  }
+}
+
+/**
+ * @brief 获取BLOCK之后邻接的Free Block，并持有它所在链表的锁
+ *
+ * @note 后一个Block可能正被malloc_list取走，因此在链表锁之下重新确认
+ *
+ * @param block 调用者持有heap_lock并拥有BLOCK
+ * @return block_t* 后一个Block已分配（包括epilogue）时返回NULL
+ */
+static block_t *lock_free_next(block_t *block) {
+  block_t *next = find_next(block);
+  tag_t front_mask = front_alloc_mask | front_tiny_mask;
+  for (;;) {
+    tag_t header = load_tag(&next->header);
+    if (extract_alloc(header)) {
+      return NULL;
+    }
+    size_t size =
+        extract_huge(header) ? *huge_size_field(next) : extract_size(header);
+    uint8_t index = deduce_list_index(size);
+    lock_list(extract_region(header), index);
+    if (((load_tag(&next->header) ^ header) & ~front_mask) == 0) {
+      return next;
+    }
+    unlock_list(extract_region(header), index);
+  }
+}
+
+/**
+ * @brief 获取BLOCK之前邻接的Free Block，并持有它所在链表的锁
+ *
+ * @par 并发模式下BLOCK的front bit与前一个Block的Footer都可能正在被
+ * malloc_list改写，因此先检查算出的Block是否合理，获取链表锁之后再确认
+ * 二者都没有改变；不一致时说明对方尚未完成，让出CPU之后重试
+ *
+ * @param block 调用者持有heap_lock，BLOCK可以是epilogue
+ * @return block_t* 前一个Block已分配时返回NULL
+ */
+static block_t *lock_free_prev(block_t *block) {
+  tag_t front_mask = front_alloc_mask | front_tiny_mask;
+  for (;;) {
+    tag_t header = load_tag(&block->header);
+    if (extract_front_alloc(header)) {
+      return NULL;
+    }
+    if (!deduce_concurrent()) {
+      return find_prev(block);
+    }
+    size_t size = min_block_size;
+    if (!extract_front_tiny(header)) {
+      tag_t *footer = find_prev_footer(block);
+      tag_t footer_tag = load_tag(footer);
+      size = extract_huge(footer_tag) ? *(word_t *)((char *)footer - wsize)
+                                      : extract_size(footer_tag);
+    }
+    block_t *start = get_segment_start(mem_segment_of(block));
+    block_t *prev = (block_t *)((char *)block - size);
+    tag_t prev_header = 0;
+    if (size >= min_block_size && check_word_align_dword((word_t)size) &&
+        size <= (size_t)((char *)block - (char *)start)) {
+      prev_header = load_tag(&prev->header);
+    }
+    size_t prev_size = extract_huge(prev_header) ? *huge_size_field(prev)
+                                                 : extract_size(prev_header);
+    if (prev_header == 0 || extract_alloc(prev_header) || prev_size != size) {
+      sched_yield();
+      continue;
+    }
+    uint8_t region = extract_region(prev_header);
+    uint8_t index = deduce_list_index(size);
+    lock_list(region, index);
+    if (((load_tag(&prev->header) ^ prev_header) & ~front_mask) == 0 &&
+        !extract_front_alloc(load_tag(&block->header))) {
+      return prev;
+    }
+    unlock_list(region, index);
+  }
+}
+
+/**
+ * @brief 比较CURR的后一个邻接的block是不是BLOCK
+ *
+ * @param block
+ * @param curr
+ * @return true
+ * @return false
+ */
+static inline bool cmp_back_is_block(block_t *block, block_t *curr) {
+  return find_next(curr) == block;
+}
+
+/**
+ * @brief 检查CURR的next指针是否大于LIST_ELEM
  *
  * @note 按照地址升序确定是否要在LIST_ELEM的后面插入CURR
  *
@@ -1544,17 +2724,27 @@ static inline bool cmp_insert_after_list_elem(list_elem_t *list_elem,
 static bool valid_list_iterate(bool aux(block_t *), size_t heap_count) {
   bool validation = false;
   size_t list_count = 0;
-  for (int i = 0; i < LIST_TABLE_SIZE; i++) {
-    for (list_elem_t *curr = list_table[i]; curr != END_OF_LIST;
-         curr = get_next(curr)) {
+  // 依次遍历每个Region的LIST_TABLE_SIZE个链表
+  for (int n = 0; n < REGION_COUNT * LIST_TABLE_SIZE; n++) {
+    int r = n / LIST_TABLE_SIZE;
+    int i = n % LIST_TABLE_SIZE;
+    for (list_elem_t *curr = get_next(get_list_by_index(r, i));
+         curr != END_OF_LIST; curr = get_next(curr)) {
       list_count++;
+      // 检查节点是否位于其Region的链表中
+      validation = get_region(payload_to_header(curr)) == r;
+      if (!validation) {
+        dbg_printf("\n=============\n%d: Node region no equals to list "
+                   "region(%d)\n=============\n",
+                   __LINE__, r);
+        goto done;
+      }
       // 检查链表大小是否适合
       validation = check_size_list(i, curr);
       if (!validation) {
         dbg_printf("\n=============\n%d: Node size(%ld) do not match with list "
-                   "size(%d)\n=============\n",
-                   __LINE__, get_size(payload_to_header(curr)),
-                   index_to_asize[i]);
+                   "index(%d)\n=============\n",
+                   __LINE__, get_size(payload_to_header(curr)), i);
         goto done;
       }
 
@@ -1565,6 +2755,33 @@ static bool valid_list_iterate(bool aux(block_t *), size_t heap_count) {
       }
     }
   }
+  // 依次遍历每个Region中按占用数目划分的Cluster链表
+  for (int n = 0; n < REGION_COUNT * CLUSTER_BLOCK_COUNT; n++) {
+    int r = n / CLUSTER_BLOCK_COUNT;
+    int c = n % CLUSTER_BLOCK_COUNT;
+    list_elem_t *prev = get_cluster_list(r, c);
+    for (list_elem_t *curr = get_next(prev); curr != END_OF_LIST;
+         prev = curr, curr = get_next(curr)) {
+      list_count++;
+      block_t *block = payload_to_header(curr);
+      validation = get_cluster(block) && get_region(block) == r &&
+                   cluster_alloc_to_bit_count[get_cluster_alloc_field(
+                       block)] == c;
+      if (!validation) {
+        dbg_printf("\n=============\n%d: Cluster do not match with cluster "
+                   "list(%d, %d)\n=============\n",
+                   __LINE__, r, c);
+        goto done;
+      }
+      validation = get_cluster_prev(block) == prev;
+      if (!validation) {
+        dbg_printf("\n=============\n%d: Cluster prev(%p) no equals to "
+                   "%p\n=============\n",
+                   __LINE__, get_cluster_prev(block), prev);
+        goto done;
+      }
+    }
+  }
   validation = list_count == heap_count;
   if (!validation) {
     dbg_printf("\n=============\n%d: List count(%ld) not match with Heap "
@@ -1587,19 +2804,22 @@ done:
  * @return true 相符
  * @return false 不符
  */
-static bool check_tag(word_t tag, size_t size, bool alloc) {
+static bool check_tag(tag_t tag, size_t size, bool alloc) {
   return size == extract_size(tag) && alloc == extract_alloc(tag);
 }
 
 /**
- * @brief 检查ADDR所指代的地址是否指向堆中
+ * @brief 检查ADDR所指代的地址是否指向堆中某个Segment的Block
+ *
+ * @note 位于堆最前端的heap_meta_t（也即链表根节点所在处）不算在内
  *
  * @param addr
  * @return true
  * @return false
  */
 static bool check_address_in_heap(word_t addr) {
-  return addr <= (word_t)mem_heap_hi() && addr >= (word_t)mem_heap_lo();
+  int seg = mem_segment_of((void *)addr);
+  return seg >= 0 && addr >= (word_t)get_segment_start(seg);
 }
 
 /**
@@ -1625,7 +2845,8 @@ static bool check_word_align_word(word_t word) {
 }
 
 /**
- * @brief 检查BLOCK是否对齐：payload起点对齐16Byte、BLOCK底部对齐16Byte
+ * @brief 检查BLOCK是否对齐：payload起点对齐16Byte、BLOCK底部位于16Byte边界
+ * 之前tag_size处（即下一个Block的Header）
  *
  * @param block
  * @return true
@@ -1640,10 +2861,10 @@ static bool valid_block_align(block_t *block) {
     goto done;
   }
 
-  // 检查footer是不是对齐16Byte
-  validation = check_word_align_dword((word_t)header_to_footer(block));
+  // 检查Block底部是不是位于16Byte边界之前tag_size处
+  validation = check_word_align_dword((word_t)find_next(block) + tag_size);
   if (!validation) {
-    dbg_printf("\n=============\n%d: block footer not align to 16 "
+    dbg_printf("\n=============\n%d: block bottom not align to 16 "
                "Byte\n",
                __LINE__);
     goto done;
@@ -1675,7 +2896,9 @@ static bool check_block_size(block_t *block) {
  * @return false
  */
 static bool check_tags_match(block_t *block) {
-  return block->header == *header_to_footer(block);
+  // Footer中的front bit不再维护，见set_front_alloc_of_back_block
+  tag_t front_mask = front_alloc_mask | front_tiny_mask;
+  return ((block->header ^ *header_to_footer(block)) & ~front_mask) == 0;
 }
 
 /**
@@ -1697,7 +2920,7 @@ static bool check_cluster_size(block_t *block) {
  * @return false
  */
 static bool check_cluster_tag(block_t *block) {
-  const static word_t low_four_bit_mask = 0x5;
+  const static tag_t low_four_bit_mask = 0x5;
   return (block->header & low_four_bit_mask) ==
          (*header_to_footer(block) & low_four_bit_mask);
 }
@@ -1758,8 +2981,8 @@ static bool valid_block_format(block_t *block) {
     goto done;
   }
 
-  // 只检查Free block
-  if (!get_alloc(block)) {
+  // 只检查有Footer的Free block
+  if (!get_alloc(block) && get_size(block) != min_block_size) {
     validation = check_tags_match(block);
     if (!validation) {
       dbg_printf("\n=============\n%d: block header & footer not match\n",
@@ -1822,8 +3045,8 @@ done:
  * @return false
  */
 static bool check_front_alloc_bit(block_t *block) {
-  if (block == HEAP_START) {
-    // 自己是堆中第一个数据块的话
+  if (block == get_segment_start(mem_segment_of(block))) {
+    // 自己是Segment中第一个数据块的话
     return get_front_alloc(block);
   } else {
     // 如果前一个Block已分配的话，由于Footer不合法，因此只能迭代获取
@@ -1831,6 +3054,10 @@ static bool check_front_alloc_bit(block_t *block) {
     dbg_assert(front_block != NULL);
     bool front_block_alloc = get_alloc(front_block);
     bool result = flip(get_front_alloc(block) ^ front_block_alloc);
+    // 前一个Block未分配时，front tiny bit需要和它的大小相符
+    if (result && !front_block_alloc) {
+      result = get_front_tiny(block) == (get_size(front_block) == min_block_size);
+    }
     if (!result) {
       print_block(front_block);
     }
@@ -1846,14 +3073,21 @@ static bool check_front_alloc_bit(block_t *block) {
  * @return false
  */
 static bool check_addr_is_root(list_elem_t *list_elem) {
-  dbg_assert(list_table[0] != NULL);
+  dbg_assert(heap_meta != NULL);
 
   if (flip(check_address_in_heap((word_t)list_elem)) == false) {
     return false;
   }
-  for (int i = 0; i < LIST_TABLE_SIZE; i++) {
-    if (get_list_by_index(i) == list_elem) {
-      return true;
+  for (int r = 0; r < REGION_COUNT; r++) {
+    for (int i = 0; i < LIST_TABLE_SIZE; i++) {
+      if (get_list_by_index(r, i) == list_elem) {
+        return true;
+      }
+    }
+    for (int c = 0; c < CLUSTER_BLOCK_COUNT; c++) {
+      if (get_cluster_list(r, c) == list_elem) {
+        return true;
+      }
     }
   }
   return false;
@@ -1934,41 +3168,24 @@ static bool check_size_list(uint8_t index, list_elem_t *list_elem) {
   dbg_ensures(index < LIST_TABLE_SIZE);
   block_t *block = payload_to_header(list_elem);
 
-  switch (index) {
-  case G_16:
-    return get_size(block) == index_to_asize[index];
-    break;
-  case G_32:
-  case G_48:
-  case G_64:
-    return get_size(block) == index_to_asize[index];
-    break;
-  case G_128:
-  case G_192:
-  case G_256:
-  case G_384:
-  case G_512:
-  case G_1024:
-  case G_2048:
-  case G_1536:
-  case G_4096:
-    return get_size(block) <= index_to_asize[index] &&
-           get_size(block) > index_to_asize[index - 1];
-  case G_INF:
-    return get_size(block) > index_to_asize[index - 1];
-  default:
-    return false;
-  }
+  return !get_cluster(block) && deduce_list_index(get_size(block)) == index;
 }
 
 /**
- * @brief 检查指定BLOCK的格式是否与链表结点的语法对应
+ * @brief 检查LIST_ELEM是否是链表头节点，或者其所在Block的格式是否与链表结点的
+ * 语法对应
+ *
+ * @note 头节点之前并没有Header，因此需要先判断是不是头节点
  *
  * @return true
  * @return false
  */
-static bool check_is_node(block_t *block) {
-  return check_addr_is_root(get_body(block)) || !get_alloc(block) ||
+static bool check_is_node(list_elem_t *list_elem) {
+  if (check_addr_is_root(list_elem)) {
+    return true;
+  }
+  block_t *block = payload_to_header(list_elem);
+  return !get_alloc(block) ||
          (get_cluster(block) && !deduce_cluster_full(block));
 }
 
@@ -2038,6 +3255,88 @@ done:
   return validation;
 }
 
+/**
+ * @brief 检查第SEG个Segment：prologue和epilogue的格式，以及其中每一个Block
+ * 的格式和front alloc bit
+ *
+ * @param seg Segment的编号
+ * @param count 累加Segment中可以分配的free block（含未满的Cluster）的数目
+ * @param dirty_count 累加Segment中尚未purge的较大Free Block的数目
+ * @return bool
+ */
+static bool valid_segment(int seg, size_t *count, size_t *dirty_count) {
+  block_t *curr = get_segment_start(seg);
+  bool valid = check_tag(*find_prev_footer(curr), 0, true);
+  if (!valid) {
+    dbg_printf("\n=============\n%d: prologue block format error!", __LINE__);
+    return false;
+  }
+
+  for (; get_size(curr) != 0; curr = find_next(curr)) {
+    valid = valid_block_format(curr);
+    if (!valid) {
+      dbg_printf("\n=============\n%d: Block format invalid", __LINE__);
+      break;
+    }
+    valid = check_front_alloc_bit(curr);
+    if (!valid) {
+      dbg_printf("\n=============\n%d: Block alloc bit not match with front "
+                 "block",
+                 __LINE__);
+      break;
+    }
+
+    if (get_cluster(curr)) {
+      if (!deduce_cluster_full(curr)) {
+        (*count)++;
+      }
+    } else {
+      if (!get_alloc(curr)) {
+        (*count)++;
+        if (get_size(curr) >= purge_min_size &&
+            get_dirty_elem(curr)->next != NULL) {
+          (*dirty_count)++;
+        }
+      }
+    }
+  }
+
+  // 检查epilogue block是否合法，以及它是否恰好位于Segment的末尾
+  if (valid) {
+    valid = check_tag(curr->header, 0, true) &&
+            (char *)curr == (char *)mem_segment_hi(seg) - 3;
+    if (!valid) {
+      dbg_printf("\n=============\n%d: epilogue Block invalid", __LINE__);
+    }
+  }
+  if (!valid) {
+    print_block(curr);
+  }
+  return valid;
+}
+
+/**
+ * @brief 检查dirty list：节点都是不小于purge_min_size的Free Block，
+ * prev与next一致，stamp单调不减，并且节点数目为DIRTY_COUNT
+ *
+ * @param dirty_count 遍历堆得到的尚未purge的较大Free Block的数目
+ * @return bool
+ */
+static bool valid_dirty_list(size_t dirty_count) {
+  dirty_elem_t *root = &heap_meta->dirty_list;
+  size_t count = 0;
+  for (dirty_elem_t *elem = root->next; elem != root; elem = elem->next) {
+    block_t *block = payload_to_header((char *)elem - dsize);
+    if (!check_address_in_heap((word_t)elem) || get_alloc(block) ||
+        get_size(block) < purge_min_size || elem->next->prev != elem ||
+        (elem->prev != root && elem->prev->stamp > elem->stamp)) {
+      return false;
+    }
+    count++;
+  }
+  return count == dirty_count;
+}
+
 /**
  * @brief 调试用辅助函数
  *
@@ -2073,6 +3372,13 @@ static bool check_free_block_aux(block_t *block) {
  *   为一个新的Block，最后再将该Block移入free list；
  * - 两边都已释放：需要先将左右两个Block都从free list中移除，随后操作同上；
  *
+ * @par 属于其他Region的Free Block不会被合并，当成已分配处理，
+ * 因此堆中可能存在两个相邻但是Region不同的Free Block
+ *
+ * @par 锁的顺序：调用者持有heap_lock，邻接Block依次在各自链表的锁之下
+ * 确认仍未分配并移出链表，见lock_free_next以及lock_free_prev；移出之后
+ * 它们就只属于这里，因此同一时刻只持有一个链表锁，与malloc_list不会死锁
+ *
  * @param[in] block 等待合并的Block
  * @return 合并之后的Block的地址，可能和参数一致
  * @pre get_alloc(block) == false，footer无需设置
@@ -2083,45 +3389,114 @@ static block_t *coalesce_block(block_t *block) {
   dbg_assert(get_alloc(block) == false);
   dbg_assert(get_size(block) != 0);
 
-  // 获取堆中前后邻接的Block
   block_t *result = block;
-  block_t *adj_back = find_next(block);
-  list_elem_t *adj_back_list_elem = (list_elem_t *)get_body(adj_back);
-  bool adj_front_allocated = get_front_alloc(block);
-  bool adj_back_allocated = get_alloc(adj_back);
-
-  // 由于无两连续Free block的不变性始终会被保证，因此front的front必然已分配
-  if (adj_front_allocated) {
-    if (adj_back_allocated) {
-      // Case 1 两边都已分配
-    } else {
-      // Case 2 后边已释放 上述两种情况都不需要改变result
-      remove_list_elem(adj_back_list_elem);
-      write_block(block, get_size(block) + get_size(adj_back), false, true);
+  size_t size = get_size(block);
+  uint8_t region = get_region(block);
+
+  // 合并的结果继承邻接Block中最早进入dirty list的那个的位置
+  heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+  heap_meta->inherit_prev = NULL;
+
+  // 后边的Block
+  block_t *adj_back = lock_free_next(block);
+  if (adj_back != NULL) {
+    if (get_region(adj_back) == region) {
+      record_dirty_position(adj_back);
+      remove_list_elem((list_elem_t *)get_body(adj_back));
+      size += get_size(adj_back);
     }
-  } else {
-    block_t *adj_front = find_prev(block);
-    list_elem_t *adj_front_list_elem = (list_elem_t *)get_body(adj_front);
-    if (adj_back_allocated) {
-      // Case 3 前边已释放
-      remove_list_elem(adj_front_list_elem);
-      write_block(adj_front, get_size(adj_front) + get_size(block), false,
-                  true);
-      result = adj_front;
-    } else {
-      // Case 4 两边都已释放
-      remove_list_elem(adj_front_list_elem);
-      remove_list_elem(adj_back_list_elem);
-      write_block(adj_front,
-                  get_size(adj_front) + get_size(block) + get_size(adj_back),
-                  false, true);
+    unlock_list_of(adj_back);
+  }
+
+  // 前边的Block，合并的结果从它开始
+  block_t *adj_front = lock_free_prev(block);
+  if (adj_front != NULL) {
+    if (get_region(adj_front) == region) {
+      record_dirty_position(adj_front);
+      remove_list_elem((list_elem_t *)get_body(adj_front));
+      size += get_size(adj_front);
       result = adj_front;
     }
+    unlock_list_of(adj_front);
+  }
+
+  // 同一Region中不会有两个连续的Free block，但是front的front可能是其他
+  // Region的Free Block，因此合并后的front bit沿用原来的值
+  if (size != get_size(result)) {
+    rewrite_block(result, size, false, region);
   }
   set_front_alloc_of_back_block(result, false);
   return result;
 }
 
+/**
+ * @brief 将所有链表从压缩链接转换为宽链接
+ *
+ * @par 每个节点都先读出两个压缩链接再写入宽链接，因此可以原地转换；
+ * Cluster的prev保存在Cluster Block 0的Header中，G_16中的Block只有8 Byte，
+ * 所以二者都只转换next
+ *
+ * @note 转换期间持有所有链表的锁，malloc_list不会读到只转换了一半的链表
+ */
+static void widen_links(void) {
+  dbg_assert(!wide_links);
+
+  lock_all_lists();
+  for (int r = 0; r != REGION_COUNT; r++) {
+    for (int i = 0; i != LIST_TABLE_SIZE; i++) {
+      list_elem_t *root = get_list_by_index(r, i);
+      list_elem_t *curr = decode_link(((narrow_elem_t *)root)->next);
+      root->next = curr;
+      while (curr != END_OF_LIST) {
+        narrow_elem_t narrow = *(narrow_elem_t *)curr;
+        curr->next = decode_link(narrow.next);
+        // G_16中的Block放不下prev，之后通过find_single_prev查找
+        if (i != G_16) {
+          curr->prev = decode_link(narrow.prev);
+        }
+        curr = curr->next;
+      }
+    }
+    for (int c = 0; c != CLUSTER_BLOCK_COUNT; c++) {
+      list_elem_t *curr = get_cluster_list(r, c);
+      while (curr != END_OF_LIST) {
+        curr->next = decode_link(((narrow_elem_t *)curr)->next);
+        curr = curr->next;
+      }
+    }
+  }
+  wide_links = true;
+  unlock_all_lists();
+}
+
+/**
+ * @brief 在已有的Segment之后开启一个新的Segment，此后extend_heap在其中拓展
+ *
+ * @par 新Segment的布局与mm_init中的Segment 0相同，只是没有heap_meta_t：
+ * 8 Byte空隙 + prologue的footer + epilogue的header
+ *
+ * @par 超出一个Segment槽位的请求由memlib分配连续的多个槽位，因此单个
+ * Block只受整个预留空间的限制
+ *
+ * @param size 开启之后需要立即拓展的大小
+ * @return true 开启成功
+ * @return false Segment已经用完，或者剩余的预留空间放不下SIZE
+ */
+static bool open_segment(size_t size) {
+  int seg = mem_segment_create(dsize + size);
+  if (seg < 0) {
+    return false;
+  }
+  char *lo = mem_segment_sbrk(seg, dsize);
+  if (lo == (void *)-1) {
+    return false;
+  }
+  tag_t *start = (tag_t *)(lo + wsize);
+  start[0] = pack_regular(0, true, true, REGION_SHORT);
+  start[1] = pack_regular(0, true, true, REGION_SHORT);
+  return true;
+}
+
 /**
  * @brief 执行系统调用，将堆向上移动SIZE byte
  *
@@ -2135,16 +3510,29 @@ static block_t *coalesce_block(block_t *block) {
  * 4.如果不是，将新申请的空间作为新Block压入free list顶部。同时确保
  *   epilogue block内容不变并修改其prev的next为新地址；
  *
+ * @note 总是拓展最后一个Segment，它无法连续增长时会开启一个新的Segment，
+ * 此时新空间不与之前堆顶的Free Block相邻，返回的Block可能小于SIZE
+ *
  * @param[in] size 堆被向上移动的大小
+ * @param[in] region 新空间所属的Region
  * @return 移动brk之后，堆最后一个Block的地址（不是payload）
  */
-static block_t *extend_heap(size_t size) {
+static block_t *extend_heap(size_t size, uint8_t region) {
   void *bp;
 
   // Allocate an even number of words to maintain alignment
   size = round_up(size, dsize);
-  if ((bp = mem_sbrk(size)) == (void *)-1) {
-    return NULL;
+  int seg = mem_segment_count() - 1;
+  if ((bp = mem_segment_sbrk(seg, size)) == (void *)-1) {
+    if (!open_segment(size) ||
+        (bp = mem_segment_sbrk(seg + 1, size)) == (void *)-1) {
+      return NULL;
+    }
+  }
+  // 新的Block可能超出压缩链接的表示范围，需要在推入链表之前切换为宽链接
+  if (!wide_links &&
+      (size_t)((char *)bp + size - (char *)heap_meta) >= narrow_link_range) {
+    widen_links();
   }
 
   /*
@@ -2156,13 +3544,9 @@ static block_t *extend_heap(size_t size) {
    * 原来的epilogue block的位置会被占掉，正好补偿了
    */
 
-  // 首先需要将epilogue block的front_alloc_bit保存起来
-  word_t old_epilogue = *(word_t *)(bp - wsize);
-  bool front_alloc_bit = extract_front_alloc(old_epilogue);
-
-  // Initialize free block header/footer
-  block_t *block = payload_to_header(bp);
-  write_block(block, size, false, front_alloc_bit);
+  // Initialize free block header/footer，沿用原来epilogue block的front bit
+  block_t *block = (block_t *)(bp - tag_size);
+  rewrite_block(block, size, false, region);
 
   // Create new epilogue header 需要先把epilguos写入
   block_t *block_next = find_next(block);
@@ -2173,228 +3557,601 @@ static block_t *extend_heap(size_t size) {
 
   // 更新链表头部为新Free Block
   push_list(deduce_list_index(get_size(block)), (list_elem_t *)get_body(block));
+  inherit_purge_state(block);
 
   dbg_ensures(valid_node(block));
   return block;
 }
 
 /**
- * @brief 检查并确定是否需要将BLOCK拆分为大小分别ASIZE和block size -
- * ASIZE的两个block
+ * @brief 获取最后一个Segment，也即extend_heap所拓展的Segment的epilogue block
  *
- * @note 如果分割出来的大小小于min_block_size，那就不必分了
+ * @return block_t*
+ */
+static inline block_t *get_epilogue(void) {
+  return (block_t *)((char *)mem_segment_hi(mem_segment_count() - 1) - 3);
+}
+
+/**
+ * @brief 大小为ASIZE的Block是否需要让Payload对齐大页边界
  *
- * @param[in] block 待拆分的block
- * @param[in] asize BLOCK的目标新大小
- * @pre ASIZE < get_size(BLOCK)
- * @pre asize对齐16 Byte
- * @pre block必须已分配
+ * @par 只有堆由大页支撑、Block不小于一个大页时才有意义，这样Block占用的
+ * 大页数目最少；Huge Block的Payload位置不同，不做对齐
+ *
+ * @param asize
+ * @return bool
  */
-static void split_block(block_t *block, size_t asize) {
-  dbg_requires(get_alloc(block));
-  dbg_requires(asize <= get_size(block));
-  dbg_requires(check_word_align_dword((word_t)asize));
-  /* TODO: Can you write a precondition about the value of asize? */
+static inline bool deduce_huge_page_align(size_t asize) {
+  size_t huge_page_size = heap_meta->huge_page_size;
+  return huge_page_size != 0 && asize >= huge_page_size &&
+         asize <= max_normal_size;
+}
 
-  size_t block_size = get_size(block);
+/**
+ * @brief 为使BLOCK中大小为ASIZE的Block的Payload对齐ALIGNMENT，需要在其
+ * 之前切掉多少字节
+ *
+ * @note 切掉的部分要成为一个Free Block，因此不为0时至少是min_block_size；
+ * ASIZE超出max_normal_size时切出来的是Huge Block，Payload位于
+ * huge_overhead_size之后
+ *
+ * @param block
+ * @param asize 目标大小
+ * @param alignment Payload的对齐，2的幂次
+ * @return size_t 已经对齐时返回0
+ */
+static inline size_t deduce_align_gap(block_t *block, size_t asize,
+                                      size_t alignment) {
+  uintptr_t mask = alignment - 1;
+  size_t offset =
+      asize > max_normal_size ? huge_overhead_size : overhead_size;
+  if ((((uintptr_t)block + offset) & mask) == 0) {
+    return 0;
+  }
+  uintptr_t payload = (uintptr_t)block + offset + min_block_size;
+  payload = (payload + mask) & ~mask;
+  return payload - offset - (uintptr_t)block;
+}
 
-  // BLOCK的后一个Block来说最后的front bit应该是？
-  bool result_front_bit = true;
-  block_t *result_last_block = block;
+/**
+ * @brief 如果BLOCK中放得下Payload对齐ALIGNMENT、大小为ASIZE的Block，
+ * 就将其之前的部分切分为一个Free Block，返回对齐之后的Block
+ *
+ * @note 切分出来的Block至少是min_block_size，并且会被推入链表；
+ * deduce_extend_size为对齐大页的Block额外预留了一个大页，memalign的Block
+ * 由find_aligned_fit确认放得下，或者多找了ALIGNMENT + min_block_size的
+ * 空间，因此总能对齐
+ *
+ * @param block 未分配且不位于任何链表中的Block
+ * @param asize 目标大小
+ * @param alignment Payload的对齐，2的幂次
+ * @return block_t* 对齐之后的Block，同样未分配且不位于任何链表中
+ */
+static block_t *align_block(block_t *block, size_t asize, size_t alignment) {
+  dbg_requires(!get_alloc(block));
 
-  if ((block_size - asize) >= min_block_size) {
-    block_t *block_next;
-    write_block(block, asize, true, get_front_alloc(block));
+  size_t gap = deduce_align_gap(block, asize, alignment);
+  size_t size = get_size(block);
+  if (gap == 0 || gap + asize > size) {
+    return block;
+  }
 
-    block_next = find_next(block);
-    // 如果切分了Block，那么它之前的Block应该是未分配状态
-    write_block(block_next, block_size - asize, false, true);
-    // 将新的Free Block插入到合适的List中
-    push_list(deduce_list_index(block_size - asize),
-              (list_elem_t *)get_body(block_next));
-    // 它的前一个Block现在是free状态了
-    result_front_bit = false;
-    result_last_block = block_next;
+  uint8_t region = get_region(block);
+  block_t *aligned = (block_t *)((char *)block + gap);
+  rewrite_block(block, gap, false, region);
+  write_block(aligned, size - gap, false, false, region);
+  // 设置ALIGNED的front tiny bit
+  set_front_alloc_of_back_block(block, false);
+  push_list(deduce_list_index(gap), (list_elem_t *)get_body(block));
+  inherit_purge_state(block);
+  return aligned;
+}
 
-    // LIFO验证 dbg_ensures(block_next == free_list_root);
+/**
+ * @brief 计算为容纳大小为ASIZE的Block，extend_heap应当将堆拓展多少
+ *
+ * @par 增长策略：
+ * 1. 基础增长量为chunksize << 增长级别，几何增长，每次miss后级别加一，
+ *    每次free都会使其缓慢回落（见extend_credit）；
+ * 2. 增长量不超过当前堆大小的 1 / 2^extend_heap_shift，也不超过
+ *    max_extend_size；
+ * 3. 如果堆顶已经有一个同一Region的Free Block，extend_heap会将新空间与其
+ *    合并，因此只需补足ASIZE与它之间的差额；
+ * 4. 需要对齐大页的Block额外预留一个大页，见align_block；
+ *
+ * @param asize 需要容纳的Block的大小
+ * @param region 新空间所属的Region
+ * @return size_t extend_heap的参数
+ */
+static size_t deduce_extend_size(size_t asize, uint8_t region) {
+  bool align = deduce_huge_page_align(asize);
+  uint8_t level = extend_credit >> extend_credit_shift;
+  size_t grow = chunksize << level;
+  size_t cap = max(chunksize, mem_heapsize() >> extend_heap_shift);
+  if (grow > cap) {
+    grow = cap;
+  }
+  if (level < max_extend_level) {
+    extend_credit += 1 << extend_credit_shift;
   }
-  set_front_alloc_of_back_block(result_last_block, result_front_bit);
 
-  dbg_ensures(mm_checkheap(__LINE__));
-  dbg_ensures(get_alloc(block));
+  // 堆顶的Free Block可能正被malloc_list取走，只在其链表锁之下读取
+  block_t *tail = lock_free_prev(get_epilogue());
+  if (tail != NULL) {
+    size_t tail_size = get_region(tail) == region ? get_size(tail) : 0;
+    unlock_list_of(tail);
+    asize = asize > tail_size ? asize - tail_size : 0;
+  }
+  if (align) {
+    asize += heap_meta->huge_page_size;
+  }
+  return max(asize, grow);
 }
 
 /**
- * @brief 遍历INDEX对应的链表，寻找大小等于ASIZE或大于等于ASIZE + 32的块
- *
- * @par 扫描算法分为两个部分：
- * 1. 第一部分是在index对应链表中进行扫描，利用Best Fit算法，过程中
- *    如果遇到大小恰好为ASIZE的Block会立刻返回，如果遇到大于等于ssize
- *    的块则会将其记录。
- *
- *    如果一直到队列末尾都没有遇到大小相等的Block，同时有记录到ssize块的话
- *    那么会将该块返回，否则进入下一部分；
+ * @brief 如果BLOCK位于所在Segment的顶端且不小于trim_threshold，
+ * 将其缩小为chunksize，并将多余的空间归还给memlib
  *
- * 2. 第二部分的流程为First fit，需要使用ssize获取新的list table index，
- *    找到对应链表中第一个大于或等于ASIZE的Block并将其返回；
+ * @note 归还之后extend_credit减半，回退几何增长带来的多余空间
  *
- * 这一算法可有效减少内存的Internal Fragmentation现象
- *
- * @param[in] asize 目标大小
- * @param[in] index list_table下标
- * @return 块的地址，如果没有找到则是NULL
+ * @param block 刚刚合并完毕的Free Block，不位于任何链表中
+ * @pre get_alloc(block) == false
  */
-static block_t *find_good_fit(size_t asize, uint8_t index) {
-  dbg_assert(asize >= 32);
+static void trim_heap(block_t *block) {
+  dbg_requires(!get_alloc(block));
 
-  list_elem_t *list_elem;
-  block_t *block = NULL;
-  size_t ssize = asize + min_block_size;
-  // 保存满足条件( >= ssize )的Block
-  block_t *sblock = NULL;
+  size_t size = get_size(block);
+  if (size < trim_threshold || get_size(find_next(block)) != 0) {
+    return;
+  }
 
-  if (list_no_empty[index] == false) {
-    goto section2;
+  size_t release = size - chunksize;
+  int seg = mem_segment_of(block);
+  if (mem_segment_sbrk(seg, -(intptr_t)release) == (void *)-1) {
+    return;
   }
+  rewrite_block(block, chunksize, false, get_region(block));
+  write_epilogue(find_next(block), false);
+  extend_credit >>= 1;
+}
 
-  list_elem = get_next(get_list_by_index(index));
-  if (list_elem == END_OF_LIST) {
-    list_no_empty[index] = true;
-    goto section2;
+/**
+ * @brief 获取较大的Free Block中的dirty_elem_t
+ *
+ * @param block 不小于purge_min_size的Free Block
+ * @return dirty_elem_t*
+ */
+static inline dirty_elem_t *get_dirty_elem(block_t *block) {
+  dbg_requires(get_size(block) >= purge_min_size);
+  return (dirty_elem_t *)((char *)get_body(block) + dsize);
+}
+
+/**
+ * @brief 将BLOCK以STAMP插入到dirty list中PREV之后
+ *
+ * @param prev dirty list中的节点或者头节点，STAMP不能破坏stamp的单调性
+ * @param block 不小于purge_min_size的Free Block，不位于dirty list中
+ * @param stamp
+ */
+static void insert_dirty(dirty_elem_t *prev, block_t *block, word_t stamp) {
+  dirty_elem_t *elem = get_dirty_elem(block);
+  elem->stamp = stamp;
+  elem->prev = prev;
+  elem->next = prev->next;
+  prev->next->prev = elem;
+  prev->next = elem;
+}
+
+/**
+ * @brief 将BLOCK以当前的purge_clock推入dirty list的末尾
+ *
+ * @param block 不小于purge_min_size的Free Block，不位于dirty list中
+ */
+static void push_dirty(block_t *block) {
+  insert_dirty(heap_meta->dirty_list.prev, block, heap_meta->purge_clock);
+}
+
+/**
+ * @brief 如果BLOCK位于dirty list中，将其移出并标记为已经purge
+ *
+ * @param block 不小于purge_min_size的Free Block
+ */
+static void remove_dirty(block_t *block) {
+  dirty_elem_t *elem = get_dirty_elem(block);
+  if (elem->next == NULL) {
+    return;
   }
+  elem->prev->next = elem->next;
+  elem->next->prev = elem->prev;
+  elem->next = NULL;
+}
 
-  do {
-    block = payload_to_header(list_elem);
-    if (asize == get_size(block)) {
-      return block;
-    } else if (sblock == NULL && ssize <= get_size(block)) {
-      sblock = block;
+/**
+ * @brief 计算BLOCK中可以purge的范围，即跳过头部的链表节点以及尾部的
+ * Footer之后剩余的整页
+ *
+ * @param block 不小于purge_min_size的Free Block
+ * @param[out] lo 范围的起点，对齐页面
+ * @param[out] hi 范围的终点，对齐页面；不大于LO代表没有可以purge的页面
+ */
+static void deduce_purge_range(block_t *block, char **lo, char **hi) {
+  uintptr_t page_mask = ~(uintptr_t)(heap_meta->page_size - 1);
+  uintptr_t start = (uintptr_t)get_dirty_elem(block) + sizeof(dirty_elem_t);
+  uintptr_t end = (uintptr_t)block + get_size(block) - dsize;
+  *lo = (char *)((start + heap_meta->page_size - 1) & page_mask);
+  *hi = (char *)(end & page_mask);
+}
+
+/**
+ * @brief purge dirty list头部那些已经释放了至少purge_decay次free的Block，
+ * 每次最多BATCH个
+ *
+ * @par purge之后Block中的整页读出来都是0，直到它被分配或者合并为止；
+ * memlib无法purge的话（Sparse模式）就将page_size置0，不再尝试
+ *
+ * @param batch free调用时为purge_batch，后台维护线程每次只purge一个
+ * @return true purge了BATCH个Block，可能还有需要purge的Block
+ * @return false 已经没有需要purge的Block
+ */
+static bool purge_dirty_blocks(uint8_t batch) {
+  dirty_elem_t *root = &heap_meta->dirty_list;
+  for (uint8_t n = 0; n != batch; n++) {
+    dirty_elem_t *oldest = root->next;
+    if (oldest == root ||
+        heap_meta->purge_clock - oldest->stamp < purge_decay ||
+        heap_meta->page_size == 0) {
+      return false;
     }
-    list_elem = get_next(list_elem);
-  } while (list_elem != END_OF_LIST);
+    block_t *block = payload_to_header((char *)oldest - dsize);
+    char *lo, *hi;
+    deduce_purge_range(block, &lo, &hi);
+    if (lo < hi && !mem_purge(lo, hi - lo)) {
+      heap_meta->page_size = 0;
+      return false;
+    }
+    remove_dirty(block);
+  }
+  return true;
+}
+
+/**
+ * @brief 如果BLOCK位于dirty list中并且比已经记录的Block更早进入，
+ * 就改为记录它的位置，见heap_meta_t::inherit_prev
+ *
+ * @param block 即将移出链表的Free Block
+ */
+static void record_dirty_position(block_t *block) {
+  if (get_size(block) < purge_min_size) {
+    return;
+  }
+  dirty_elem_t *elem = get_dirty_elem(block);
+  if (elem->next == NULL) {
+    return;
+  }
+  // 已经记录的Block紧随BLOCK之后的话，BLOCK更早并且同样会被移出
+  if (heap_meta->inherit_prev == elem || heap_meta->inherit_prev == NULL ||
+      elem->stamp < heap_meta->inherit_stamp) {
+    heap_meta->inherit_prev = elem->prev;
+    heap_meta->inherit_stamp = elem->stamp;
+  }
+}
 
-  if (sblock != NULL) {
-    return sblock;
+/**
+ * @brief 在即将被分配的BLOCK移出链表之前，将其purge状态记录在heap_meta中：
+ * 已经purge的话记录purge的范围，否则记录它在dirty list中的位置
+ *
+ * @param block 仍位于链表中的Free Block
+ */
+static void record_taken_block(block_t *block) {
+  heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+  heap_meta->inherit_prev = NULL;
+  if (get_size(block) < purge_min_size) {
+    return;
   }
-section2:
-  index = deduce_list_index(ssize);
-  for (int i = index; i != LIST_TABLE_SIZE; i++) {
-    // 如果链表是空的直接跳过
-    if (list_no_empty[i] == false) {
-      continue;
-    }
+  if (get_dirty_elem(block)->next != NULL) {
+    record_dirty_position(block);
+  } else if (heap_meta->page_size != 0) {
+    deduce_purge_range(block, &heap_meta->zero_lo, &heap_meta->zero_hi);
+  }
+}
 
-    // 由于再清理链表元素的时候不会更新对应链表空状态，因此这里需要检查一下
-    list_elem = get_next(get_list_by_index(i));
-    if (list_elem == END_OF_LIST) {
-      // 如果没有更新空状态，那么需要显式更新一下
-      list_no_empty[i] = true;
-      continue;
+/**
+ * @brief 让刚刚推入链表的BLOCK继承被分配或者被合并的Block的purge状态
+ *
+ * @par 原Block尚未purge的话，BLOCK回到它在dirty list中的位置并沿用其
+ * stamp，否则不断从中切分小Block、或者不断有小Block与之合并，都会使它
+ * 永远不被purge；原Block已经purge并且BLOCK的purge范围依然都是0的话，
+ * BLOCK也保持已经purge的状态
+ *
+ * @param block 刚刚推入链表的Free Block
+ */
+static void inherit_purge_state(block_t *block) {
+  if (get_size(block) < purge_min_size) {
+    return;
+  }
+  if (heap_meta->inherit_prev != NULL) {
+    remove_dirty(block);
+    insert_dirty(heap_meta->inherit_prev, block, heap_meta->inherit_stamp);
+  } else if (heap_meta->zero_lo < heap_meta->zero_hi) {
+    char *lo, *hi;
+    deduce_purge_range(block, &lo, &hi);
+    if (lo >= heap_meta->zero_lo && hi <= heap_meta->zero_hi) {
+      remove_dirty(block);
     }
+  }
+}
 
-    do {
-      block = payload_to_header(list_elem);
-      // 优化掉了 get_alloc(block) 先比较是不是小于 get_size(block) + block size
-      if (ssize <= get_size(block)) {
-        return block;
-      }
-      list_elem = get_next(list_elem);
-    } while (list_elem != END_OF_LIST);
+/**
+ * @brief 检查并确定是否需要将BLOCK拆分为大小分别ASIZE和block size -
+ * ASIZE的两个block
+ *
+ * @note 如果分割出来的大小小于min_block_size，那就不必分了
+ *
+ * @param[in] block 待拆分的block
+ * @param[in] asize BLOCK的目标新大小
+ * @pre ASIZE < get_size(BLOCK)
+ * @pre asize对齐16 Byte
+ * @pre block必须已分配
+ */
+static void split_block(block_t *block, size_t asize) {
+  dbg_requires(get_alloc(block));
+  dbg_requires(asize <= get_size(block));
+  dbg_requires(check_word_align_dword((word_t)asize));
+  /* TODO: Can you write a precondition about the value of asize? */
+
+  size_t block_size = get_size(block);
+
+  // BLOCK的后一个Block来说最后的front bit应该是？
+  bool result_front_bit = true;
+  block_t *result_last_block = block;
+
+  if ((block_size - asize) >= min_block_size) {
+    block_t *block_next;
+    uint8_t region = get_region(block);
+    rewrite_block(block, asize, true, region);
+
+    block_next = find_next(block);
+    // 如果切分了Block，那么它之前的Block应该是未分配状态
+    write_block(block_next, block_size - asize, false, true, region);
+    // 它的前一个Block现在是free状态了
+    result_front_bit = false;
+    result_last_block = block_next;
   }
-  return NULL; // no fit found
+  // 推入链表之前设置，否则malloc_list取走BLOCK_NEXT之后会被这里覆盖
+  set_front_alloc_of_back_block(result_last_block, result_front_bit);
+  if (result_last_block != block) {
+    // 将新的Free Block插入到合适的List中
+    push_list(deduce_list_index(block_size - asize),
+              (list_elem_t *)get_body(result_last_block));
+    inherit_purge_state(result_last_block);
+
+    // LIFO验证 dbg_ensures(block_next == free_list_root);
+  }
+
+  dbg_ensures(check_heap(__LINE__));
+  dbg_ensures(get_alloc(block));
 }
 
 /**
- * @brief 找到第一个大于或等于ASIZE的Block，没有找到就切换到下一个链表
+ * @brief 原地将已分配的BLOCK扩大到ASIZE：吞并其后邻接的Free Block，
+ * 多余的部分再切分出去
  *
- * TODO 这里也需要加上一段，中间用来检查ASIZE是不是32或者48，如果是的话++index
+ * @note 调用者持有heap_lock；后一个Block属于另一个Region时不吞并，
+ * 与coalesce_block相同。BLOCK位于堆顶时先拓展堆，再吞并拓展出来的Block
  *
- * @param asize 目标大小
- * @param index list_table下标
- * @return block_t*
+ * @param block 已分配的普通Block
+ * @param asize 目标大小，对齐16 Byte
+ * @return bool 后一个Block已分配或者不够大时返回false，BLOCK保持不变
  */
-static block_t *find_first_fit(size_t asize, uint8_t index) {
-  list_elem_t *list_elem;
-  block_t *block = NULL;
-  // 如果链表是空的直接跳过
-  if (list_no_empty[index] == false) {
-    goto section2;
+static bool grow_block(block_t *block, size_t asize) {
+  dbg_requires(get_alloc(block));
+  dbg_requires(check_word_align_dword((word_t)asize));
+
+  size_t size = get_size(block);
+  if (asize <= size) {
+    return true;
+  }
+  if (extract_huge(block->header) || asize > max_normal_size) {
+    return false;
+  }
+  uint8_t region = get_region(block);
+  // 开启了新的Segment的话拓展出来的Block与BLOCK不相邻，下面照常失败
+  if (find_next(block) == get_epilogue() &&
+      extend_heap(asize - size, region) == NULL) {
+    return false;
+  }
+  block_t *next = lock_free_next(block);
+  if (next == NULL) {
+    return false;
+  }
+  size_t next_size = get_size(next);
+  if (get_region(next) != region || size + next_size < asize ||
+      size + next_size > max_normal_size) {
+    unlock_list_of(next);
+    return false;
   }
+  record_taken_block(next);
+  remove_list_elem(get_body(next));
+  unlock_list_of(next);
+  rewrite_block(block, size + next_size, true, region);
+  split_block(block, asize);
+  return true;
+}
 
-  // 由于再清理链表元素的时候不会更新对应链表空状态，因此这里需要检查一下
-  list_elem = get_next(get_list_by_index(index));
+/**
+ * @brief 在REGION中INDEX对应的链表里，找到第一个大于或等于ASIZE的Block
+ *
+ * @note 如果链表实际上是空的，会顺便将其在Bitmap中的状态清零；
+ * 调用者持有该链表的锁
+ *
+ * @param asize 目标大小
+ * @param region 在哪个Region的链表中查找
+ * @param index list_table下标
+ * @return block_t* 没有找到则返回NULL
+ */
+static block_t *find_first_fit(size_t asize, uint8_t region, uint8_t index) {
+  list_elem_t *list_elem = get_next(get_list_by_index(region, index));
   if (list_elem == END_OF_LIST) {
-    // 如果没有更新空状态，那么需要显式更新一下
-    list_no_empty[index] = true;
-    goto section2;
+    // 移除Block的时候不会更新Bitmap，因此需要在这里显式更新一下
+    set_list_no_empty(region, index, false);
+    return NULL;
   }
 
   do {
-    block = payload_to_header(list_elem);
+    block_t *block = payload_to_header(list_elem);
     if (asize <= get_size(block)) {
       return block;
     }
     list_elem = get_next(list_elem);
   } while (list_elem != END_OF_LIST);
-  if (asize == 32 || asize == 48) {
-    index++;
-  }
-section2:
-  for (int i = index; i < LIST_TABLE_SIZE; i++) {
-    // 如果链表是空的直接跳过
-    if (list_no_empty[i] == false) {
-      continue;
-    }
+  return NULL; // no fit found
+}
 
-    // 由于再清理链表元素的时候不会更新对应链表空状态，因此这里需要检查一下
-    list_elem = get_next(get_list_by_index(i));
-    if (list_elem == END_OF_LIST) {
-      // 如果没有更新空状态，那么需要显式更新一下
-      list_no_empty[i] = true;
+/**
+ * @brief 在INDEX对应链表的前near_fit_window个元素中，寻找大小恰好为ASIZE且
+ * 距离该链表rover最近的Block
+ *
+ * @par rover是该链表上一次放置的Block的末尾，因此连续分配的同类对象
+ * （例如bdd中的节点）会被放在一起，在cache以及TLB中也更加集中
+ *
+ * @note 调用者持有该链表的锁
+ *
+ * @param asize 目标大小
+ * @param region 在哪个Region的链表中查找
+ * @param index list_table下标
+ * @return block_t* 没有找到则返回NULL
+ */
+static block_t *find_near_fit(size_t asize, uint8_t region, uint8_t index) {
+  void *rover =
+      __atomic_load_n(&heap_meta->list_table[region][index].rover,
+                      __ATOMIC_RELAXED);
+  block_t *near_block = NULL;
+  size_t near_dist = SIZE_MAX;
+  uint8_t count = 0;
+
+  for (list_elem_t *list_elem = get_next(get_list_by_index(region, index));
+       list_elem != END_OF_LIST && count != near_fit_window;
+       list_elem = get_next(list_elem), count++) {
+    block_t *block = payload_to_header(list_elem);
+    if (get_size(block) != asize) {
       continue;
     }
-
-    do {
-      block = payload_to_header(list_elem);
-      if (asize <= get_size(block)) {
-        return block;
-      }
-      list_elem = get_next(list_elem);
-    } while (list_elem != END_OF_LIST);
+    size_t dist = address_distance(block, rover);
+    if (dist < near_dist) {
+      near_block = block;
+      near_dist = dist;
+    }
   }
-  return NULL; // no fit found
+  return near_block;
 }
 
 /**
- * @brief 根据ASIZE选择调用合适的fit函数
+ * @brief 在REGION的链表中为ASIZE寻找合适的Free Block
+ *
+ * @par 查找分为三步：
+ * 1. 在ASIZE对应的链表中寻找大小恰好相等的Block（find_near_fit）；
+ * 2. 利用Bitmap跳过空链表，从ssize = ASIZE + min_block_size对应的链表开始
+ *    寻找第一个不小于ssize的Block，这样的Block切分后剩余部分仍是合法的
+ *    Block。精确链表中的任何一个Block都满足条件，因此只需查看链表头部；
+ * 3. 最后才使用介于ASIZE与ssize之间、无法切分的Block；
+ *
+ * 精确链表使得前两步几乎不需要遍历链表，同时可以减少Internal Fragmentation
+ *
+ * @note 每个链表都在它的锁之下查找，找到时依然持有所在链表的锁，
+ * 由调用者将Block移出链表之后释放，见take_block
  *
  * @param asize
- * @return block_t*
+ * @param region 在哪个Region的链表中查找
+ * @return block_t* 没有找到则返回NULL
  */
-static inline block_t *find_fit(size_t asize) {
+static block_t *find_fit(size_t asize, uint8_t region) {
   uint8_t index = deduce_list_index(asize);
-  block_t *result = index_to_fit_func[index](asize, index);
-  return result;
+  size_t ssize = asize + min_block_size;
+  uint8_t sindex = deduce_list_index(ssize);
+  block_t *block;
+
+  if (get_list_no_empty(region, index)) {
+    lock_list(region, index);
+    block = find_near_fit(asize, region, index);
+    if (block != NULL) {
+      return block;
+    }
+    unlock_list(region, index);
+  }
+
+  for (uint8_t i = find_no_empty_list(region, sindex); i != LIST_TABLE_SIZE;
+       i = find_no_empty_list(region, i + 1)) {
+    lock_list(region, i);
+    block = find_first_fit(ssize, region, i);
+    if (block != NULL) {
+      return block;
+    }
+    unlock_list(region, i);
+  }
+
+  for (uint8_t i = find_no_empty_list(region, index); i <= sindex;
+       i = find_no_empty_list(region, i + 1)) {
+    lock_list(region, i);
+    block = find_first_fit(asize, region, i);
+    if (block != NULL) {
+      return block;
+    }
+    unlock_list(region, i);
+  }
+  return NULL; // no fit found
 }
 
 /**
- * @brief 获取一个Cluster，如果没有则返回NULL
+ * @brief 在REGION的链表中寻找对齐ALIGNMENT之后仍放得下ASIZE的Free Block
  *
- * @return block_t*
+ * @par 逐个检查Block切掉对齐之前的部分（见deduce_align_gap）之后是否还
+ * 放得下，而不是要求多出ALIGNMENT + min_block_size的最坏情况，地址恰好
+ * 合适的较小Block因此也可以使用。每个链表只查看前near_fit_window个元素
+ *
+ * @note 与find_fit相同，找到时依然持有所在链表的锁
+ *
+ * @param asize 调整之后的Block大小
+ * @param region 在哪个Region的链表中查找
+ * @param alignment Payload的对齐，2的幂次
+ * @return block_t* 没有找到则返回NULL
  */
-static block_t *find_cluster_fit() {
-  list_elem_t *list_elem;
-  if (list_no_empty[G_16] == false) {
-    return NULL;
+static block_t *find_aligned_fit(size_t asize, uint8_t region,
+                                 size_t alignment) {
+  for (uint8_t i = find_no_empty_list(region, deduce_list_index(asize));
+       i != LIST_TABLE_SIZE; i = find_no_empty_list(region, i + 1)) {
+    lock_list(region, i);
+    uint8_t count = 0;
+    for (list_elem_t *list_elem = get_next(get_list_by_index(region, i));
+         list_elem != END_OF_LIST && count != near_fit_window;
+         list_elem = get_next(list_elem), count++) {
+      block_t *block = payload_to_header(list_elem);
+      if (deduce_align_gap(block, asize, alignment) + asize <=
+          get_size(block)) {
+        return block;
+      }
+    }
+    unlock_list(region, i);
   }
+  return NULL; // no fit found
+}
 
-  list_elem = get_next(get_list_by_index(G_16));
-  if (list_elem == END_OF_LIST) {
-    list_no_empty[G_16] = true;
-    return NULL;
+/**
+ * @brief 获取REGION中最满的未满Cluster，如果没有则返回NULL
+ *
+ * @par 新的Cluster Block集中到少数几个Cluster中，几乎为空的Cluster
+ * 就有机会被清空并归还
+ *
+ * @param region
+ * @return block_t*
+ */
+static block_t *find_cluster_fit(uint8_t region) {
+  for (int count = CLUSTER_BLOCK_COUNT - 1; count >= 0; count--) {
+    list_elem_t *list_elem = get_next(get_cluster_list(region, count));
+    if (list_elem != END_OF_LIST) {
+      return payload_to_header(list_elem);
+    }
   }
-  // 非空的话返回第一个就好了
-  return payload_to_header(list_elem);
+  return NULL;
 }
 
 /**
@@ -2424,419 +4181,2643 @@ static block_t *find_best_fit(size_t asize, list_elem_t *root) {
 }
 
 /**
- * @brief 检查堆的不变性是否始终被满足
+ * @brief 取出一个属于REGION、大小为ASIZE的Block并将其标记为已分配，
+ * 找不到合适的Free Block时拓展堆
  *
- * @par Heap check：
- * - epilogue & prologue blocks 格式检查（见下）；
- * - Coalesce检查：堆中不可以有任何两个连续的Free Block存在；
+ * @note malloc、memalign与后台维护线程预先准备Cluster时共用
  *
- * @par List check：
- * - 前后两个Block需具有正确的next/previous指向；
- * - 所有指针都位于mem heap lo() & mem heap high()之间；
- * - 遍历堆得到的Free block数目应该和遍历free list得到的数目一致；
- * - segregated list相关（ @todo ）
+ * @param asize 调整之后的Block大小
+ * @param region Block所属的Region
+ * @param alignment Payload的对齐，为0代表只需双字对齐（以及对齐大页，
+ * 见deduce_huge_page_align）
+ * @return block_t* 切分完毕的已分配Block，堆无法拓展时返回NULL
+ */
+static block_t *take_block(size_t asize, uint8_t region, size_t alignment) {
+  // 需要对齐时先找对齐之后恰好放得下的Block，找不到再多找一些空间，
+  // 用来切分掉Payload对齐之前的部分
+  size_t fit_size =
+      alignment == 0 ? asize : asize + alignment + min_block_size;
+  // 需要放外边 Search the free list for a fit
+  // block = find_good_fit(asize, deduce_list_index(asize));
+  block_t *block = NULL;
+  if (alignment != 0) {
+    block = find_aligned_fit(asize, region, alignment);
+  }
+  if (block == NULL) {
+    block = find_fit(fit_size, region);
+  }
+  // 拓展堆之前先把各级cache中的Payload还回来，它们合并之后也许放得下
+  if (block == NULL && heap_meta->cpu_caches != NULL && flush_cpu_caches()) {
+    block = find_fit(fit_size, region);
+  }
+
+  // If no fit is found, request more memory, and then and place the block
+  if (block == NULL) {
+    // 增长量随miss次数以及堆大小几何增长，见deduce_extend_size
+    size_t extendsize = deduce_extend_size(fit_size, region);
+    block = extend_heap(extendsize, region);
+    // 开启了新的Segment的话，原来堆顶的Free Block不再与新空间相邻，
+    // 此时按新Segment的堆顶重新计算增长量
+    while (block != NULL && get_size(block) < fit_size) {
+      extendsize = deduce_extend_size(fit_size, region);
+      block = extend_heap(extendsize, region);
+    }
+    // extend_heap returns an error
+    if (block == NULL) {
+      return NULL;
+    }
+    // 拓展出来的Block不小于chunksize，不在精确链表中，malloc_list不会
+    // 取走它，因此可以在推入链表之后再获取锁
+    lock_list_of(block);
+  }
+  return claim_block(block, asize, region, alignment);
+}
+
+/**
+ * @brief 将find_fit等找到的Free Block BLOCK移出链表，标记为已分配并切掉
+ * ASIZE之外的部分
  *
- * @par Block check：
- * - Block地址均对齐16Byte；
- * - Block都在Heap的边界之内；
- * - Free之后Block的allocate bit应该被合理设置；
- * - 每个Block的Header和Footer：
- *    - 大小是大于等于Block的最小值；
- *    - prev和next是否具有一致性；
- *    - allocate bit是否符合实际情况；
- *    - Header和Footer是否相互匹配；
+ * @param block 调用者持有它所在链表的锁，返回之前释放
+ * @param asize 调整之后的Block大小
+ * @param region Block所属的Region
+ * @param alignment 见take_block
+ * @return block_t* 切分完毕的已分配Block
+ */
+static block_t *claim_block(block_t *block, size_t asize, uint8_t region,
+                            size_t alignment) {
+  // The block should be marked as free
+  dbg_assert(!get_alloc(block));
+  // Mark block as allocated，移出链表之前记下其中已经purge的范围
+  record_taken_block(block);
+  remove_list_elem(get_body(block));
+  unlock_list_of(block);
+  if (alignment != 0) {
+    block = align_block(block, asize, alignment);
+  } else if (deduce_huge_page_align(asize)) {
+    block = align_block(block, asize, heap_meta->huge_page_size);
+  }
+  size_t block_size = get_size(block);
+  rewrite_block(block, block_size, true, region);
+  // Try to split the block if too large
+  split_block(block, asize);
+  // 同一链表的下一次分配优先选择紧随其后的Block
+  __atomic_store_n(&heap_meta->list_table[region][deduce_list_index(asize)].rover,
+                   (void *)find_next(block), __ATOMIC_RELAXED);
+  return block;
+}
+
+/**
+ * @brief free是否应当把trim和purge留给后台维护线程
  *
- * @par free list方面，epilogue block需保持如下不变性：
- * - next元素始终为NULL：可用于检测是否到达free list的末尾；
- * - prev元素始终指向block_t：可将初次插入以及后续插入
- *   平凡化为同一种情况，将其当作普通的block修改指针即可；
- * -
- * 由于堆初始情况下即包含有一个大小为chunksize的block，因此prev元素不可为NULL；
+ * @par 后台线程没有运行，或者已经落后maintain_lag次free以上时，free依然
+ * 自己完成这些工作，前台因此从不需要等待后台线程赶上来
  *
- * @par coalesce block方面，epilogue block和prologue blcok都需保持
+ * @return bool
+ */
+static inline bool deduce_deferred(void) {
+  return maintainer_running &&
+         heap_meta->purge_clock - heap_meta->maintain_mark < maintain_lag;
+}
+
+/**
+ * @brief 前台正在等待heap_lock时，后台维护线程应当在完成当前这一步之后
+ * 立即让出
+ *
+ * @return bool
+ */
+static inline bool deduce_yield(void) {
+  return atomic_load_explicit(&yield_request, memory_order_relaxed);
+}
+
+/**
+ * @brief 如果第SEG个Segment顶端是不小于trim_threshold的Free Block，
+ * 将多余的空间归还给memlib
+ *
+ * @note 后台维护线程运行时release_block不再调用trim_heap，由这里代劳；
+ * Block在dirty list中的位置以及已经purge的范围都保持不变
+ *
+ * @param seg Segment的编号
+ */
+static void trim_segment(int seg) {
+  block_t *epilogue = (block_t *)((char *)mem_segment_hi(seg) - 3);
+  block_t *block = lock_free_prev(epilogue);
+  if (block == NULL) {
+    return;
+  }
+  if (get_cluster(block) || get_size(block) < trim_threshold) {
+    unlock_list_of(block);
+    return;
+  }
+  record_taken_block(block);
+  remove_list_elem(get_body(block));
+  unlock_list_of(block);
+  trim_heap(block);
+  push_list(deduce_list_index(get_size(block)),
+            (list_elem_t *)get_body(block));
+  inherit_purge_state(block);
+}
+
+/**
+ * @brief 堆的后台维护，每次由maintainer_main在持有heap_lock时调用
+ *
+ * @par 依次执行以下工作，每一步都很短，前台等待heap_lock时立即返回：
+ * 1. 为最近当场创建过Cluster、现在又没有未满Cluster的Region预先准备一个
+ *    空的Cluster，下一次分配Cluster Block时就不必再切分或者拓展堆；
+ * 2. 归还各Segment顶端多余的空间；
+ * 3. purge所有已经到期的dirty Block；
+ * 完整地执行一遍之后记下purge_clock，见deduce_deferred
+ *
+ * @note 合并依然在free中立即完成：它只需要读写相邻Block的tag，而且
+ * mm_checkheap要求堆中没有相邻的Free Block；出于同样的原因，普通Block
+ * 无法预先切分，只有Cluster可以提前准备
+ */
+static void maintain_heap(void) {
+  if (heap_meta == NULL) {
+    return;
+  }
+  for (uint8_t r = 0; r != REGION_COUNT; r++) {
+    if (deduce_yield()) {
+      return;
+    }
+    if ((heap_meta->cluster_wanted >> r & 1) && find_cluster_fit(r) == NULL) {
+      block_t *block = take_block(cluster_size, r, 0);
+      if (block != NULL) {
+        create_cluster(block);
+      }
+    }
+  }
+  for (int seg = 0; seg != mem_segment_count(); seg++) {
+    if (deduce_yield()) {
+      return;
+    }
+    trim_segment(seg);
+  }
+  do {
+    if (deduce_yield()) {
+      return;
+    }
+  } while (purge_dirty_blocks(1));
+  heap_meta->maintain_mark = heap_meta->purge_clock;
+}
+
+/**
+ * @brief 后台维护线程的主循环：每隔maintain_interval尝试获取heap_lock，
+ * 获取成功就执行一次maintain_heap
+ *
+ * @note 只尝试而不等待，前台正在分配时就跳过这一轮；获取之后再确认一次
+ * 没有被暂停，mm_maintenance_stop据此只需等待heap_lock
+ *
+ * @param arg 未使用
+ * @return void*
+ */
+static void *maintainer_main(void *arg) {
+  struct timespec interval = {0, maintain_interval};
+  while (true) {
+    nanosleep(&interval, NULL);
+    if (atomic_load(&maintainer_paused) ||
+        pthread_mutex_trylock(&heap_lock) != 0) {
+      continue;
+    }
+    if (!atomic_load(&maintainer_paused)) {
+      atomic_store_explicit(&maintainer_busy, true, memory_order_relaxed);
+      maintain_heap();
+      atomic_store_explicit(&maintainer_busy, false, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&heap_lock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief 前台的分配函数在访问堆之前调用，获取heap_lock
+ *
+ * @par 获取失败并且是后台线程在执行maintain_heap时，设置yield_request，
+ * 它会在完成当前这一步之后让出；前台线程之间的竞争不触碰yield_request
+ *
+ * @note mdriver是单线程的，只在后台线程运行时才需要加锁；interposition
+ * 构建（libmm.so）总是加锁
+ */
+static void lock_heap(void) {
+  if (!maintainer_running && !always_lock) {
+    return;
+  }
+  if (pthread_mutex_trylock(&heap_lock) != 0) {
+    bool yield =
+        atomic_load_explicit(&maintainer_busy, memory_order_relaxed);
+    if (yield) {
+      atomic_store_explicit(&yield_request, true, memory_order_relaxed);
+    }
+    pthread_mutex_lock(&heap_lock);
+    if (yield) {
+      atomic_store_explicit(&yield_request, false, memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @brief 与lock_heap配对，释放heap_lock
+ */
+static void unlock_heap(void) {
+  if (!maintainer_running && !always_lock) {
+    return;
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/**
+ * @brief fork之前获取heap_lock以及所有链表的锁，子进程因此不会继承只修改
+ * 了一半的堆
+ */
+static void prepare_fork(void) {
+  lock_heap();
+  lock_all_lists();
+}
+
+/**
+ * @brief fork之后父进程释放prepare_fork获取的锁
+ */
+static void finish_fork_parent(void) {
+  unlock_all_lists();
+  unlock_heap();
+}
+
+/**
+ * @brief fork之后子进程重置heap_lock，释放prepare_fork获取的链表锁
+ *
+ * @note 子进程中只剩下调用fork的线程，heap_lock记录的却是父进程中线程的
+ * 所有权，只能重新初始化；后台维护线程同样没有被复制到子进程中
+ */
+static void finish_fork_child(void) {
+  pthread_mutex_t lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+  heap_lock = lock;
+  unlock_all_lists();
+  maintainer_running = false;
+  maintainer_created = false;
+  atomic_store(&yield_request, false);
+}
+
+/**
+ * @brief 在第一次分配时初始化堆，调用者已经执行lock_heap
+ *
+ * @par mdriver会自己调用mem_init和mm_init；interposition构建（libmm.so）
+ * 则在这里向操作系统预留堆的地址空间，注册fork处理函数，并尽量启用
+ * per-CPU cache。程序中最早的分配可能发生在任何构造函数之前，因此不能
+ * 依赖构造函数完成初始化
+ *
+ * @return true 堆已经初始化
+ * @return false 无法初始化
+ */
+static bool init_heap(void) {
+#ifndef DRIVER
+  if (mem_heap_lo() == NULL) {
+    mem_init(false);
+    pthread_atfork(prepare_fork, finish_fork_parent, finish_fork_child);
+  }
+  if (!mm_init()) {
+    return false;
+  }
+  mm_cpu_cache_start();
+  return true;
+#else
+  return mm_init();
+#endif
+}
+
+/**
+ * @brief BP是否不是从这个堆中分配出来的
+ *
+ * @par interposition构建中，动态链接器在libmm.so接管之前使用自己的分配器，
+ * 这样的指针之后仍可能被交给free和realloc
+ *
+ * @param bp
+ * @return bool
+ */
+static inline bool deduce_foreign(void *bp) {
+#ifdef DRIVER
+  return false;
+#else
+  return mem_segment_of(bp) < 0;
+#endif
+}
+
+/** @brief copy_foreign一次系统调用最多读取的页面数 */
+#define FOREIGN_COPY_PAGES 64
+
+/**
+ * @brief 将不属于这个堆的SRC处至多SIZE字节复制到DST，遇到不可读的页面为止
+ *
+ * @par 这样的指针不知道原有大小：动态链接器自己的分配器没有glibc那样的
+ * Chunk Header，可以查询的malloc_usable_size并不存在。对自身调用
+ * process_vm_readv，每个页面一个iovec，内核在第一个不可读的页面处停下而
+ * 不是产生SIGSEGV，于是原有的对象不论跨越多少页面都被完整复制，多复制的
+ * 部分只是realloc本就未定义的内容。系统调用不可用时（例如被seccomp禁止）
+ * 退回到只复制到SRC所在页面的末尾
+ *
+ * @param[out] dst
+ * @param[in] src 不属于这个堆的Payload
+ * @param[in] size 最多复制的字节数
+ * @return size_t 复制的字节数
+ */
+static size_t copy_foreign(void *dst, const void *src, size_t size) {
+  size_t page_size = mem_pagesize();
+  size_t copied = 0;
+  while (copied < size) {
+    struct iovec local;
+    struct iovec remote[FOREIGN_COPY_PAGES];
+    const char *from = (const char *)src + copied;
+    size_t count = 0;
+    size_t len = 0;
+    while (count < FOREIGN_COPY_PAGES && copied + len < size) {
+      size_t rest = page_size - ((word_t)(from + len) & (page_size - 1));
+      if (rest > size - copied - len) {
+        rest = size - copied - len;
+      }
+      remote[count].iov_base = (void *)(from + len);
+      remote[count].iov_len = rest;
+      count++;
+      len += rest;
+    }
+    local.iov_base = (char *)dst + copied;
+    local.iov_len = len;
+    ssize_t done = process_vm_readv(getpid(), &local, 1, remote, count, 0);
+    if (done <= 0) {
+      break;
+    }
+    copied += done;
+    if ((size_t)done < len) {
+      break;
+    }
+  }
+  if (copied == 0) {
+    copied = page_size - ((word_t)src & (page_size - 1));
+    if (copied > size) {
+      copied = size;
+    }
+    memcpy(dst, src, copied);
+  }
+  return copied;
+}
+
+/**
+ * @brief 获取BP所指向的Payload所在的Region
+ *
+ * @note Cluster Block的Region即是其所在Cluster的Region
+ *
+ * @param bp
+ * @return uint8_t
+ */
+static uint8_t get_payload_region(void *bp) {
+  block_t *block = payload_to_header(bp);
+  if (get_cluster(block)) {
+    void *cluster_block = payload_to_cluster_block(bp);
+    uint8_t num = get_cluster_block_number(cluster_block);
+    block = get_cluster_by_cluster_block(cluster_block, num);
+  }
+  return get_region(block);
+}
+
+/**
+ * @brief BP所指向的Payload实际可用的字节数
+ *
+ * @note Cluster Block的Payload只有15 Byte
+ *
+ * @param bp
+ * @return size_t
+ */
+static size_t get_payload_size(void *bp) {
+  block_t *block = payload_to_header(bp);
+  return get_cluster(block) ? cluster_block_size - 1 : get_body_size(block);
+}
+
+/**
+ * @brief 大小为SIZE的请求所属的per-CPU cache大小类
+ *
+ * @note 与malloc_region的判断保持一致：Cluster Block为0号类，其余按照
+ * 调整之后的Block大小划分
+ *
+ * @param size 目标payload的大小
+ * @return uint8_t 不在任何大小类中时返回CPU_CACHE_CLASS_COUNT
+ */
+static inline uint8_t deduce_cache_class(size_t size) {
+  if (size > min_block_size - overhead_size && size < dsize) {
+    return 0;
+  }
+  if (size == 0 ||
+      size > (CPU_CACHE_CLASS_COUNT - 1) * dsize - overhead_size) {
+    return CPU_CACHE_CLASS_COUNT;
+  }
+  return round_up(size + overhead_size, dsize) / dsize;
+}
+
+/**
+ * @brief 已分配的Payload BP所属的per-CPU cache大小类
+ *
+ * @note 只读取BP自己（或者其Cluster）的Header，调用者持有BP，因此不必
+ * 获取heap_lock；Huge Block以及REGION_LONG中的Block不进入cache
+ *
+ * @param bp
+ * @return uint8_t 不在任何大小类中时返回CPU_CACHE_CLASS_COUNT
+ */
+static inline uint8_t deduce_payload_class(void *bp) {
+  block_t *block = payload_to_header(bp);
+  if (get_cluster(block)) {
+    return get_payload_region(bp) == REGION_SHORT ? 0 : CPU_CACHE_CLASS_COUNT;
+  }
+  if (extract_huge(block->header) || get_region(block) != REGION_SHORT) {
+    return CPU_CACHE_CLASS_COUNT;
+  }
+  size_t size = get_size(block);
+  if (size > (CPU_CACHE_CLASS_COUNT - 1) * dsize) {
+    return CPU_CACHE_CLASS_COUNT;
+  }
+  return size / dsize;
+}
+
+/**
+ * @brief 从当前CPU的cache中取出一个CLASS类的Payload，存入*BP
+ *
+ * @par 整个过程是一个restartable sequence：读取rseq中的CPU编号，找到该CPU
+ * 的cache，读出栈顶的Payload，最后一条指令写回count作为提交。线程在提交
+ * 之前被抢占或者迁移到其他CPU时，内核让它跳转到abort处，从头再来，因此
+ * 不需要任何锁或者原子操作
+ *
+ * @note 描述这段代码的struct rseq_cs位于__rseq_cs节中，abort处之前的4 Byte
+ * 必须是RSEQ_SIG
+ *
+ * @param cls 大小类
+ * @param bp 用于接收Payload
+ * @return true 取到了Payload
+ * @return false cache为空，或者CPU编号超出cpu_count，应当使用普通路径
+ */
+static bool cpu_cache_pop(uint8_t cls, void **bp) {
+#if CPU_CACHE_RSEQ
+  struct rseq *rs =
+      (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+  size_t count_off = cls * sizeof(uint32_t);
+  size_t slot_off =
+      offsetof(cpu_cache_t, slot) + cls * CPU_CACHE_DEPTH * sizeof(void *);
+retry:
+  __asm__ goto(".pushsection __rseq_cs, \"aw\"\n\t"
+               ".balign 32\n\t"
+               "3:\n\t"
+               ".long 0, 0\n\t"
+               ".quad 1f, 2f - 1f, 4f\n\t"
+               ".popsection\n\t"
+               "leaq 3b(%%rip), %%rax\n\t"
+               "movq %%rax, %c[cs_off](%[rs])\n\t"
+               "1:\n\t"
+               "movl %c[cpu_off](%[rs]), %%eax\n\t"
+               "cmpl %[cpu_count], %%eax\n\t"
+               "jae %l[miss]\n\t"
+               "imulq %[stride], %%rax\n\t"
+               "addq %[caches], %%rax\n\t"
+               "movl (%%rax, %[count_off]), %%ecx\n\t"
+               "testl %%ecx, %%ecx\n\t"
+               "jz %l[miss]\n\t"
+               "leaq -8(%%rax, %[slot_off]), %%rdx\n\t"
+               "movq (%%rdx, %%rcx, 8), %%rdx\n\t"
+               "movq %%rdx, (%[bp])\n\t"
+               "decl %%ecx\n\t"
+               "movl %%ecx, (%%rax, %[count_off])\n\t"
+               "2:\n\t"
+               ".pushsection __rseq_failure, \"ax\"\n\t"
+               ".byte 0x0f, 0xb9, 0x3d\n\t"
+               ".long %c[sig]\n\t"
+               "4:\n\t"
+               "jmp %l[retry]\n\t"
+               ".popsection\n\t"
+               :
+               : [rs] "r"(rs), [cpu_count] "r"(heap_meta->cpu_count),
+                 [stride] "r"(cpu_cache_stride),
+                 [caches] "r"(heap_meta->cpu_caches),
+                 [count_off] "r"(count_off), [slot_off] "r"(slot_off),
+                 [bp] "r"(bp), [cs_off] "i"(offsetof(struct rseq, rseq_cs)),
+                 [cpu_off] "i"(offsetof(struct rseq, cpu_id)),
+                 [sig] "i"(RSEQ_SIG)
+               : "rax", "rcx", "rdx", "memory", "cc"
+               : miss, retry);
+  return true;
+miss:
+#endif
+  return false;
+}
+
+/**
+ * @brief 将CLASS类的Payload BP放入当前CPU的cache，与cpu_cache_pop相对应
+ *
+ * @param cls 大小类
+ * @param bp
+ * @return true 已经放入cache
+ * @return false cache已满，或者CPU编号超出cpu_count，应当使用普通路径
+ */
+static bool cpu_cache_push(uint8_t cls, void *bp) {
+#if CPU_CACHE_RSEQ
+  struct rseq *rs =
+      (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+  size_t count_off = cls * sizeof(uint32_t);
+  size_t slot_off =
+      offsetof(cpu_cache_t, slot) + cls * CPU_CACHE_DEPTH * sizeof(void *);
+retry:
+  __asm__ goto(".pushsection __rseq_cs, \"aw\"\n\t"
+               ".balign 32\n\t"
+               "3:\n\t"
+               ".long 0, 0\n\t"
+               ".quad 1f, 2f - 1f, 4f\n\t"
+               ".popsection\n\t"
+               "leaq 3b(%%rip), %%rax\n\t"
+               "movq %%rax, %c[cs_off](%[rs])\n\t"
+               "1:\n\t"
+               "movl %c[cpu_off](%[rs]), %%eax\n\t"
+               "cmpl %[cpu_count], %%eax\n\t"
+               "jae %l[miss]\n\t"
+               "imulq %[stride], %%rax\n\t"
+               "addq %[caches], %%rax\n\t"
+               "movl (%%rax, %[count_off]), %%ecx\n\t"
+               "cmpl %[depth], %%ecx\n\t"
+               "jae %l[miss]\n\t"
+               "leaq (%%rax, %[slot_off]), %%rdx\n\t"
+               "movq %[bp], (%%rdx, %%rcx, 8)\n\t"
+               "incl %%ecx\n\t"
+               "movl %%ecx, (%%rax, %[count_off])\n\t"
+               "2:\n\t"
+               ".pushsection __rseq_failure, \"ax\"\n\t"
+               ".byte 0x0f, 0xb9, 0x3d\n\t"
+               ".long %c[sig]\n\t"
+               "4:\n\t"
+               "jmp %l[retry]\n\t"
+               ".popsection\n\t"
+               :
+               : [rs] "r"(rs), [cpu_count] "r"(heap_meta->cpu_count),
+                 [stride] "r"(cpu_cache_stride),
+                 [caches] "r"(heap_meta->cpu_caches),
+                 [count_off] "r"(count_off), [slot_off] "r"(slot_off),
+                 [bp] "r"(bp), [depth] "i"(CPU_CACHE_DEPTH),
+                 [cs_off] "i"(offsetof(struct rseq, rseq_cs)),
+                 [cpu_off] "i"(offsetof(struct rseq, cpu_id)),
+                 [sig] "i"(RSEQ_SIG)
+               : "rax", "rcx", "rdx", "memory", "cc"
+               : miss, retry);
+  return true;
+miss:
+#endif
+  return false;
+}
+
+/**
+ * @brief depot栈顶TOP所指向的magazine
+ *
+ * @param top 带有版本号的栈顶指针
+ * @return magazine_t* 栈为空时返回NULL
+ */
+static inline magazine_t *depot_untag(word_t top) {
+  return (magazine_t *)(top & (((word_t)1 << depot_tag_shift) - 1));
+}
+
+/**
+ * @brief depot栈中magazine的数目
+ *
+ * @note 读到的栈顶可能随即被其他线程弹出，结果只用于估计工作集
+ *
+ * @param stack
+ * @return uint32_t
+ */
+static uint32_t depot_depth(_Atomic word_t *stack) {
+  magazine_t *mag = depot_untag(atomic_load(stack));
+  return mag == NULL ? 0 : mag->depth;
+}
+
+/**
+ * @brief 将MAG压入depot栈STACK，没有竞争时只需要一次比较交换
+ *
+ * @par 栈顶指针的高位是版本号，每次修改都加一，其他线程在此期间弹出并
+ * 重新压入同一个magazine时比较交换依然会失败
+ *
+ * @param stack
+ * @param mag
+ */
+static void depot_push(_Atomic word_t *stack, magazine_t *mag) {
+  word_t top = atomic_load(stack);
+  word_t tag;
+  do {
+    magazine_t *next = depot_untag(top);
+    mag->next = next;
+    mag->depth = next == NULL ? 1 : next->depth + 1;
+    tag = (top >> depot_tag_shift) + 1;
+  } while (!atomic_compare_exchange_weak(stack, &top,
+                                         (word_t)mag | tag << depot_tag_shift));
+}
+
+/**
+ * @brief 从depot栈STACK中弹出一个magazine，没有竞争时只需要一次比较交换
+ *
+ * @note magazine在cache启用期间不会被释放（reclaim_depot也只是把它倒空），
+ * 因此读取栈顶的next总是安全的；读到的next已经过时的话，版本号使得
+ * 比较交换失败
+ *
+ * @param stack
+ * @param min 弹出之后栈的深度小于*MIN时更新*MIN，见reclaim_depot；
+ * 为NULL时不记录
+ * @return magazine_t* 栈为空时返回NULL
+ */
+static magazine_t *depot_pop(_Atomic word_t *stack, uint32_t *min) {
+  word_t top = atomic_load(stack);
+  magazine_t *mag;
+  do {
+    mag = depot_untag(top);
+    if (mag == NULL) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak(
+      stack, &top,
+      (word_t)mag->next |
+          ((top >> depot_tag_shift) + 1) << depot_tag_shift));
+  // 只是估计值，不值得再付出一次原子操作
+  if (min != NULL && mag->depth - 1 < *min) {
+    *min = mag->depth - 1;
+  }
+  return mag;
+}
+
+/**
+ * @brief 将当前CPU中CLASS类的cache的全部Payload移入空的magazine MAG，
+ * 清空cache
+ *
+ * @par 与cpu_cache_pop一样是restartable sequence：复制的过程只读取cache
+ * 以及写入MAG，最后一条指令将count写为0作为提交，中途被抢占时从头再来
+ *
+ * @param cls 大小类
+ * @param mag 空的magazine，成功时count为原先cache中Payload的数目
+ * @return true 已经清空cache
+ * @return false cache为空（其他线程抢先取走了全部Payload），或者CPU编号
+ * 超出cpu_count
+ */
+static bool cpu_cache_drain(uint8_t cls, magazine_t *mag) {
+#if CPU_CACHE_RSEQ
+  struct rseq *rs =
+      (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+  char *count_base = (char *)&heap_meta->cpu_caches->count[cls];
+  char *slot_base = (char *)heap_meta->cpu_caches->slot[cls];
+retry:
+  __asm__ goto(".pushsection __rseq_cs, \"aw\"\n\t"
+               ".balign 32\n\t"
+               "3:\n\t"
+               ".long 0, 0\n\t"
+               ".quad 1f, 2f - 1f, 4f\n\t"
+               ".popsection\n\t"
+               "leaq 3b(%%rip), %%rax\n\t"
+               "movq %%rax, %c[cs_off](%[rs])\n\t"
+               "1:\n\t"
+               "movl %c[cpu_off](%[rs]), %%eax\n\t"
+               "cmpl %[cpu_count], %%eax\n\t"
+               "jae %l[miss]\n\t"
+               "imulq %[stride], %%rax\n\t"
+               "movl (%[count_base], %%rax), %%ecx\n\t"
+               "testl %%ecx, %%ecx\n\t"
+               "jz %l[miss]\n\t"
+               "movl %%ecx, (%[mag_count])\n\t"
+               "leaq (%[slot_base], %%rax), %%r8\n\t"
+               "5:\n\t"
+               "movq -8(%%r8, %%rcx, 8), %%rdx\n\t"
+               "movq %%rdx, -8(%[round], %%rcx, 8)\n\t"
+               "decl %%ecx\n\t"
+               "jnz 5b\n\t"
+               "movl $0, (%[count_base], %%rax)\n\t"
+               "2:\n\t"
+               ".pushsection __rseq_failure, \"ax\"\n\t"
+               ".byte 0x0f, 0xb9, 0x3d\n\t"
+               ".long %c[sig]\n\t"
+               "4:\n\t"
+               "jmp %l[retry]\n\t"
+               ".popsection\n\t"
+               :
+               : [rs] "r"(rs), [cpu_count] "r"(heap_meta->cpu_count),
+                 [stride] "r"(cpu_cache_stride), [count_base] "r"(count_base),
+                 [slot_base] "r"(slot_base), [round] "r"(mag->round),
+                 [mag_count] "r"(&mag->count),
+                 [cs_off] "i"(offsetof(struct rseq, rseq_cs)),
+                 [cpu_off] "i"(offsetof(struct rseq, cpu_id)),
+                 [sig] "i"(RSEQ_SIG)
+               : "rax", "rcx", "rdx", "r8", "memory", "cc"
+               : miss, retry);
+  return true;
+miss:
+#endif
+  return false;
+}
+
+/**
+ * @brief 当前CPU中CLASS类的cache为空时，将装满的magazine MAG中的Payload
+ * 全部移入cache
+ *
+ * @par restartable sequence：只在count为0时写入slot，这些slot都不属于
+ * cache，中途被抢占也不会破坏cache；最后一条指令写回count作为提交
+ *
+ * @param cls 大小类
+ * @param mag 装满的magazine，成功时count为0
+ * @return true 已经装入cache
+ * @return false cache不为空（其他线程抢先释放了一些），或者CPU编号超出
+ * cpu_count
+ */
+static bool cpu_cache_fill(uint8_t cls, magazine_t *mag) {
+#if CPU_CACHE_RSEQ
+  struct rseq *rs =
+      (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+  char *count_base = (char *)&heap_meta->cpu_caches->count[cls];
+  char *slot_base = (char *)heap_meta->cpu_caches->slot[cls];
+retry:
+  __asm__ goto(".pushsection __rseq_cs, \"aw\"\n\t"
+               ".balign 32\n\t"
+               "3:\n\t"
+               ".long 0, 0\n\t"
+               ".quad 1f, 2f - 1f, 4f\n\t"
+               ".popsection\n\t"
+               "leaq 3b(%%rip), %%rax\n\t"
+               "movq %%rax, %c[cs_off](%[rs])\n\t"
+               "1:\n\t"
+               "movl %c[cpu_off](%[rs]), %%eax\n\t"
+               "cmpl %[cpu_count], %%eax\n\t"
+               "jae %l[miss]\n\t"
+               "imulq %[stride], %%rax\n\t"
+               "cmpl $0, (%[count_base], %%rax)\n\t"
+               "jne %l[miss]\n\t"
+               "leaq (%[slot_base], %%rax), %%r8\n\t"
+               "movl %[n], %%ecx\n\t"
+               "5:\n\t"
+               "movq -8(%[round], %%rcx, 8), %%rdx\n\t"
+               "movq %%rdx, -8(%%r8, %%rcx, 8)\n\t"
+               "decl %%ecx\n\t"
+               "jnz 5b\n\t"
+               "movl %[n], (%[count_base], %%rax)\n\t"
+               "2:\n\t"
+               ".pushsection __rseq_failure, \"ax\"\n\t"
+               ".byte 0x0f, 0xb9, 0x3d\n\t"
+               ".long %c[sig]\n\t"
+               "4:\n\t"
+               "jmp %l[retry]\n\t"
+               ".popsection\n\t"
+               :
+               : [rs] "r"(rs), [cpu_count] "r"(heap_meta->cpu_count),
+                 [stride] "r"(cpu_cache_stride), [count_base] "r"(count_base),
+                 [slot_base] "r"(slot_base), [round] "r"(mag->round),
+                 [n] "r"(mag->count),
+                 [cs_off] "i"(offsetof(struct rseq, rseq_cs)),
+                 [cpu_off] "i"(offsetof(struct rseq, cpu_id)),
+                 [sig] "i"(RSEQ_SIG)
+               : "rax", "rcx", "rdx", "r8", "memory", "cc"
+               : miss, retry);
+  mag->count = 0;
+  return true;
+miss:
+#endif
+  return false;
+}
+
+/**
+ * @brief 将depot中工作集之外的magazine归还：上一次reclaim以来从未被取用
+ * 的装满的magazine，其中的Payload释放回list_table，magazine本身转为空的
+ *
+ * @par 空的magazine不在这里释放：其他线程可能正在无锁的depot_pop中读取
+ * 它的next，只有mm_cpu_cache_stop才能释放
+ *
+ * @note 调用者已经执行lock_heap
+ */
+static void reclaim_depot(void) {
+  for (uint8_t cls = 0; cls != CPU_CACHE_CLASS_COUNT; cls++) {
+    uint32_t surplus = heap_meta->depot_full_min[cls];
+    uint32_t min = UINT32_MAX;
+    magazine_t *mag;
+    while (surplus-- != 0 &&
+           (mag = depot_pop(&heap_meta->depot_full[cls], &min)) != NULL) {
+      for (uint32_t i = 0; i != mag->count; i++) {
+        free_payload(mag->round[i]);
+      }
+      mag->count = 0;
+      depot_push(&heap_meta->depot_empty, mag);
+    }
+    heap_meta->depot_full_min[cls] = depot_depth(&heap_meta->depot_full[cls]);
+  }
+}
+
+/**
+ * @brief 记录一次magazine交换或者cache未能满足的分配，每depot_interval次
+ * 执行一次reclaim_depot
+ *
+ * @note depot_clock只是估计值，不使用原子操作
+ */
+static void tick_depot(void) {
+  if (++heap_meta->depot_clock % depot_interval == 0) {
+    lock_heap();
+    reclaim_depot();
+    unlock_heap();
+  }
+}
+
+/**
+ * @brief 当前CPU中CLASS类的cache为空时，从depot取来一个装满的magazine
+ *
+ * @return true cache中已经有Payload，应当重新尝试cpu_cache_pop
+ * @return false depot中没有装满的magazine，应当使用普通路径
+ */
+static bool cpu_cache_reload(uint8_t cls) {
+  magazine_t *mag =
+      depot_pop(&heap_meta->depot_full[cls], &heap_meta->depot_full_min[cls]);
+  if (mag == NULL) {
+    return false;
+  }
+  if (!cpu_cache_fill(cls, mag)) {
+    depot_push(&heap_meta->depot_full[cls], mag);
+    return false;
+  }
+  depot_push(&heap_meta->depot_empty, mag);
+  tick_depot();
+  return true;
+}
+
+/**
+ * @brief 当前CPU中CLASS类的cache已满时，将其装入一个空的magazine交给depot
+ *
+ * @par depot中没有空的magazine时从REGION_LONG中分配一个
+ *
+ * @return true cache已经清空，应当重新尝试cpu_cache_push
+ * @return false 无法分配magazine，应当使用普通路径
+ */
+static bool cpu_cache_unload(uint8_t cls) {
+  if (depot_depth(&heap_meta->depot_full[cls]) >= depot_full_max) {
+    magazine_t spill;
+    if (!cpu_cache_drain(cls, &spill)) {
+      return false;
+    }
+    lock_heap();
+    for (uint32_t i = 0; i != spill.count; i++) {
+      free_payload(spill.round[i]);
+    }
+    unlock_heap();
+    tick_depot();
+    return true;
+  }
+  magazine_t *mag = depot_pop(&heap_meta->depot_empty, NULL);
+  if (mag == NULL) {
+    lock_heap();
+    mag = malloc_region(sizeof(magazine_t), REGION_LONG);
+    unlock_heap();
+    if (mag == NULL) {
+      return false;
+    }
+  }
+  if (!cpu_cache_drain(cls, mag)) {
+    depot_push(&heap_meta->depot_empty, mag);
+    return false;
+  }
+  depot_push(&heap_meta->depot_full[cls], mag);
+  tick_depot();
+  return true;
+}
+
+/**
+ * @brief 堆即将拓展时，把depot以及当前CPU的cache中的Payload全部释放回
+ * list_table，使它们能与相邻的Free Block合并
+ *
+ * @par cache中零散的已分配Block会把大片Free Block隔开，例如释放完一大批
+ * 小对象之后的大请求，即使只有十几个Payload留在cache中也只能拓展堆
+ *
+ * @note 调用者已经执行lock_heap；其他CPU的cache只能由在其上运行的线程
+ * 清空，留给它们自己的reclaim
+ *
+ * @return true 至少释放了一个Payload
+ */
+static bool flush_cpu_caches(void) {
+  bool flushed = false;
+  for (uint8_t cls = 0; cls != CPU_CACHE_CLASS_COUNT; cls++) {
+    magazine_t spill;
+    if (cpu_cache_drain(cls, &spill)) {
+      for (uint32_t i = 0; i != spill.count; i++) {
+        free_payload(spill.round[i]);
+      }
+      flushed = true;
+    }
+    flushed |= depot_depth(&heap_meta->depot_full[cls]) != 0;
+    heap_meta->depot_full_min[cls] = UINT32_MAX;
+  }
+  reclaim_depot();
+  return flushed;
+}
+
+/**
+ * @brief 检查堆的不变性是否始终被满足
+ *
+ * @par Heap check：
+ * - epilogue & prologue blocks 格式检查（见下）；
+ * - Coalesce检查：堆中不可以有任何两个连续的Free Block存在；
+ *
+ * @par List check：
+ * - 前后两个Block需具有正确的next/previous指向；
+ * - 所有指针都位于mem heap lo() & mem heap high()之间；
+ * - 遍历堆得到的Free block数目应该和遍历free list得到的数目一致；
+ * - segregated list相关（ @todo ）
+ *
+ * @par Block check：
+ * - Block地址均对齐16Byte；
+ * - Block都在Heap的边界之内；
+ * - Free之后Block的allocate bit应该被合理设置；
+ * - 每个Block的Header和Footer：
+ *    - 大小是大于等于Block的最小值；
+ *    - prev和next是否具有一致性；
+ *    - allocate bit是否符合实际情况；
+ *    - Header和Footer是否相互匹配；
+ *
+ * @par free list方面，epilogue block需保持如下不变性：
+ * - next元素始终为NULL：可用于检测是否到达free list的末尾；
+ * - prev元素始终指向block_t：可将初次插入以及后续插入
+ *   平凡化为同一种情况，将其当作普通的block修改指针即可；
+ * -
+ * 由于堆初始情况下即包含有一个大小为chunksize的block，因此prev元素不可为NULL；
+ *
+ * @par coalesce block方面，epilogue block和prologue blcok都需保持
  * allocated bit为1，以便将边界coalesce情况化为平凡情况
  *
- * @par free list需保持如下不变性：
- * - 头部节点prev必然为NULL；
- * - 尾部节点必须是epilogue block；
+ * @par free list需保持如下不变性：
+ * - 头部节点prev必然为NULL；
+ * - 尾部节点必须是epilogue block；
+ *
+ *
+ * @note 分配函数内部的检查以及后台维护线程都已经持有heap_lock，
+ * 直接调用这里；外部调用的是mm_checkheap。调用者不能持有任何链表锁
+ *
+ * @param[in] line 被调用时的行号
+ * @return 堆是否满足不变性
+ */
+static bool check_heap(int line) {
+  /*
+   * You will need to write the heap checker yourself.
+   * Please keep modularity in mind when you're writing the heap checker!
+   *
+   * As a filler: one guacamole is equal to 6.02214086 x 10**23 guacas.
+   * One might even call it...  the avocado's number.
+   *
+   * Internal use only: If you mix guacamole on your bibimbap,
+   * do you eat it with a pair of chopsticks, or with a spoon?
+   */
+
+  bool valid = false;
+
+  // malloc_list不持有heap_lock，检查期间需要让它等待
+  lock_all_lists();
+
+  // 检查数组大小是否和LIST_TABLE_SIZE匹配
+  valid = (sizeof(heap_meta->list_table[0]) /
+           sizeof(heap_meta->list_table[0][0])) == LIST_TABLE_SIZE;
+  if (!valid) {
+    dbg_printf(
+        "\n=============\n%d: list_table size no equals to LIST_TABLE_SIZE",
+        __LINE__);
+    goto done;
+  }
+  valid = (sizeof(cluster_alloc_to_num) / sizeof(cluster_alloc_to_num[0])) ==
+          CLUSTER_ALLOC_STATUS;
+  if (!valid) {
+    dbg_printf("\n=============\n%d: cluster_alloc_to_num size no equals to "
+               "CLUSTER_ALLOC_STATUS",
+               __LINE__);
+    goto done;
+  }
+  valid = (sizeof(cluster_alloc_to_num) / sizeof(cluster_alloc_to_num[0])) ==
+          CLUSTER_ALLOC_STATUS;
+  if (!valid) {
+    dbg_printf("\n=============\n%d: cluster_alloc_to_num size no equals to "
+               "CLUSTER_ALLOC_STATUS",
+               __LINE__);
+    goto done;
+  }
+
+  // 逐个检查Segment，同时统计其中free block的数目
+  size_t count = 0;
+  size_t dirty_count = 0;
+  for (int seg = 0; seg != mem_segment_count(); seg++) {
+    valid = valid_segment(seg, &count, &dirty_count);
+    if (!valid) {
+      dbg_printf("\n=============\n%d: Segment %d invalid", __LINE__, seg);
+      goto done;
+    }
+  }
+
+  // 遍历链表中的所有节点，检查它们是否合法
+  valid = valid_list_iterate(valid_node, count);
+  if (!valid) {
+    dbg_printf("\n=============\n%d: List invalid", __LINE__);
+    goto done;
+  }
+
+  // dirty list中恰好是所有尚未purge的较大Free Block
+  valid = valid_dirty_list(dirty_count);
+  if (!valid) {
+    dbg_printf("\n=============\n%d: Dirty list invalid", __LINE__);
+    goto done;
+  }
+done:
+  unlock_all_lists();
+  if (!valid) {
+    dbg_printf("\n=============\n");
+  }
+
+  return valid;
+}
+
+/**
+ * @brief 检查堆是否满足不变性，见check_heap
+ *
+ * @note 后台维护线程运行时先获取heap_lock，以免检查到它修改了一半的堆
+ *
+ * @param[in] line 被调用时的行号
+ * @return 堆是否满足不变性
+ */
+bool mm_checkheap(int line) {
+  lock_heap();
+  bool valid = check_heap(line);
+  unlock_heap();
+  return valid;
+}
+
+/**
+ * @brief 初始化堆
+ *
+ * @par 初始状况下的堆长度为meta_size + 16Byte + chunksize：
+ * - meta_size：heap_meta_t；
+ * - 8 Byte：空隙，使得之后的Block都位于16 Byte边界之前4 Byte处；
+ * - Tag1：prologue block的footer；
+ * - Tag2：epilogue block的header；
+ * - chunksize：堆初始的空余空间，可被直接使用；
+ * prologue和epilogue的“size”字段都为0，用于标识
+ *
+ * @return
+ */
+bool mm_init(void) {
+  // Create the initial empty heap
+  heap_meta_t *meta = mem_sbrk(meta_size + dsize);
+
+  if (meta == (void *)-1) {
+    return false;
+  }
+  heap_meta = meta;
+  tag_t *start = (tag_t *)((char *)meta + meta_size + wsize);
+
+  /*
+   * TODO: delete or replace this comment once you've thought about it.
+   * Think about why we need a heap prologue and epilogue. Why do
+   * they correspond to a block footer and header respectively?
+   *
+   * 主要的目的是用来标识堆的边界
+   */
+
+  // Heap prologue (block footer) & Heap epilogue (block header)
+  start[0] = pack_regular(0, true, true, REGION_SHORT);
+  start[1] = pack_regular(0, true, true, REGION_SHORT);
+
+  // 将各segregate list指针从NULL显式初始化为END_OF_LIST
+  for (int r = 0; r != REGION_COUNT; r++) {
+    for (int i = 0; i != LIST_TABLE_SIZE; i++) {
+      meta->list_table[r][i].head = END_OF_LIST;
+      meta->list_table[r][i].rover = HEAP_START;
+      atomic_flag_clear(&meta->list_lock[r][i]);
+    }
+    for (int w = 0; w != LIST_MAP_WORDS; w++) {
+      meta->list_map[r][w] = 0;
+    }
+    for (int c = 0; c != CLUSTER_BLOCK_COUNT; c++) {
+      meta->cluster_table[r][c] = END_OF_LIST;
+    }
+  }
+  meta->huge_page_size = mem_hugepagesize();
+  meta->dirty_list.next = meta->dirty_list.prev = &meta->dirty_list;
+  meta->purge_clock = 0;
+  meta->page_size = mem_pagesize();
+  meta->zero_lo = meta->zero_hi = NULL;
+  meta->inherit_prev = NULL;
+  meta->maintain_mark = 0;
+  meta->cluster_wanted = 0;
+  meta->cpu_caches = NULL;
+  meta->cpu_count = 0;
+  for (int c = 0; c != CPU_CACHE_CLASS_COUNT; c++) {
+    atomic_init(&meta->depot_full[c], 0);
+    meta->depot_full_min[c] = 0;
+  }
+  atomic_init(&meta->depot_empty, 0);
+  meta->depot_clock = 0;
+  meta->handle_chunks = NULL;
+  meta->handle_free = NULL;
+  meta->handle_count = 0;
+  meta->compact_len = 0;
+  meta->compact_pos = 0;
+  meta->compact_cursor = NULL;
+  extend_credit = 0;
+  wide_links = false;
+
+  block_t *first_block = NULL;
+
+  // Extend the empty heap with a free block of chunksize bytes
+  if ((first_block = extend_heap(chunksize, REGION_SHORT)) == NULL) {
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief 获取一个指定大小的Block，可能调用sbrk
+ *
+ * @par 需执行的操作如下：
+ * 1.find_fit：遍历free list，寻找合适的free block；
+ *   1.找到了：将其移出free list；
+ *   2.没有找到：调用extend_heap拓展堆；
+ * 2.split_block：根据占用大小对其进行分割；
+ *
+ * @note 只会使用REGION的链表，拓展出来的空间也属于REGION
+ *
+ * @param[in] size 目标payload的大小，不一定是倍数
+ * @param[in] region Block所属的Region
+ * @return 合适payload的地址
+ * @post 返回地址需对齐Dword
+ */
+static void *malloc_region(size_t size, uint8_t region) {
+  dbg_requires(check_heap(__LINE__));
+
+  size_t asize; // Adjusted block size
+  block_t *block;
+  void *bp = NULL;
+
+  // Initialize heap if it isn't initialized
+  if (heap_meta == NULL && !init_heap()) {
+    return bp;
+  }
+
+  // Ignore spurious request
+  if (size == 0) {
+    dbg_ensures(check_heap(__LINE__));
+    return bp;
+  }
+  // 加上Header并取整之后会回绕的请求不可能满足
+  if (size > SIZE_MAX - huge_overhead_size - dsize) {
+    errno = ENOMEM;
+    return bp;
+  }
+  heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+
+  // 用于表示要不要执行和Cluster Block分配相关的逻辑
+  // 最小Block放得下的请求直接使用它，剩下的小于dsize的请求才使用Cluster
+  bool alloc_cluster = size > min_block_size - overhead_size && size < dsize;
+  // Cluster Block & Regular Block
+  if (alloc_cluster) {
+    // 查看系统中有没有现成的Cluster
+    block = find_cluster_fit(region);
+    if (block != NULL) {
+      goto alloc_cluster;
+    }
+    // 否则，需要构造一个新的Cluster
+    asize = cluster_size;
+  } else {
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + overhead_size, dsize);
+    // 32 Bit的Header放不下的话，需要使用Huge Block的Header
+    if (asize > max_normal_size) {
+      asize = round_up(size + huge_overhead_size, dsize);
+    }
+    // 由于使用Round
+    // up可以确保至少为min_block_size，因此无需执行max(min_block_size, asize)
+  }
+  block = take_block(asize, region, 0);
+  if (block == NULL) {
+    return bp;
+  }
+
+  if (alloc_cluster) {
+    // 如果是通过判断语句到达这里的，代表需要在128Byte Block上创建Cluster，
+    // 后台维护线程之后会为这个Region预先准备Cluster
+    create_cluster(block);
+    heap_meta->cluster_wanted |= 1 << region;
+  alloc_cluster:
+    // 如果是通过goto到达这里的，代表找到了一个已有的Cluster
+    dbg_assert(!deduce_cluster_full(block));
+    bp = allocate_cluster_block(block);
+    dbg_assert(!deduce_cluster_empty(block));
+    dbg_ensures(valid_block_format(block));
+  } else {
+    bp = header_to_payload(block);
+  }
+  dbg_ensures(check_heap(__LINE__));
+  return bp;
+}
+
+/**
+ * @brief 不获取heap_lock，直接从精确链表中取走一个大小恰好为ASIZE的
+ * Free Block
+ *
+ * @par 这样的Block不需要切分，也不会位于dirty list中，整个过程只持有
+ * 这一个链表的锁，只改写这个Block的Header以及后一个Block的front bit，
+ * 因此分配不同大小的线程互不阻塞。Header在释放链表锁之前标记为已分配，
+ * 持有heap_lock合并邻接Block的一方据此在链表锁之下重新确认，见
+ * lock_free_next以及lock_free_prev
+ *
+ * @param asize 调整之后的Block大小，不大于MAX_EXACT_BLOCK_GROUP
+ * @param region Block所属的Region
+ * @return void* 链表中没有大小恰好合适的Block时返回NULL
+ */
+static void *take_exact_block(size_t asize, uint8_t region) {
+  uint8_t index = deduce_list_index(asize);
+  if (!get_list_no_empty(region, index)) {
+    return NULL;
+  }
+
+  lock_list(region, index);
+  block_t *block = find_near_fit(asize, region, index);
+  if (block == NULL) {
+    unlock_list(region, index);
+    return NULL;
+  }
+  remove_list_elem(get_body(block));
+  rewrite_block(block, asize, true, region);
+  set_front_alloc_of_back_block(block, true);
+  __atomic_store_n(&heap_meta->list_table[region][index].rover,
+                   (void *)find_next(block), __ATOMIC_RELAXED);
+  unlock_list(region, index);
+  return header_to_payload(block);
+}
+
+/**
+ * @brief 并发模式下先尝试take_exact_block，不获取heap_lock
+ *
+ * @param size 目标payload的大小
+ * @param region Block所属的Region
+ * @return void* 不在精确链表的范围内，或者链表中没有Block时返回NULL，
+ * 调用者改用malloc_region
+ */
+static void *malloc_list(size_t size, uint8_t region) {
+  // Cluster Block以及超出精确链表的请求都需要heap_lock
+  if (heap_meta == NULL || !deduce_concurrent() || size == 0 ||
+      (size > min_block_size - overhead_size && size < dsize) ||
+      size > MAX_EXACT_BLOCK_GROUP - overhead_size) {
+    return NULL;
+  }
+  return take_exact_block(round_up(size + overhead_size, dsize), region);
+}
+
+/**
+ * @brief cache与depot中都没有CLS类的Payload时，在一次heap_lock之内取出
+ * refill_count + 1个：一个交给调用者，其余装入cache
+ *
+ * @par 普通Block像mm_comalloc一样只从链表中取一个Block，再把它切成
+ * refill_count + 1个已分配的Block，一连串同一大小的分配因此每
+ * refill_count + 1次才查找一次链表、获取一次heap_lock；链表中放不下
+ * 时只分配调用者的一个，Cluster Block则依然逐个分配。装入失败（其他线程抢先释放了一些）时把多取的Payload
+ * 释放回去
+ *
+ * @param cls 大小类
+ * @param bp 用于接收Payload
+ * @return bool 堆无法分配时返回false
+ */
+static bool malloc_refill(uint8_t cls, void **bp) {
+  magazine_t mag;
+  mag.count = 0;
+  lock_heap();
+  block_t *block = NULL;
+  size_t total = cls * dsize * (refill_count + 1);
+  // 链表中放不下时只分配一个，不为了预取而拓展堆
+  if (cls != 0 && (block = find_fit(total, REGION_SHORT)) != NULL) {
+    heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+    block = claim_block(block, total, REGION_SHORT, 0);
+  }
+  if (block != NULL) {
+    // 与mm_comalloc相同：最后一个Block得到take_block切剩的全部空间
+    size_t rest = get_size(block);
+    rewrite_block(block, cls * dsize, true, REGION_SHORT);
+    *bp = header_to_payload(block);
+    while (mag.count != refill_count) {
+      rest -= cls * dsize;
+      block = find_next(block);
+      write_block(block, mag.count + 1 == refill_count ? rest : cls * dsize,
+                  true, true, REGION_SHORT);
+      mag.round[mag.count++] = header_to_payload(block);
+    }
+    dbg_ensures(check_heap(__LINE__));
+  } else {
+    size_t size =
+        cls == 0 ? cluster_block_size - 1 : cls * dsize - overhead_size;
+    *bp = malloc_region(size, REGION_SHORT);
+    while (cls == 0 && *bp != NULL && mag.count != refill_count) {
+      void *p = malloc_region(size, REGION_SHORT);
+      if (p == NULL) {
+        break;
+      }
+      mag.round[mag.count++] = p;
+    }
+  }
+  unlock_heap();
+  if (mag.count != 0 && !cpu_cache_fill(cls, &mag)) {
+    lock_heap();
+    for (uint32_t i = 0; i != mag.count; i++) {
+      free_payload(mag.round[i]);
+    }
+    unlock_heap();
+  }
+  return *bp != NULL;
+}
+
+/**
+ * @brief 从当前CPU的cache中取出一个CLS类的Payload，cache为空时先从depot
+ * 换来一个装满的magazine，depot中也没有时见malloc_refill
+ *
+ * @param cls 大小类，为CPU_CACHE_CLASS_COUNT时直接失败
+ * @param bp 用于接收Payload
+ * @return bool 是否取到了Payload
+ */
+static bool malloc_cached(uint8_t cls, void **bp) {
+  if (cls == CPU_CACHE_CLASS_COUNT) {
+    return false;
+  }
+  if (cpu_cache_pop(cls, bp) ||
+      (cpu_cache_reload(cls) && cpu_cache_pop(cls, bp))) {
+    return true;
+  }
+  // depot中也没有，只能从list_table中分配，depot的surplus此时最有用；
+  // 只有多个前台线程争用heap_lock时才值得多取，否则预取的Payload只会
+  // 占着空间：后台维护线程只是尝试获取，不与前台争用
+  tick_depot();
+  return always_lock && malloc_refill(cls, bp);
+}
+
+/**
+ * @brief 获取一个指定大小的Block，位于默认的Region中
+ *
+ * @param[in] size 目标payload的大小，不一定是倍数
+ * @return 合适payload的地址
+ */
+void *malloc(size_t size) {
+  void *bp;
+#ifndef DRIVER
+  // 程序通常期望malloc(0)返回可以传给free的唯一指针
+  if (size == 0) {
+    size = 1;
+  }
+#endif
+  // 启用了per-CPU cache时，小Block优先从当前CPU的cache中取，
+  // cache为空时先从depot换来一个装满的magazine
+  if (heap_meta != NULL && heap_meta->cpu_caches != NULL &&
+      malloc_cached(deduce_cache_class(size), &bp)) {
+    return bp;
+  }
+  bp = malloc_list(size, REGION_SHORT);
+  if (bp != NULL) {
+    return bp;
+  }
+  lock_heap();
+  bp = malloc_region(size, REGION_SHORT);
+  unlock_heap();
+  return bp;
+}
+
+/**
+ * @brief 与malloc相同，但是根据HINT将Block放到对应的Region中
+ *
+ * @par MM_LONG_LIVED的对象位于REGION_LONG，其他对象（包括MM_SHORT_LIVED）
+ * 与未提供hint的对象一同位于REGION_SHORT。两个Region的Block不会相互合并，
+ * 因此长期存活的对象不会把短期对象释放出来的空间分隔开
+ *
+ * @param[in] size 目标payload的大小
+ * @param[in] hint MM_SHORT_LIVED或者MM_LONG_LIVED
+ * @return 合适payload的地址
+ */
+void *mm_malloc_hint(size_t size, int hint) {
+  uint8_t region = (hint & MM_LONG_LIVED) ? REGION_LONG : REGION_SHORT;
+  void *bp = malloc_list(size, region);
+  if (bp != NULL) {
+    return bp;
+  }
+  lock_heap();
+  bp = malloc_region(size, region);
+  unlock_heap();
+  return bp;
+}
+
+/**
+ * @brief 分配调整之后大小恰好为ASIZE的普通Block，位于默认的Region中
+ *
+ * @par mm_const.h在编译期完成malloc开头的判断：不是Cluster、不为0、
+ * 位于精确链表的范围内，以及round_up之后的ASIZE。这里直接尝试per-CPU
+ * cache的ASIZE / dsize类以及ASIZE对应的精确链表，都为空时才进入malloc_region
+ *
+ * @note 与malloc_list一样，只有并发模式下才不持有heap_lock访问精确链表
+ *
+ * @param[in] asize 16的倍数，介于min_block_size与MAX_EXACT_BLOCK_GROUP之间
+ * @return 合适payload的地址
+ */
+void *mm_malloc_exact(size_t asize) {
+  dbg_requires(asize % dsize == 0 && asize >= min_block_size &&
+               asize <= MAX_EXACT_BLOCK_GROUP);
+  void *bp;
+  if (heap_meta != NULL) {
+    if (heap_meta->cpu_caches != NULL &&
+        asize <= (CPU_CACHE_CLASS_COUNT - 1) * dsize &&
+        malloc_cached(asize / dsize, &bp)) {
+      return bp;
+    }
+    // 与malloc_list相同，链表锁只在并发模式下生效，否则交给heap_lock
+    // 之下的malloc_region，它同样先找精确链表
+    if (deduce_concurrent() &&
+        (bp = take_exact_block(asize, REGION_SHORT)) != NULL) {
+      return bp;
+    }
+  }
+  lock_heap();
+  bp = malloc_region(asize - overhead_size, REGION_SHORT);
+  unlock_heap();
+  return bp;
+}
+
+/**
+ * @brief 分配一个Cluster Block，位于默认的Region中
+ *
+ * @note 与malloc(dsize - 1)相同，只是省去了判断大小的分支
+ *
+ * @return 合适payload的地址，只有cluster_block_size - 1 Byte可用
+ */
+void *mm_malloc_cluster(void) {
+  void *bp;
+  if (heap_meta != NULL && heap_meta->cpu_caches != NULL &&
+      malloc_cached(0, &bp)) {
+    return bp;
+  }
+  lock_heap();
+  bp = malloc_region(cluster_block_size - 1, REGION_SHORT);
+  unlock_heap();
+  return bp;
+}
+
+/**
+ * @brief 一次分配N个一起使用的对象，第i个对象有SIZES[i]字节，地址写入OUT[i]
+ *
+ * @par 只调用一次take_block取得能放下所有对象的Block，再将它依次切成N个
+ * 已分配的普通Block，对象因此在堆中紧密相邻，并且各自都可以单独free。
+ * 大小落在Cluster范围内的对象也使用普通Block
+ *
+ * @note 总大小超出max_normal_size时退化为逐个malloc
+ *
+ * @param[in] n 对象的数目
+ * @param[in] sizes 各个对象的大小，0视为1
+ * @param[out] out 接收各个对象的地址
+ * @return bool 堆无法分配时返回false，此时不分配任何对象
+ */
+bool mm_comalloc(size_t n, const size_t sizes[], void *out[]) {
+  size_t total = 0;
+  bool fits = true;
+  for (size_t i = 0; i < n && fits; i++) {
+    size_t size = sizes[i] == 0 ? 1 : sizes[i];
+    // 先比较再累加，巨大的请求不会让total回绕成一个小值
+    if (size > max_normal_size - total ||
+        round_up(size + overhead_size, dsize) > max_normal_size - total) {
+      fits = false;
+    } else {
+      total += round_up(size + overhead_size, dsize);
+    }
+  }
+  if (n == 0) {
+    return true;
+  }
+
+  if (!fits) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = malloc(sizes[i] == 0 ? 1 : sizes[i]);
+      if (out[i] == NULL) {
+        while (i-- > 0) {
+          free(out[i]);
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+  lock_heap();
+  if (heap_meta == NULL && !init_heap()) {
+    unlock_heap();
+    return false;
+  }
+  heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+  block_t *block = take_block(total, REGION_SHORT, 0);
+  if (block == NULL) {
+    unlock_heap();
+    return false;
+  }
+  // take_block已经切掉了多余的部分，剩下的依次切给每个对象，最后一个
+  // 对象得到剩下的全部空间；中间的Header都是新写入的，前一个Block已分配
+  size_t rest = get_size(block);
+  for (size_t i = 0; i + 1 < n; i++) {
+    size_t asize = round_up((sizes[i] == 0 ? 1 : sizes[i]) + overhead_size,
+                            dsize);
+    if (i == 0) {
+      rewrite_block(block, asize, true, REGION_SHORT);
+    } else {
+      write_block(block, asize, true, true, REGION_SHORT);
+    }
+    out[i] = header_to_payload(block);
+    rest -= asize;
+    block = find_next(block);
+  }
+  if (n > 1) {
+    write_block(block, rest, true, true, REGION_SHORT);
+  }
+  out[n - 1] = header_to_payload(block);
+  dbg_ensures(check_heap(__LINE__));
+  unlock_heap();
+  return true;
+}
+
+/**
+ * @brief 将已分配的普通BLOCK（或者已经清空的Cluster）标记为free，与邻接的
+ * Block合并之后放入合适的链表中
+ *
+ * @param block
+ */
+static void release_block(block_t *block) {
+  size_t size = get_size(block);
+
+  // The block should be marked as allocated
+  dbg_assert(get_alloc(block));
+
+  // Mark the block as free，Cluster bit也随之清零
+  rewrite_block(block, size, false, get_region(block));
+  set_front_alloc_of_back_block(block, false);
+
+  // Try to coalesce the block with its neighbors
+  block = coalesce_block(block);
+  // 位于堆顶的大Free Block需要归还多余的空间，后台维护线程可以代劳
+  if (!deduce_deferred()) {
+    trim_heap(block);
+  }
+
+  // 将新Free block插入到合适的链表中
+  push_list(deduce_list_index(get_size(block)),
+            (list_elem_t *)get_body(block));
+  inherit_purge_state(block);
+}
+
+/**
+ * @brief 释放目标BP指向的block
+ *
+ * @par 需执行的操作如下：
+ * 1.将指定Block从free list中移出；
+ * 2.将其状态标记为free；
+ * 3.Coalesce邻接Block；
+ * 4.将新free block插入free list头部；
+ *
+ * @param[in] bp 不为NULL，调用者已经执行lock_heap
+ * @pre 鉴于payload的地址必对齐16位，似乎可以利用这一特性
+ * @post header & footer的allocated bit都被合理设置
+ * @post 位于free list的头部
+ * @post 堆中不可有连续的free block
+ */
+static void free_payload(void *bp) {
+  dbg_requires(check_heap(__LINE__));
+
+  block_t *block = payload_to_header(bp);
+  // free越频繁，说明越不需要快速增长
+  if (extend_credit != 0) {
+    extend_credit--;
+  }
+  if (get_cluster(block)) {
+    free_cluster_block(payload_to_cluster_block(bp));
+  } else {
+    release_block(block);
+  }
+  // 释放了足够久的较大Free Block将其中的整页归还，后台维护线程可以代劳
+  heap_meta->purge_clock++;
+  if (!deduce_deferred()) {
+    purge_dirty_blocks(purge_batch);
+  }
+
+  dbg_ensures(check_heap(__LINE__));
+}
+
+/**
+ * @brief 尝试将已分配的Payload BP放入当前CPU的cache
+ *
+ * @par cache满了就把整个cache装入magazine交给depot，无法分配magazine时
+ * 失败，由调用者真正释放
+ *
+ * @param[in] bp
+ * @return true BP已经进入cache
+ * @return false BP不在任何大小类中，或者cache已满
+ */
+static bool free_cached(void *bp) {
+  uint8_t cls = deduce_payload_class(bp);
+  return cls != CPU_CACHE_CLASS_COUNT &&
+         (cpu_cache_push(cls, bp) ||
+          (cpu_cache_unload(cls) && cpu_cache_push(cls, bp)));
+}
+
+/**
+ * @brief 释放BP指向的Payload，见free_payload
+ *
+ * @note 启用了per-CPU cache时，小Block先放入当前CPU的cache，cache满了
+ * 就把整个cache装入magazine交给depot，无法分配magazine时才真正释放；
+ * 不属于这个堆的指针被忽略，见deduce_foreign
+ *
+ * @param[in] bp
+ */
+void free(void *bp) {
+  if (bp == NULL || heap_meta == NULL || deduce_foreign(bp)) {
+    return;
+  }
+  if (heap_meta->cpu_caches != NULL && free_cached(bp)) {
+    return;
+  }
+  lock_heap();
+  free_payload(bp);
+  unlock_heap();
+}
+
+/**
+ * @brief 与free相同，调用者同时给出分配时请求的大小SIZE
+ *
+ * @par 大小类直接由SIZE算出，放入per-CPU cache时不读取Header：Block不小于
+ * SIZE对应的大小，进入较小的类只是之后被分配出去时多出一些空间；释放出
+ * cache时free_payload仍然按Header处理。SIZE超出所有cache类时直接进入
+ * 普通路径
+ *
+ * @note BP应当来自malloc、calloc、realloc或者memalign，mm_malloc_hint
+ * 放在REGION_LONG中的Block应当交给free，否则会作为短期对象被重新分配
+ *
+ * @param[in] bp
+ * @param[in] size 分配时请求的大小，不超过malloc_usable_size(BP)
+ */
+void free_sized(void *bp, size_t size) {
+  if (bp == NULL || heap_meta == NULL || deduce_foreign(bp)) {
+    return;
+  }
+  dbg_requires(size <= get_payload_size(bp));
+  if (heap_meta->cpu_caches != NULL) {
+    uint8_t cls = deduce_cache_class(size);
+    if (cls != CPU_CACHE_CLASS_COUNT &&
+        (cpu_cache_push(cls, bp) ||
+         (cpu_cache_unload(cls) && cpu_cache_push(cls, bp)))) {
+      return;
+    }
+  }
+  lock_heap();
+  free_payload(bp);
+  unlock_heap();
+}
+
+/**
+ * @brief 释放由memalign等函数以ALIGNMENT对齐分配的Payload，见free_sized
+ *
+ * @note align_block已经切掉了Payload之前的部分，Block与普通Block没有区别
+ *
+ * @param[in] bp
+ * @param[in] alignment 分配时的对齐要求
+ * @param[in] size 分配时请求的大小
+ */
+void free_aligned_sized(void *bp, size_t alignment, size_t size) {
+  dbg_requires(((word_t)bp & (alignment - 1)) == 0);
+  free_sized(bp, size);
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * <What are the function's arguments?>
+ * <What is the function's return value?>
+ * <Are there any preconditions or postconditions?>
+ *
+ * @param[in] ptr
+ * @param[in] size
+ * @return
+ */
+static void *realloc_payload(void *ptr, size_t size) {
+  size_t copysize;
+  void *newptr;
+
+  // If size == 0, then free block and return NULL
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  // If ptr is NULL, then equivalent to malloc
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+
+  // 不属于这个堆的指针不知道原有大小，复制SIZE字节中可读的部分
+  if (heap_meta == NULL || deduce_foreign(ptr)) {
+    newptr = malloc_region(size, REGION_SHORT);
+    if (newptr != NULL) {
+      copy_foreign(newptr, ptr, size);
+    }
+    return newptr;
+  }
+
+  // Otherwise, proceed with reallocation 新Block与原Block位于同一个Region
+  newptr = malloc_region(size, get_payload_region(ptr));
+
+  // If malloc fails, the original block is left untouched
+  if (newptr == NULL) {
+    return NULL;
+  }
+
+  // Copy the old data
+  copysize = get_payload_size(ptr); // size of old payload
+  if (size < copysize) {
+    copysize = size;
+  }
+  memcpy(newptr, ptr, copysize);
+
+  // Free the old block
+  free(ptr);
+
+  return newptr;
+}
+
+/**
+ * @brief 调整PTR所指向的Payload的大小，见realloc_payload
+ *
+ * @note 整个过程都持有heap_lock，后台维护线程不会看到只完成了一半的realloc
+ *
+ * @param[in] ptr
+ * @param[in] size
+ * @return 新Payload的地址
+ */
+void *realloc(void *ptr, size_t size) {
+  lock_heap();
+  void *newptr = realloc_payload(ptr, size);
+  unlock_heap();
+  return newptr;
+}
+
+/**
+ * @brief
  *
+ * <What does this function do?>
+ * <What are the function's arguments?>
+ * <What is the function's return value?>
+ * <Are there any preconditions or postconditions?>
  *
- * @param[in] line 被调用时的行号
- * @return 堆是否满足不变性
+ * @param[in] elements
+ * @param[in] size
+ * @return
  */
-bool mm_checkheap(int line) {
-  /*
-   * You will need to write the heap checker yourself.
-   * Please keep modularity in mind when you're writing the heap checker!
-   *
-   * As a filler: one guacamole is equal to 6.02214086 x 10**23 guacas.
-   * One might even call it...  the avocado's number.
-   *
-   * Internal use only: If you mix guacamole on your bibimbap,
-   * do you eat it with a pair of chopsticks, or with a spoon?
-   */
+void *calloc(size_t elements, size_t size) {
+  void *bp;
+  size_t asize = elements * size;
 
-  bool valid = false;
-  block_t *curr = NULL;
+  if (elements != 0 && asize / elements != size) {
+    // Multiplication overflowed
+    return NULL;
+  }
+#ifndef DRIVER
+  // 与malloc(0)相同，返回可以传给free的唯一指针
+  if (asize == 0) {
+    asize = 1;
+  }
+#endif
 
-  // 检查全局数组大小是否和LIST_TABLE_SIZE匹配
-  valid = (sizeof(index_to_push_func) / sizeof(index_to_push_func[0])) ==
-          LIST_TABLE_SIZE;
-  if (!valid) {
-    dbg_printf("\n=============\n%d: index_to_push_func size no equals to "
-               "LIST_TABLE_SIZE",
-               __LINE__);
-    goto done;
+  // 持有heap_lock直到读完zero_lo和zero_hi，以免后台维护线程改写它们
+  lock_heap();
+  // 不经过per-CPU cache：zero_lo和zero_hi只描述malloc_region刚取用的Block
+  bp = malloc_region(asize, REGION_SHORT);
+  if (bp != NULL) {
+    // Initialize all bits to 0，已经purge的页面本来就是0
+    char *lo = bp;
+    char *hi = lo + asize;
+    char *zero_lo = heap_meta->zero_lo > lo ? heap_meta->zero_lo : lo;
+    char *zero_hi = heap_meta->zero_hi < hi ? heap_meta->zero_hi : hi;
+    if (zero_lo < zero_hi) {
+      memset(lo, 0, zero_lo - lo);
+      memset(zero_hi, 0, hi - zero_hi);
+    } else {
+      memset(bp, 0, asize);
+    }
   }
-  valid = (sizeof(list_table) / sizeof(list_table[0])) == LIST_TABLE_SIZE;
-  if (!valid) {
-    dbg_printf(
-        "\n=============\n%d: list_table size no equals to LIST_TABLE_SIZE",
-        __LINE__);
-    goto done;
+  unlock_heap();
+
+  return bp;
+}
+
+/**
+ * @brief 获取Payload对齐到ALIGNMENT的Block，位于默认的Region中
+ *
+ * @par 不超过dsize的对齐由malloc保证；更大的对齐多取alignment +
+ * min_block_size的空间，再由align_block切掉Payload之前的部分。
+ * 与malloc_region相同，超出max_normal_size的请求使用Huge Block
+ *
+ * @param[in] alignment 对齐要求，不是2的幂时向上取整
+ * @param[in] size 目标payload的大小
+ * @return 合适payload的地址
+ */
+void *memalign(size_t alignment, size_t size) {
+  if (alignment <= dsize) {
+    return malloc(size);
   }
-  valid = (sizeof(index_to_push_func) / sizeof(index_to_push_func[0])) ==
-          LIST_TABLE_SIZE;
-  if (!valid) {
-    dbg_printf("\n=============\n%d: index_to_push_func size no equals to "
-               "LIST_TABLE_SIZE",
-               __LINE__);
-    goto done;
+  // 向上取整为2的幂之后不能回绕
+  if (alignment > SIZE_MAX / 2 + 1) {
+    errno = ENOMEM;
+    return NULL;
   }
-  valid = (sizeof(cluster_alloc_to_num) / sizeof(cluster_alloc_to_num[0])) ==
-          CLUSTER_ALLOC_STATUS;
-  if (!valid) {
-    dbg_printf("\n=============\n%d: cluster_alloc_to_num size no equals to "
-               "CLUSTER_ALLOC_STATUS",
-               __LINE__);
-    goto done;
+  if ((alignment & (alignment - 1)) != 0) {
+    alignment = (word_t)1 << (64 - __builtin_clzl(alignment));
   }
-  valid = (sizeof(cluster_alloc_to_num) / sizeof(cluster_alloc_to_num[0])) ==
-          CLUSTER_ALLOC_STATUS;
-  if (!valid) {
-    dbg_printf("\n=============\n%d: cluster_alloc_to_num size no equals to "
-               "CLUSTER_ALLOC_STATUS",
-               __LINE__);
-    goto done;
+  // 加上Header、对齐以及切掉的部分之后会回绕的请求不可能满足，见take_block
+  if (size > SIZE_MAX - huge_overhead_size - dsize ||
+      alignment > SIZE_MAX - huge_overhead_size - dsize - min_block_size -
+                      size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size_t asize = round_up((size == 0 ? 1 : size) + overhead_size, dsize);
+  if (asize > max_normal_size) {
+    asize = round_up(size + huge_overhead_size, dsize);
   }
 
-  // 检查prologue block格式
-  valid = check_tag(*find_prev_footer(HEAP_START), 0, true);
-  if (!valid) {
-    dbg_printf("\n=============\n%d: prologue block format error!", __LINE__);
-    goto done;
+  void *bp = NULL;
+  lock_heap();
+  if (heap_meta != NULL || init_heap()) {
+    dbg_requires(check_heap(__LINE__));
+    heap_meta->zero_lo = heap_meta->zero_hi = NULL;
+    block_t *block = take_block(asize, REGION_SHORT, alignment);
+    if (block != NULL) {
+      bp = header_to_payload(block);
+    }
+    dbg_ensures(check_heap(__LINE__));
   }
+  unlock_heap();
+  return bp;
+}
 
-  // 检查free list中所有的block
+/**
+ * @brief 与memalign相同，结果写入MEMPTR，见posix_memalign(3)
+ *
+ * @param[out] memptr
+ * @param[in] alignment 2的幂，并且是sizeof(void *)的倍数
+ * @param[in] size
+ * @return 0，EINVAL或者ENOMEM
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+      alignment % sizeof(void *) != 0) {
+    return EINVAL;
+  }
+  void *bp = memalign(alignment, size);
+  if (bp == NULL) {
+    return ENOMEM;
+  }
+  *memptr = bp;
+  return 0;
+}
 
-  size_t count = 0;
+/**
+ * @brief C11的aligned_alloc，见memalign
+ *
+ * @param[in] alignment
+ * @param[in] size
+ * @return 合适payload的地址
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
 
-  // 检查堆中的每一个块的格式是否合法，同时统计其中free block的数目
-  for (curr = HEAP_START; get_size(curr) != 0; curr = find_next(curr)) {
-    valid = valid_block_format(curr);
-    if (!valid) {
-      dbg_printf("\n=============\n%d: Block format invalid", __LINE__);
-      goto done;
-    }
-    valid = check_front_alloc_bit(curr);
-    if (!valid) {
-      dbg_printf("\n=============\n%d: Block alloc bit not match with front "
-                 "block",
-                 __LINE__);
-      goto done;
+/**
+ * @brief 获取对齐到页面的Block，见memalign
+ *
+ * @param[in] size
+ * @return 合适payload的地址
+ */
+void *valloc(size_t size) { return memalign(mem_pagesize(), size); }
+
+/**
+ * @brief 与valloc相同，但是大小也向上取整到页面
+ *
+ * @param[in] size
+ * @return 合适payload的地址
+ */
+void *pvalloc(size_t size) {
+  size_t page_size = mem_pagesize();
+  if (size > SIZE_MAX - page_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return memalign(page_size, round_up(size == 0 ? 1 : size, page_size));
+}
+
+/**
+ * @brief BP所指向的Payload实际可用的字节数，见get_payload_size
+ *
+ * @note Payload可能位于per-CPU cache之外的任何地方，读取Header不需要
+ * heap_lock：调用者持有BP，它的Header不会被改写
+ *
+ * @param[in] bp
+ * @return 字节数，BP为NULL或者不属于这个堆时为0
+ */
+size_t malloc_usable_size(void *bp) {
+  if (bp == NULL || heap_meta == NULL || deduce_foreign(bp)) {
+    return 0;
+  }
+  return get_payload_size(bp);
+}
+
+/**
+ * @brief 启动后台维护线程，由它完成trim、purge以及预先准备Cluster
+ *
+ * @par 线程运行期间，分配函数都会获取heap_lock，后台线程则只在获取得到
+ * heap_lock时工作，并且在前台等待时立即让出，见maintain_heap
+ *
+ * @par 线程只在第一次调用时创建，之后由mm_maintenance_stop暂停、由这里
+ * 恢复，mdriver每次重置堆都停止再启动也不必付出创建和等待线程的开销
+ *
+ * @note 重置堆（mem_reset_brk、mm_init）之前需要调用mm_maintenance_stop；
+ * Sparse模式的内存模拟不是线程安全的，不能使用
+ *
+ * @return true 线程正在运行
+ * @return false 无法创建线程
+ */
+bool mm_maintenance_start(void) {
+  if (maintainer_running) {
+    return true;
+  }
+  atomic_store(&yield_request, false);
+  if (heap_meta != NULL) {
+    heap_meta->maintain_mark = heap_meta->purge_clock;
+  }
+  // 先进入并发模式，线程才能开始访问堆
+  maintainer_running = true;
+  atomic_store(&maintainer_paused, false);
+  if (!maintainer_created) {
+    if (pthread_create(&maintainer, NULL, maintainer_main, NULL) != 0) {
+      atomic_store(&maintainer_paused, true);
+      maintainer_running = false;
+      return false;
     }
+    pthread_detach(maintainer);
+    maintainer_created = true;
+  }
+  return true;
+}
 
-    if (get_cluster(curr)) {
-      if (!deduce_cluster_full(curr)) {
-        count++;
+/**
+ * @brief 暂停后台维护线程，返回时它已经不再访问堆，之后trim和purge重新
+ * 由free完成
+ *
+ * @par 线程只在持有heap_lock时访问堆，并且在获取之后确认没有被暂停，
+ * 因此获取一次heap_lock就等到了它正在执行的maintain_heap结束
+ */
+void mm_maintenance_stop(void) {
+  if (!maintainer_running) {
+    return;
+  }
+  atomic_store(&maintainer_paused, true);
+  atomic_store_explicit(&yield_request, true, memory_order_relaxed);
+  pthread_mutex_lock(&heap_lock);
+  atomic_store_explicit(&yield_request, false, memory_order_relaxed);
+  pthread_mutex_unlock(&heap_lock);
+  maintainer_running = false;
+}
+
+/**
+ * @brief 启用per-CPU cache：在堆中为每个可能的CPU分配一个cpu_cache_t，
+ * 之后malloc和free的小Block优先经过当前CPU的cache
+ *
+ * @par cache的快速路径是restartable sequence，不需要锁或者原子操作，
+ * 而且cache的数目是CPU的数目，与线程的数目无关；cache为空或者满了时，
+ * 整个与depot交换magazine，每个magazine只需要一次比较交换，depot也没有
+ * magazine可用时，以及线程的CPU编号不可用时，依然使用普通路径
+ *
+ * @note 使用glibc为每个线程注册的rseq区域；glibc没有注册（内核不支持或者
+ * 被glibc.pthread.rseq关闭）时返回false，malloc和free保持原样。
+ * cache的状态位于heap_meta_t中，mm_init之后需要重新启用
+ *
+ * @return true cache已经启用
+ * @return false 无法使用rseq，或者无法分配cache
+ */
+bool mm_cpu_cache_start(void) {
+#if CPU_CACHE_RSEQ
+  if (heap_meta == NULL && !mm_init()) {
+    return false;
+  }
+  if (heap_meta->cpu_caches != NULL) {
+    return true;
+  }
+  long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+  if (__rseq_size == 0 || cpu_count <= 0) {
+    return false;
+  }
+  lock_heap();
+  cpu_cache_t *caches =
+      malloc_region(cpu_count * cpu_cache_stride, REGION_LONG);
+  unlock_heap();
+  if (caches == NULL) {
+    return false;
+  }
+  memset(caches, 0, cpu_count * cpu_cache_stride);
+  heap_meta->cpu_count = cpu_count;
+  heap_meta->cpu_caches = caches;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief 停用per-CPU cache，将其中以及depot中所有的Payload、magazine和cache
+ * 本身释放回堆中
+ *
+ * @note 调用时不能有其他线程正在使用分配函数
+ */
+void mm_cpu_cache_stop(void) {
+  if (heap_meta == NULL || heap_meta->cpu_caches == NULL) {
+    return;
+  }
+  cpu_cache_t *caches = heap_meta->cpu_caches;
+  heap_meta->cpu_caches = NULL;
+  lock_heap();
+  for (uint32_t cpu = 0; cpu != heap_meta->cpu_count; cpu++) {
+    cpu_cache_t *cache =
+        (cpu_cache_t *)((char *)caches + cpu * cpu_cache_stride);
+    for (uint8_t cls = 0; cls != CPU_CACHE_CLASS_COUNT; cls++) {
+      for (uint32_t i = 0; i != cache->count[cls]; i++) {
+        free_payload(cache->slot[cls][i]);
       }
+    }
+  }
+  free_payload(caches);
+  heap_meta->cpu_count = 0;
+  // depot中的magazine全部归还
+  for (uint8_t cls = 0; cls != CPU_CACHE_CLASS_COUNT; cls++) {
+    heap_meta->depot_full_min[cls] = UINT32_MAX;
+  }
+  reclaim_depot();
+  // 没有其他线程了，空的magazine这时才能释放
+  magazine_t *mag;
+  while ((mag = depot_pop(&heap_meta->depot_empty, NULL)) != NULL) {
+    free_payload(mag);
+  }
+  unlock_heap();
+}
+
+/**
+ * @brief 创建一个大小为OBJSIZE的对象的池
+ *
+ * @par 对象从向堆申请的Chunk中切出，没有Header，因此数量庞大的同一大小
+ * 对象（例如bdd中的节点）不再各自付出overhead_size和对齐的空间；被释放
+ * 的对象放入池自己的侵入式链表，只有mm_pool_destroy才把Chunk还给堆。
+ * Chunk位于REGION_LONG，从pool_min_chunk开始翻倍
+ *
+ * @note OBJSIZE向上取整为wsize的倍数，对象因此对齐到OBJSIZE最低的那个
+ * 为1的位（最多16 Byte）。池本身不加锁，同一时刻只能由一个线程使用
+ *
+ * @param[in] objsize 对象的大小
+ * @return mm_pool_t* 堆无法分配时，或者OBJSIZE超出普通Block的上限时返回NULL
+ */
+mm_pool_t *mm_pool_create(size_t objsize) {
+  // 接近SIZE_MAX的OBJSIZE取整之后会回绕成0，池会反复交出同一个地址
+  if (objsize > max_normal_size - pool_header_size) {
+    return NULL;
+  }
+  mm_pool_t *pool = mm_malloc_hint(sizeof(mm_pool_t), MM_LONG_LIVED);
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->objsize = round_up(objsize == 0 ? 1 : objsize, wsize);
+  pool->chunk_size = pool_min_chunk;
+  pool->free_list = NULL;
+  pool->bump = pool->bump_end = NULL;
+  pool->chunks = pool->current = NULL;
+  return pool;
+}
+
+/**
+ * @brief 让POOL的bump指向下一个Chunk，reset之后留下的Chunk用完了才向堆
+ * 申请新的Chunk
+ *
+ * @param pool
+ * @return bool 堆无法分配时返回false
+ */
+static bool pool_next_chunk(mm_pool_t *pool) {
+  pool_chunk_t *chunk =
+      pool->current != NULL ? pool->current->next : pool->chunks;
+  if (chunk == NULL) {
+    size_t size = max(pool->chunk_size, pool_header_size + pool->objsize);
+    chunk = mm_malloc_hint(size, MM_LONG_LIVED);
+    if (chunk == NULL) {
+      return false;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    // 新Chunk总是在最后：current之后已经没有Chunk了
+    if (pool->current != NULL) {
+      pool->current->next = chunk;
     } else {
-      if (!get_alloc(curr)) {
-        count++;
-      }
+      pool->chunks = chunk;
+    }
+    if (pool->chunk_size < pool_max_chunk) {
+      pool->chunk_size *= 2;
     }
   }
+  pool->current = chunk;
+  pool->bump = (char *)chunk + pool_header_size;
+  pool->bump_end = (char *)chunk + chunk->size;
+  return true;
+}
 
-  // 检查epilogue block是否合法
-  valid = check_tag(curr->header, 0, true);
-  if (!valid) {
-    dbg_printf("\n=============\n%d: epilogue Block invalid", __LINE__);
-    goto done;
+/**
+ * @brief 从POOL中取出一个对象：先取被释放的对象，再从当前Chunk中切出
+ *
+ * @param[in] pool
+ * @return 对象的地址，堆无法分配时返回NULL
+ */
+void *mm_pool_alloc(mm_pool_t *pool) {
+  void *obj = pool->free_list;
+  if (obj != NULL) {
+    pool->free_list = *(void **)obj;
+    return obj;
+  }
+  if ((size_t)(pool->bump_end - pool->bump) < pool->objsize &&
+      !pool_next_chunk(pool)) {
+    return NULL;
+  }
+  obj = pool->bump;
+  pool->bump += pool->objsize;
+  return obj;
+}
+
+/**
+ * @brief 将OBJ放回POOL的侵入式链表，空间不还给堆
+ *
+ * @param[in] pool
+ * @param[in] obj NULL，或者由同一个池分配的对象
+ */
+void mm_pool_free(mm_pool_t *pool, void *obj) {
+  if (obj == NULL) {
+    return;
   }
+  *(void **)obj = pool->free_list;
+  pool->free_list = obj;
+}
+
+/**
+ * @brief 一次性释放POOL中所有的对象，Chunk全部留下，之后的分配从第一个
+ * Chunk重新切出
+ *
+ * @param[in] pool
+ */
+void mm_pool_reset(mm_pool_t *pool) {
+  pool->free_list = NULL;
+  pool->current = NULL;
+  pool->bump = pool->bump_end = NULL;
+}
 
-  // 遍历链表中的所有节点，检查它们是否合法
-  valid = valid_list_iterate(valid_node, count);
-  if (!valid) {
-    dbg_printf("\n=============\n%d: List invalid", __LINE__);
-    goto done;
+/**
+ * @brief 将POOL的所有Chunk以及池本身还给堆
+ *
+ * @param[in] pool 可以为NULL
+ */
+void mm_pool_destroy(mm_pool_t *pool) {
+  if (pool == NULL) {
+    return;
   }
-done:
-  if (!valid) {
-    if (curr != NULL) {
-      print_block(curr);
-    }
-    dbg_printf("\n=============\n");
+  pool_chunk_t *chunk = pool->chunks;
+  while (chunk != NULL) {
+    pool_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
   }
-
-  return valid;
+  free(pool);
 }
 
 /**
- * @brief 初始化堆
+ * @brief 创建一个Arena，用于一起分配、一起释放的对象（例如一个请求期间
+ * 的所有对象）
  *
- * @par 初始状况下的堆长度为64Byte (4 DWord) + chunksize：
- * - DWord1：prologue block的footer；
- * - DWord2：epilogue block的header；
- * - chunksize：堆初始的空余空间，可被直接使用；
- * 它们的“size”字段都为0，用于标识
+ * @par mm_arena_alloc只是移动bump指针，对象没有Header也不能单独释放；
+ * Chunk是REGION_SHORT中的普通Block，用完时先原地扩大，扩大不了才分配
+ * 新的Chunk。mm_arena_reset和mm_arena_destroy因此只需释放很少几个Block，
+ * 而不是逐个free、逐个合并成千上万个对象
  *
- * @return
+ * @note Arena本身不加锁，同一时刻只能由一个线程使用
+ *
+ * @return mm_arena_t* 堆无法分配时返回NULL
  */
-bool mm_init(void) {
-  // Create the initial empty heap
-  word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-  if (start == (void *)-1) {
-    return false;
+mm_arena_t *mm_arena_create(void) {
+  mm_arena_t *arena = mm_malloc_hint(sizeof(mm_arena_t), MM_LONG_LIVED);
+  if (arena == NULL) {
+    return NULL;
   }
+  arena->bump = arena->end = NULL;
+  arena->chunks = NULL;
+  arena->capacity = 0;
+  return arena;
+}
 
-  /*
-   * TODO: delete or replace this comment once you've thought about it.
-   * Think about why we need a heap prologue and epilogue. Why do
-   * they correspond to a block footer and header respectively?
-   *
-   * 主要的目的是用来标识堆的边界
-   */
-
-  start[0] = pack_regular(0, true, true); // Heap prologue (block footer)
-  start[1] = pack_regular(0, true, true); // Heap epilogue (block header)
-
-  // 将各segregate list指针从NULL显式初始化为END_OF_LIST
-  for (int i = 0; i != LIST_TABLE_SIZE; i++)
-    list_table[i] = END_OF_LIST;
-
-  block_t *first_block = NULL;
+/**
+ * @brief 为ARENA再腾出至少SIZE字节：先原地扩大当前Chunk，否则分配新Chunk
+ *
+ * @param arena
+ * @param size 对齐16 Byte
+ * @return bool 堆无法分配时返回false
+ */
+static bool arena_grow(mm_arena_t *arena, size_t size) {
+  size_t step = arena->capacity / arena_growth_div;
+  if (step > arena_max_chunk) {
+    step = arena_max_chunk;
+  }
+  size_t extra = max(max(step, arena_min_chunk), size);
+
+  pool_chunk_t *chunk = arena->chunks;
+  if (chunk != NULL) {
+    // 当前Chunk之后的空间空闲的话原地扩大，bump得以继续，不浪费剩余部分
+    size_t chunk_size = chunk->size + extra;
+    lock_heap();
+    bool grown = grow_block(payload_to_header(chunk),
+                            round_up(chunk_size + overhead_size, dsize));
+    unlock_heap();
+    if (grown) {
+      arena->capacity += chunk_size - chunk->size;
+      chunk->size = chunk_size;
+      arena->end = (char *)chunk + chunk_size;
+      return true;
+    }
+  }
 
-  // Extend the empty heap with a free block of chunksize bytes
-  if ((first_block = extend_heap(chunksize)) == NULL) {
+  size_t chunk_size = round_up(pool_header_size + extra, dsize);
+  chunk = mm_malloc_hint(chunk_size, MM_SHORT_LIVED);
+  if (chunk == NULL) {
     return false;
   }
-
+  chunk->next = arena->chunks;
+  chunk->size = chunk_size;
+  arena->capacity += chunk_size;
+  arena->chunks = chunk;
+  arena->bump = (char *)chunk + pool_header_size;
+  arena->end = (char *)chunk + chunk_size;
   return true;
 }
 
 /**
- * @brief 获取一个指定大小的Block，可能调用sbrk
- *
- * @par 需执行的操作如下：
- * 1.find_fit：遍历free list，寻找合适的free block；
- *   1.找到了：将其移出free list；
- *   2.没有找到：调用extend_heap拓展堆；
- * 2.split_block：根据占用大小对其进行分割；
+ * @brief 从ARENA中切出SIZE字节，与malloc相同地对齐16 Byte
  *
- * @param[in] size 目标payload的大小，不一定是倍数
- * @return 合适payload的地址
- * @post 返回地址需对齐Dword
+ * @param[in] arena
+ * @param[in] size
+ * @return 对象的地址，堆无法分配时，或者SIZE超出普通Block的上限时返回NULL
  */
-void *malloc(size_t size) {
-  dbg_requires(mm_checkheap(__LINE__));
-
-  size_t asize;      // Adjusted block size
-  size_t extendsize; // Amount to extend heap if no fit is found
-  block_t *block;
-  void *bp = NULL;
+void *mm_arena_alloc(mm_arena_t *arena, size_t size) {
+  // 接近SIZE_MAX的SIZE取整之后会回绕成0
+  if (size > max_normal_size) {
+    return NULL;
+  }
+  size = round_up(size == 0 ? 1 : size, dsize);
+  if ((size_t)(arena->end - arena->bump) < size && !arena_grow(arena, size)) {
+    return NULL;
+  }
+  void *obj = arena->bump;
+  arena->bump += size;
+  return obj;
+}
 
-  // Initialize heap if it isn't initialized
-  if (list_table[0] == NULL) {
-    mm_init();
+/**
+ * @brief 一次性释放ARENA中所有的对象，只留下最早的那个Chunk供之后使用
+ *
+ * @note 原地扩大过的Arena通常只有一个Chunk，这时不调用free
+ *
+ * @param[in] arena
+ */
+void mm_arena_reset(mm_arena_t *arena) {
+  pool_chunk_t *chunk = arena->chunks;
+  if (chunk == NULL) {
+    return;
   }
+  while (chunk->next != NULL) {
+    pool_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = chunk;
+  arena->capacity = chunk->size;
+  arena->bump = (char *)chunk + pool_header_size;
+  arena->end = (char *)chunk + chunk->size;
+}
 
-  // Ignore spurious request
-  if (size == 0) {
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+/**
+ * @brief 将ARENA的所有Chunk以及Arena本身还给堆
+ *
+ * @param[in] arena 可以为NULL
+ */
+void mm_arena_destroy(mm_arena_t *arena) {
+  if (arena == NULL) {
+    return;
+  }
+  pool_chunk_t *chunk = arena->chunks;
+  while (chunk != NULL) {
+    pool_chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
   }
+  free(arena);
+}
 
-  // 用于表示要不要执行和Cluster Block分配相关的逻辑
-  bool alloc_cluster = size < dsize;
-  // Cluster Block & Regular Block
-  if (alloc_cluster) {
-    // 查看系统中有没有现成的Cluster
-    block = find_cluster_fit();
-    if (block != NULL) {
-      goto alloc_cluster;
+/**
+ * @brief 取出一个空闲的Handle，没有的话先分配一个新的handle_chunk_t
+ *
+ * @note 调用者持有heap_lock
+ *
+ * @return mm_handle_t 堆无法分配时返回NULL
+ */
+static mm_handle_t take_handle(void) {
+  if (heap_meta->handle_free == NULL) {
+    size_t count = heap_meta->handle_chunks == NULL
+                       ? handle_min_chunk
+                       : heap_meta->handle_chunks->count * 2;
+    if (count > handle_max_chunk) {
+      count = handle_max_chunk;
+    }
+    handle_chunk_t *chunk =
+        malloc_region(sizeof(handle_chunk_t) + count * sizeof(struct mm_handle),
+                      REGION_SHORT);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = heap_meta->handle_chunks;
+    chunk->count = count;
+    heap_meta->handle_chunks = chunk;
+    heap_meta->handle_count += count;
+    for (size_t i = count; i-- > 0;) {
+      chunk->slots[i].ptr = NULL;
+      chunk->slots[i].next = heap_meta->handle_free;
+      heap_meta->handle_free = &chunk->slots[i];
     }
-    // 否则，需要构造一个新的Cluster
-    asize = cluster_size;
-  } else {
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + overhead_size, dsize);
-    // 由于使用Round
-    // up可以确保至少为min_block_size，因此无需执行max(min_block_size, asize)
   }
-  // 需要放外边 Search the free list for a fit
-  // block = find_good_fit(asize, deduce_list_index(asize));
-  block = find_fit(asize);
+  mm_handle_t handle = heap_meta->handle_free;
+  heap_meta->handle_free = handle->next;
+  return handle;
+}
 
-  // If no fit is found, request more memory, and then and place the block
-  if (block == NULL) {
-    // Always request at least chunksize
-    extendsize = max(asize, chunksize);
-    block = extend_heap(extendsize);
-    // extend_heap returns an error
-    if (block == NULL) {
-      return bp;
+/**
+ * @brief 分配一个可以被mm_compact移动的Block，位于默认的Region中
+ *
+ * @par 程序只持有Handle，使用之前通过mm_hlock取得Payload的地址，用完之后
+ * mm_hunlock；没有被锁住的Block随时可能被mm_compact移到更低的地址。
+ * 大小落在Cluster范围内的请求使用普通Block，Cluster Block无法移动
+ *
+ * @param[in] size 目标payload的大小
+ * @return mm_handle_t 堆无法分配时返回NULL
+ */
+mm_handle_t mm_halloc(size_t size) {
+  if (size > min_block_size - overhead_size && size < dsize) {
+    size = dsize;
+  }
+  lock_heap();
+  if (heap_meta == NULL && !init_heap()) {
+    unlock_heap();
+    return NULL;
+  }
+  mm_handle_t handle = take_handle();
+  if (handle != NULL) {
+    handle->ptr = malloc_region(size == 0 ? 1 : size, REGION_SHORT);
+    handle->locks = 0;
+    if (handle->ptr == NULL) {
+      handle->next = heap_meta->handle_free;
+      heap_meta->handle_free = handle;
+      handle = NULL;
     }
   }
-  // The block should be marked as free
-  dbg_assert(!get_alloc(block));
-  // Mark block as allocated
-  remove_list_elem(get_body(block));
-  size_t block_size = get_size(block);
-  write_block(block, block_size, true, get_front_alloc(block));
-  // Try to split the block if too large
-  split_block(block, asize);
+  unlock_heap();
+  return handle;
+}
 
-  if (alloc_cluster) {
-    // 如果是通过判断语句到达这里的，代表需要在128Byte Block上创建Cluster
-    create_cluster(block);
-  alloc_cluster:
-    // 如果是通过goto到达这里的，代表找到了一个已有的Cluster
-    dbg_assert(!deduce_cluster_full(block));
-    bp = allocate_cluster_block(block);
-    dbg_assert(!deduce_cluster_empty(block));
-    dbg_ensures(valid_block_format(block));
-  } else {
-    bp = header_to_payload(block);
-  }
-  dbg_ensures(mm_checkheap(__LINE__));
+/**
+ * @brief 锁住HANDLE的Block，在对应的mm_hunlock之前它不会被移动
+ *
+ * @note 可以嵌套；与mm_compact互斥，因此需要heap_lock
+ *
+ * @param[in] handle
+ * @return void* Block当前的Payload
+ */
+void *mm_hlock(mm_handle_t handle) {
+  lock_heap();
+  handle->locks++;
+  void *bp = handle->ptr;
+  unlock_heap();
   return bp;
 }
 
 /**
- * @brief 释放目标BP指向的block
- *
- * @par 需执行的操作如下：
- * 1.将指定Block从free list中移出；
- * 2.将其状态标记为free；
- * 3.Coalesce邻接Block；
- * 4.将新free block插入free list头部；
+ * @brief 解除一次mm_hlock，之前得到的地址不再可用
  *
- * @param[in] bp
- * @pre 鉴于payload的地址必对齐16位，似乎可以利用这一特性
- * @post header & footer的allocated bit都被合理设置
- * @post 位于free list的头部
- * @post 堆中不可有连续的free block
+ * @param[in] handle
  */
-void free(void *bp) {
-  dbg_requires(mm_checkheap(__LINE__));
+void mm_hunlock(mm_handle_t handle) {
+  lock_heap();
+  dbg_requires(handle->locks != 0);
+  handle->locks--;
+  unlock_heap();
+}
 
-  if (bp == NULL) {
+/**
+ * @brief 释放HANDLE及其Block，不论是否锁住
+ *
+ * @note Block不经过per-CPU cache，直接与邻接的Free Block合并，
+ * 之后的mm_compact才能看到这片空间
+ *
+ * @param[in] handle 可以为NULL
+ */
+void mm_hfree(mm_handle_t handle) {
+  if (handle == NULL) {
     return;
   }
-  block_t *block = payload_to_header(bp);
-  if (get_cluster(block)) {
-    free_cluster_block((void *)block);
-  } else {
-    size_t size = get_size(block);
-
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    write_block(block, size, false, get_front_alloc(block));
-    set_front_alloc_of_back_block(block, false);
-
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
+  lock_heap();
+  free_payload(handle->ptr);
+  handle->ptr = NULL;
+  handle->next = heap_meta->handle_free;
+  heap_meta->handle_free = handle;
+  unlock_heap();
+}
 
-    // 将新Free block插入到合适的链表中
-    push_list(deduce_list_index(get_size(block)),
-              (list_elem_t *)get_body(block));
+/**
+ * @brief 如果HANDLE的Block紧接在一个Free Block之后，将它滑动到这个Free
+ * Block的起始位置，腾出来的空间与之后的Free Block合并
+ *
+ * @par 移动之后，原来的Free Block变为位于Block之后的Free Block，因此反复
+ * 滑动会让Handle Block沉向堆底，空闲空间浮向堆顶，最终由release_block
+ * 调用trim_heap归还
+ *
+ * @note 调用者持有heap_lock；Huge Block以及前一个Block属于另一个Region的
+ * Block不移动
+ *
+ * @param handle 未被锁住的Handle
+ * @return size_t 移动的字节数，没有移动时为0
+ */
+static size_t slide_handle_block(mm_handle_t handle) {
+  block_t *block = payload_to_header(handle->ptr);
+  if (extract_huge(block->header)) {
+    return 0;
   }
+  block_t *prev = lock_free_prev(block);
+  if (prev == NULL) {
+    return 0;
+  }
+  uint8_t region = get_region(block);
+  if (get_region(prev) != region) {
+    unlock_list_of(prev);
+    return 0;
+  }
+  record_taken_block(prev);
+  remove_list_elem(get_body(prev));
+  unlock_list_of(prev);
+
+  size_t size = get_size(block);
+  size_t gap = get_size(prev);
+  rewrite_block(prev, size, true, region);
+  // Block只会移向低地址：DRIVER下的memcpy是逐Word向前复制的mem_memcpy，
+  // 重叠时同样正确，并且经由memlib访问模拟的堆
+#ifdef DRIVER
+  memcpy(header_to_payload(prev), handle->ptr, size - overhead_size);
+#else
+  memmove(header_to_payload(prev), handle->ptr, size - overhead_size);
+#endif
+  handle->ptr = header_to_payload(prev);
+  // 腾出来的空间先写成已分配的Block，再像free一样合并、trim、推入链表
+  block_t *hole = find_next(prev);
+  write_block(hole, gap, true, true, region);
+  release_block(hole);
+  return size - overhead_size;
+}
 
-  dbg_ensures(mm_checkheap(__LINE__));
+/**
+ * @brief 按Payload的地址比较两个Handle，用于qsort
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+static int cmp_handle_ptr(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)(*(const mm_handle_t *)a)->ptr;
+  uintptr_t y = (uintptr_t)(*(const mm_handle_t *)b)->ptr;
+  return (x > y) - (x < y);
 }
 
 /**
- * @brief
+ * @brief 将HANDLE放入compact_batch这个以Payload地址为键的大根堆中
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * @par 堆满时只在HANDLE比堆顶更低时替换堆顶，最终留下的是地址最低的
+ * COMPACT_BATCH_SIZE个
  *
- * @param[in] ptr
- * @param[in] size
- * @return
+ * @param[in] handle
  */
-void *realloc(void *ptr, size_t size) {
-  block_t *block = payload_to_header(ptr);
-  size_t copysize;
-  void *newptr;
-
-  // If size == 0, then free block and return NULL
-  if (size == 0) {
-    free(ptr);
-    return NULL;
+static void offer_compact_batch(mm_handle_t handle) {
+  mm_handle_t *batch = heap_meta->compact_batch;
+  size_t len = heap_meta->compact_len;
+  size_t i;
+  if (len < COMPACT_BATCH_SIZE) {
+    // 上浮
+    for (i = len++; i != 0; i = (i - 1) / 2) {
+      mm_handle_t parent = batch[(i - 1) / 2];
+      if ((char *)parent->ptr >= (char *)handle->ptr) {
+        break;
+      }
+      batch[i] = parent;
+    }
+    batch[i] = handle;
+    heap_meta->compact_len = len;
+    return;
   }
-
-  // If ptr is NULL, then equivalent to malloc
-  if (ptr == NULL) {
-    return malloc(size);
+  if ((char *)handle->ptr >= (char *)batch[0]->ptr) {
+    return;
   }
-
-  // Otherwise, proceed with reallocation
-  newptr = malloc(size);
-
-  // If malloc fails, the original block is left untouched
-  if (newptr == NULL) {
-    return NULL;
+  // 替换堆顶并下沉
+  for (i = 0; 2 * i + 1 < len;) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < len &&
+        (char *)batch[child + 1]->ptr > (char *)batch[child]->ptr) {
+      child++;
+    }
+    if ((char *)batch[child]->ptr <= (char *)handle->ptr) {
+      break;
+    }
+    batch[i] = batch[child];
+    i = child;
   }
+  batch[i] = handle;
+}
 
-  // Copy the old data
-  copysize = get_body_size(block); // gets size of old payload
-  if (size < copysize) {
-    copysize = size;
+/**
+ * @brief 取出compact_cursor之上地址最低的至多COMPACT_BATCH_SIZE个使用中
+ * 的Handle，按地址升序放入compact_batch
+ *
+ * @par 每一批扫描一遍所有的Handle，代价是O(n log COMPACT_BATCH_SIZE)，
+ * 换来整理不需要与Handle数目成正比的额外空间
+ *
+ * @note 调用者持有heap_lock
+ *
+ * @return bool compact_cursor之上没有使用中的Handle时返回false
+ */
+static bool start_compact_batch(void) {
+  char *cursor = heap_meta->compact_cursor;
+  heap_meta->compact_len = 0;
+  heap_meta->compact_pos = 0;
+  for (handle_chunk_t *c = heap_meta->handle_chunks; c != NULL; c = c->next) {
+    for (size_t i = 0; i != c->count; i++) {
+      if (c->slots[i].ptr != NULL && (char *)c->slots[i].ptr > cursor) {
+        offer_compact_batch(&c->slots[i]);
+      }
+    }
   }
-  memcpy(newptr, ptr, copysize);
-
-  // Free the old block
-  free(ptr);
-
-  return newptr;
+  qsort(heap_meta->compact_batch, heap_meta->compact_len, sizeof(mm_handle_t),
+        cmp_handle_ptr);
+  return heap_meta->compact_len != 0;
 }
 
 /**
- * @brief
+ * @brief 增量地整理堆：按地址从低到高把没有锁住的Handle Block滑向堆底
+ * （见slide_handle_block），移动了BUDGET字节之后停下，下一次调用继续
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * @par 一轮从堆底开始，每次取出compact_cursor之上地址最低的一批Handle
+ * 依次滑动。Block在滑动中保持相对顺序，因此空闲空间随着Block依次下移
+ * 而不断合并、一路浮到连续的Handle Block之上，而不是每一轮只上移一个
+ * Block。已经处理过的Block只会移到compact_cursor之下，不会在同一轮中
+ * 被再次取出；这一轮中途在compact_cursor之下分配的Handle留到下一轮
  *
- * @param[in] elements
- * @param[in] size
- * @return
+ * @par 一次调用最多开始一轮新的整理，从新一轮开始的调用在这一轮结束时
+ * 停下，因此返回0代表完整的一轮没有移动任何Block，堆已经无法再整理
+ *
+ * @param[in] budget 这一次最多移动的字节数，最后一个Block可能超出
+ * @return size_t 这一次移动的字节数
  */
-void *calloc(size_t elements, size_t size) {
-  void *bp;
-  size_t asize = elements * size;
-
-  if (asize / elements != size) {
-    // Multiplication overflowed
-    return NULL;
+size_t mm_compact(size_t budget) {
+  size_t moved = 0;
+  lock_heap();
+  if (heap_meta == NULL) {
+    unlock_heap();
+    return 0;
   }
-
-  bp = malloc(asize);
-  if (bp == NULL) {
-    return NULL;
+  bool started = heap_meta->compact_cursor == NULL;
+  while (moved < budget) {
+    if (heap_meta->compact_pos == heap_meta->compact_len &&
+        !start_compact_batch()) {
+      // 这一轮结束
+      heap_meta->compact_cursor = NULL;
+      if (started || !start_compact_batch()) {
+        break;
+      }
+      started = true;
+    }
+    mm_handle_t handle = heap_meta->compact_batch[heap_meta->compact_pos++];
+    // 这一批取出之后被释放、重新分配的Handle可能落在compact_cursor之下
+    if ((char *)handle->ptr <= heap_meta->compact_cursor) {
+      continue;
+    }
+    heap_meta->compact_cursor = handle->ptr;
+    if (handle->locks == 0) {
+      moved += slide_handle_block(handle);
+    }
   }
-
-  // Initialize all bits to 0
-  memset(bp, 0, asize);
-
-  return bp;
+  dbg_ensures(check_heap(__LINE__));
+  unlock_heap();
+  return moved;
 }
 
 /*
@@ -6,6 +6,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -13,6 +17,14 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_free_aligned_sized(void *ptr, size_t alignment, size_t size);
 
 #else
 
@@ -56,8 +68,282 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes.
+ *
+ * @param[in] alignment  The alignment, rounded up to a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Like memalign, storing the result in `*memptr`.
+ *
+ * @param[out] memptr  Where to store the pointer to the allocated bytes.
+ * @param[in] alignment  A power of two multiple of sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL or ENOMEM otherwise.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Same as memalign.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory aligned to the page size.
+ */
+extern void *valloc(size_t size);
+
+/**
+ * @brief  Like valloc, rounding `size` up to the page size as well.
+ */
+extern void *pvalloc(size_t size);
+
+/**
+ * @brief  Get the number of usable bytes in an allocated block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The usable size, which is at least the requested size, or 0 if
+ *          `ptr` is NULL or was not allocated from this heap.
+ */
+extern size_t malloc_usable_size(void *ptr);
+
+/**
+ * @brief  Like free, given the size that was requested when allocating.
+ *
+ * With per-CPU caches enabled, the cache class comes from `size`, so the
+ * block header is not read.  Free memory from mm_malloc_hint with free.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The requested size, at most malloc_usable_size(ptr).
+ */
+extern void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Like free_sized, for memory from memalign and friends.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] alignment  The alignment requested when allocating.
+ * @param[in] size  The requested size, at most malloc_usable_size(ptr).
+ */
+extern void free_aligned_sized(void *ptr, size_t alignment, size_t size);
 #endif
 
+/* Lifetime hints accepted by mm_malloc_hint */
+#define MM_SHORT_LIVED 0x1
+#define MM_LONG_LIVED 0x2
+
+/**
+ * @brief  Allocate memory like malloc, placing it according to a lifetime
+ *         hint.
+ *
+ * Objects with different hints are kept in separate heap regions so that
+ * long-lived objects do not pin the space freed by short-lived ones.
+ *
+ * @param[in] size  The minimum size of bytes to allocate.
+ * @param[in] hint  MM_SHORT_LIVED or MM_LONG_LIVED.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *mm_malloc_hint(size_t size, int hint);
+
+/* Block geometry, so that mm_const.h can resolve size classes at compile
+ * time: header bytes in front of each payload, block alignment, and the
+ * largest block size that has a list of its own */
+#define MM_BLOCK_OVERHEAD 4
+#define MM_BLOCK_ALIGN 16
+#define MM_MAX_EXACT_BLOCK 1024
+
+/**
+ * @brief  Allocate a block of exactly `asize` bytes, header included.
+ *
+ * The fast path behind mm_const.h: the caller has already rounded the
+ * request, so the allocator goes straight to the per-CPU cache and the
+ * free list of that size.
+ *
+ * @param[in] asize  A multiple of MM_BLOCK_ALIGN, at most
+ *                   MM_MAX_EXACT_BLOCK.
+ *
+ * @return  A pointer to the beginning of asize - MM_BLOCK_OVERHEAD bytes.
+ */
+extern void *mm_malloc_exact(size_t asize);
+
+/**
+ * @brief  Allocate a payload of MM_BLOCK_ALIGN - 1 bytes from a cluster,
+ *         like malloc of any size between MM_BLOCK_ALIGN -
+ *         MM_BLOCK_OVERHEAD + 1 and MM_BLOCK_ALIGN - 1.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *mm_malloc_cluster(void);
+
+/**
+ * @brief  Allocate `n` objects that are used together, the i-th of
+ *         `sizes[i]` bytes, and store their addresses in `out`.
+ *
+ * All objects are carved from one free block found with one search, so
+ * they lie next to each other in the heap; each of them is freed on its
+ * own with free.
+ *
+ * @return  false if the heap is exhausted, in which case nothing is
+ *          allocated.
+ */
+extern bool mm_comalloc(size_t n, const size_t sizes[], void *out[]);
+
+/* Pool of fixed-size objects without per-object headers */
+typedef struct mm_object_pool mm_pool_t;
+
+/**
+ * @brief  Create a pool of objects of `objsize` bytes.
+ *
+ * Objects are carved from chunks taken from the heap and have no header;
+ * freed objects go to a free list inside the pool.  Objects are aligned
+ * to the lowest set bit of `objsize` rounded up to 8, at most 16.  A pool
+ * is not thread-safe.
+ *
+ * @return  The pool, or NULL if the heap is exhausted or `objsize` is
+ *          larger than any block.
+ */
+extern mm_pool_t *mm_pool_create(size_t objsize);
+
+/**
+ * @brief  Allocate an object from `pool`.
+ *
+ * @return  A pointer to the object, or NULL if the heap is exhausted.
+ */
+extern void *mm_pool_alloc(mm_pool_t *pool);
+
+/**
+ * @brief  Give an object back to the pool it came from.
+ */
+extern void mm_pool_free(mm_pool_t *pool, void *obj);
+
+/**
+ * @brief  Free every object of `pool` at once, keeping its chunks for the
+ *         allocations that follow.
+ */
+extern void mm_pool_reset(mm_pool_t *pool);
+
+/**
+ * @brief  Give all chunks of `pool` back to the heap and delete it.
+ */
+extern void mm_pool_destroy(mm_pool_t *pool);
+
+/* Arena of objects that are freed all together */
+typedef struct mm_arena mm_arena_t;
+
+/**
+ * @brief  Create an empty arena.  Arenas are not thread-safe.
+ *
+ * @return  The arena, or NULL if the heap is exhausted.
+ */
+extern mm_arena_t *mm_arena_create(void);
+
+/**
+ * @brief  Allocate `size` bytes from `arena` by bumping a pointer.
+ *
+ * The memory has no header, is aligned like malloc and cannot be freed on
+ * its own.
+ *
+ * @return  A pointer to the allocated bytes, or NULL if the heap is
+ *          exhausted.
+ */
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+
+/**
+ * @brief  Free everything allocated from `arena` at once, keeping its
+ *         first chunk for the allocations that follow.
+ */
+extern void mm_arena_reset(mm_arena_t *arena);
+
+/**
+ * @brief  Give all chunks of `arena` back to the heap and delete it.
+ */
+extern void mm_arena_destroy(mm_arena_t *arena);
+
+/* Movable block, reached through a handle that never moves */
+typedef struct mm_handle *mm_handle_t;
+
+/**
+ * @brief  Allocate `size` bytes that mm_compact may move while unlocked.
+ *
+ * @return  The handle, or NULL if the heap is exhausted.
+ */
+extern mm_handle_t mm_halloc(size_t size);
+
+/**
+ * @brief  Pin the block of `handle` and return its current address, which
+ *         stays valid until the matching mm_hunlock.  Locks nest.
+ */
+extern void *mm_hlock(mm_handle_t handle);
+
+/**
+ * @brief  Undo one mm_hlock; the block may move again afterwards.
+ */
+extern void mm_hunlock(mm_handle_t handle);
+
+/**
+ * @brief  Free the block of `handle`, locked or not, and the handle.
+ */
+extern void mm_hfree(mm_handle_t handle);
+
+/**
+ * @brief  Slide unlocked handle blocks toward the bottom of the heap, so
+ *         that free space gathers at the top and is trimmed.
+ *
+ * Incremental: each call resumes where the previous one stopped and moves
+ * at most `budget` bytes.
+ *
+ * @return  The number of bytes moved; 0 once no block can slide.
+ */
+extern size_t mm_compact(size_t budget);
+
+/**
+ * @brief  Start a background thread that trims the heap, purges pages of
+ *         long-free blocks and prepares clusters ahead of demand.
+ *
+ * While it runs, the allocation functions take a lock that the thread
+ * gives up as soon as they wait for it.  Stop the thread before resetting
+ * the heap.  Not supported in sparse emulation.
+ *
+ * @return  True if the thread is running, False otherwise.
+ */
+extern bool mm_maintenance_start(void);
+
+/**
+ * @brief  Pause the background maintenance thread; once this returns the
+ *         thread no longer touches the heap until it is started again.
+ */
+extern void mm_maintenance_stop(void);
+
+/**
+ * @brief  Enable per-CPU caches of small freed objects.
+ *
+ * Small blocks freed afterwards go to a cache of the CPU the thread runs
+ * on, and small allocations are served from it first.  Both fast paths are
+ * Linux restartable sequences, so they take no lock and use no atomic
+ * instruction.  The caches are dropped by mm_init.
+ *
+ * @return  True if the caches are enabled, False if restartable sequences
+ *          are unavailable (the allocator then keeps its normal paths).
+ */
+extern bool mm_cpu_cache_start(void);
+
+/**
+ * @brief  Free everything held in the per-CPU caches and disable them.
+ *
+ * No other thread may use the allocator while this runs.
+ */
+extern void mm_cpu_cache_stop(void);
+
 /**
  * @brief  Initialize the heap.
  *
@@ -74,3 +360,7 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,147 @@
+/**
+ * @file mm_allocator.h
+ * @brief C++ allocators backed by the malloclab heap: an allocator for
+ *        standard containers and a std::pmr::memory_resource
+ *
+ * Both pass the size of each allocation back to free_sized, and both use
+ * memalign for types aligned beyond __STDCPP_DEFAULT_NEW_ALIGNMENT__.
+ * Compiled with -DDRIVER they use the mm_ prefixed functions, so that the
+ * heap can be compared with the default allocator in the same program;
+ * the caller must then have called mem_init and mm_init.  Requires C++17.
+ */
+
+#ifndef MM_ALLOCATOR_H
+#define MM_ALLOCATOR_H
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "mm.h"
+
+namespace mm_detail {
+
+/* Alignment that malloc already guarantees */
+constexpr std::size_t default_alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+inline void *allocate(std::size_t size, std::size_t alignment) {
+  // malloc(0) may return NULL, which containers would take as failure
+  if (size == 0) {
+    size = 1;
+  }
+#ifdef DRIVER
+  void *p = alignment <= default_alignment ? mm_malloc(size)
+                                           : mm_memalign(alignment, size);
+#else
+  void *p = alignment <= default_alignment ? malloc(size)
+                                           : memalign(alignment, size);
+#endif
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+inline void deallocate(void *p, std::size_t size, std::size_t alignment) {
+  if (size == 0) {
+    size = 1;
+  }
+#ifdef DRIVER
+  if (alignment <= default_alignment) {
+    mm_free_sized(p, size);
+  } else {
+    mm_free_aligned_sized(p, alignment, size);
+  }
+#else
+  if (alignment <= default_alignment) {
+    free_sized(p, size);
+  } else {
+    free_aligned_sized(p, alignment, size);
+  }
+#endif
+}
+
+} // namespace mm_detail
+
+/**
+ * @brief  An allocator for standard containers.
+ *
+ * Stateless: every instance allocates from the same heap, so all of them
+ * compare equal and containers may move memory between each other freely.
+ */
+template <class T> class mm_allocator {
+public:
+  using value_type = T;
+  using is_always_equal = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+
+  mm_allocator() noexcept = default;
+
+  template <class U> mm_allocator(const mm_allocator<U> &) noexcept {}
+
+  /**
+   * @brief  Allocate uninitialized storage for `n` objects of type T.
+   *
+   * @throw std::bad_array_new_length  If `n` objects do not fit in size_t.
+   * @throw std::bad_alloc  If the heap is exhausted.
+   */
+  T *allocate(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    return static_cast<T *>(mm_detail::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  /**
+   * @brief  Free storage from allocate(n), passing its size along.
+   */
+  void deallocate(T *p, std::size_t n) noexcept {
+    mm_detail::deallocate(p, n * sizeof(T), alignof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const mm_allocator<T> &, const mm_allocator<U> &) noexcept {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const mm_allocator<T> &, const mm_allocator<U> &) noexcept {
+  return false;
+}
+
+/**
+ * @brief  A std::pmr::memory_resource over the same heap.
+ *
+ * Any two mm_memory_resource objects compare equal, since memory from one
+ * can be given back to the other.
+ */
+class mm_memory_resource : public std::pmr::memory_resource {
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    return mm_detail::allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override {
+    mm_detail::deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return dynamic_cast<const mm_memory_resource *>(&other) != nullptr;
+  }
+};
+
+/**
+ * @brief  The mm_memory_resource shared by the whole program, to be passed
+ *         to pmr containers or std::pmr::set_default_resource.
+ */
+inline mm_memory_resource *mm_resource() noexcept {
+  static mm_memory_resource resource;
+  return &resource;
+}
+
+#endif /* MM_ALLOCATOR_H */
@@ -0,0 +1,109 @@
+/**
+ * @file mm_const.h
+ * @brief Allocation of compile-time constant sizes, with the size class
+ *        resolved by the compiler
+ *
+ * malloc starts by deciding whether a request goes to a cluster, rounding
+ * it up to a block size and looking up the list of that size.  For sizes
+ * known at compile time mm_malloc_const<N> does all of this in constexpr
+ * and calls mm_malloc_exact or mm_malloc_cluster directly; sizes outside
+ * the exact lists fall back to malloc.  mm_new<T> and mm_delete<T> build
+ * on it.  Requires C++17.
+ */
+
+#ifndef MM_CONST_H
+#define MM_CONST_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include "mm_allocator.h"
+
+namespace mm_detail {
+
+/* How mm.c places a request of `size` bytes */
+template <std::size_t size> struct size_class {
+  /* Requests that fit neither the smallest block nor a whole word */
+  static constexpr bool cluster =
+      size > MM_BLOCK_ALIGN - MM_BLOCK_OVERHEAD && size < MM_BLOCK_ALIGN;
+  /* Adjusted block size, as round_up(size + overhead_size, dsize) */
+  static constexpr std::size_t asize =
+      (size + MM_BLOCK_OVERHEAD + MM_BLOCK_ALIGN - 1) / MM_BLOCK_ALIGN *
+      MM_BLOCK_ALIGN;
+  /* Blocks with a list of their own */
+  static constexpr bool exact =
+      !cluster && size != 0 && asize <= MM_MAX_EXACT_BLOCK;
+};
+
+} // namespace mm_detail
+
+/**
+ * @brief  Allocate `N` bytes, like malloc(N).
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL.
+ */
+template <std::size_t N> inline void *mm_malloc_const() {
+  using size_class = mm_detail::size_class<N>;
+  if constexpr (size_class::cluster) {
+    return mm_malloc_cluster();
+  } else if constexpr (size_class::exact) {
+    return mm_malloc_exact(size_class::asize);
+  } else {
+#ifdef DRIVER
+    return mm_malloc(N);
+#else
+    return malloc(N);
+#endif
+  }
+}
+
+/**
+ * @brief  Free `p` from mm_malloc_const<N>.
+ */
+template <std::size_t N> inline void mm_free_const(void *p) {
+#ifdef DRIVER
+  mm_free_sized(p, N);
+#else
+  free_sized(p, N);
+#endif
+}
+
+/**
+ * @brief  Allocate and construct a T from `args`.
+ *
+ * @throw std::bad_alloc  If the heap is exhausted, or whatever the
+ *                        constructor throws (the memory is then freed).
+ */
+template <class T, class... Args> T *mm_new(Args &&...args) {
+  void *p;
+  if constexpr (alignof(T) <= mm_detail::default_alignment) {
+    p = mm_malloc_const<sizeof(T)>();
+    if (p == nullptr) {
+      throw std::bad_alloc();
+    }
+  } else {
+    p = mm_detail::allocate(sizeof(T), alignof(T));
+  }
+  try {
+    return ::new (p) T(std::forward<Args>(args)...);
+  } catch (...) {
+    mm_detail::deallocate(p, sizeof(T), alignof(T));
+    throw;
+  }
+}
+
+/**
+ * @brief  Destroy and free an object from mm_new<T>.
+ *
+ * @param[in] p  NULL, or an object whose dynamic type is T.
+ */
+template <class T> void mm_delete(T *p) noexcept {
+  if (p == nullptr) {
+    return;
+  }
+  p->~T();
+  mm_detail::deallocate(p, sizeof(T), alignof(T));
+}
+
+#endif /* MM_CONST_H */
@@ -0,0 +1,136 @@
+/*
+ * mm_new.cc - replaces every global operator new and operator delete
+ *
+ * Linked into a program together with the interposition build of mm.c
+ * (or loaded as part of libmm++.so with LD_PRELOAD), it sends C++
+ * allocations straight to the heap:
+ *
+ *   - plain and nothrow new go to malloc, and follow the standard loop of
+ *     calling the new_handler until it succeeds or there is none;
+ *   - align_val_t new goes to memalign, which looks for a free block that
+ *     already fits the aligned payload before asking for extra space;
+ *   - sized delete goes to free_sized, which picks the per-CPU cache class
+ *     from the size instead of decoding the header;
+ *   - aligned delete goes to free_aligned_sized, or free without a size.
+ */
+
+#include <cstddef>
+#include <new>
+
+#include "mm.h"
+
+namespace {
+
+/* Alignment that malloc already guarantees */
+constexpr std::size_t default_alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+void *allocate(std::size_t size, std::size_t alignment) {
+  if (size == 0) {
+    size = 1;
+  }
+  for (;;) {
+    void *p = alignment <= default_alignment ? malloc(size)
+                                             : memalign(alignment, size);
+    if (p != nullptr) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void deallocate_sized(void *p, std::size_t size,
+                      std::size_t alignment) noexcept {
+  if (alignment <= default_alignment) {
+    free_sized(p, size);
+  } else {
+    free_aligned_sized(p, alignment, size);
+  }
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+  return allocate(size, default_alignment);
+}
+
+void *operator new[](std::size_t size) {
+  return allocate(size, default_alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, default_alignment);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, default_alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete[](void *p) noexcept { free(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+
+void operator delete(void *p, std::size_t size) noexcept {
+  deallocate_sized(p, size, default_alignment);
+}
+
+void operator delete[](void *p, std::size_t size) noexcept {
+  deallocate_sized(p, size, default_alignment);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+
+void operator delete(void *p, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, std::size_t size,
+                     std::align_val_t alignment) noexcept {
+  deallocate_sized(p, size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void *p, std::size_t size,
+                       std::align_val_t alignment) noexcept {
+  deallocate_sized(p, size, static_cast<std::size_t>(alignment));
+}
@@ -0,0 +1,348 @@
+/*
+ * poolbench.cc - compare mm_pool with plain mm_malloc on traces dominated
+ * by a few object sizes, such as the bdd traces
+ *
+ * Each trace is replayed a number of rounds in three ways:
+ *   mm_malloc   every request goes to mm_malloc, and whatever is still
+ *               allocated at the end of a round is freed one by one;
+ *   mm_pool     sizes making up at least a tenth of the allocations of
+ *               the trace come from one pool per size, the rest from
+ *               mm_malloc;
+ *   mm_pool+reset  as mm_pool, but the pools are reset at the end of a
+ *               round instead of freeing their objects one by one.
+ * The heap is reset before each way, so the peak heap sizes compare too.
+ * Finally a synthetic node churn compares mm_pool<T> with mm_new<T>, and a
+ * request churn compares an mm_arena reset per request with freeing each
+ * object of the request.
+ *
+ * usage: poolbench [-r <rounds>] [tracefile...]
+ *   default tracefiles are the bdd traces in TRACEDIR
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "config.h"
+#include "memlib.h"
+}
+#include "mm_const.h"
+#include "mm_pool.h"
+
+namespace {
+
+int rounds = 10;
+
+struct op {
+  char type; /* 'a', 'f' or 'r' */
+  int id;
+  std::size_t size;
+};
+
+struct trace {
+  int num_ids;
+  std::vector<op> ops;
+};
+
+bool read_trace(const char *path, trace &t) {
+  FILE *f = std::fopen(path, "r");
+  if (f == nullptr) {
+    std::perror(path);
+    return false;
+  }
+  int weight, num_ops;
+  long suggested;
+  if (std::fscanf(f, "%d %d %d %ld", &weight, &t.num_ids, &num_ops,
+                  &suggested) != 4) {
+    std::fprintf(stderr, "%s: bad header\n", path);
+    std::fclose(f);
+    return false;
+  }
+  char type[2];
+  while (std::fscanf(f, "%1s", type) == 1) {
+    op o{type[0], 0, 0};
+    if (std::fscanf(f, "%d", &o.id) != 1 ||
+        (o.type != 'f' && std::fscanf(f, "%zu", &o.size) != 1)) {
+      std::fprintf(stderr, "%s: bad op\n", path);
+      std::fclose(f);
+      return false;
+    }
+    t.ops.push_back(o);
+  }
+  std::fclose(f);
+  return true;
+}
+
+/* Replays a trace, with a pool for each size in `pooled` */
+class replayer {
+public:
+  replayer(const trace &t, const std::vector<std::size_t> &pooled)
+      : t_(t), ptr_(t.num_ids), pool_of_(t.num_ids) {
+    for (std::size_t size : pooled) {
+      pools_[size] = mm_pool_create(size);
+    }
+  }
+
+  ~replayer() {
+    for (auto &p : pools_) {
+      mm_pool_destroy(p.second);
+    }
+  }
+
+  void round(bool reset) {
+    for (const op &o : t_.ops) {
+      switch (o.type) {
+      case 'a':
+        ptr_[o.id] = allocate(o.id, o.size);
+        std::memset(ptr_[o.id], o.id, o.size);
+        break;
+      case 'f':
+        release(o.id);
+        break;
+      default: {
+        mm_pool_t *old_pool = pool_of_[o.id];
+        void *old = ptr_[o.id];
+        std::size_t old_size = size_of(old_pool, old);
+        void *p = allocate(o.id, o.size);
+        std::memcpy(p, old, old_size < o.size ? old_size : o.size);
+        if (old_pool != nullptr) {
+          mm_pool_free(old_pool, old);
+        } else {
+          mm_free(old);
+        }
+        ptr_[o.id] = p;
+        break;
+      }
+      }
+    }
+    for (int id = 0; id < t_.num_ids; id++) {
+      if (ptr_[id] != nullptr && (!reset || pool_of_[id] == nullptr)) {
+        release(id);
+      }
+      ptr_[id] = nullptr;
+    }
+    if (reset) {
+      for (auto &p : pools_) {
+        mm_pool_reset(p.second);
+      }
+    }
+  }
+
+private:
+  void *allocate(int id, std::size_t size) {
+    auto it = pools_.find(size);
+    pool_of_[id] = it != pools_.end() ? it->second : nullptr;
+    void *p = pool_of_[id] != nullptr ? mm_pool_alloc(pool_of_[id])
+                                      : mm_malloc(size);
+    if (p == nullptr) {
+      std::fprintf(stderr, "out of memory\n");
+      std::exit(1);
+    }
+    return p;
+  }
+
+  void release(int id) {
+    if (pool_of_[id] != nullptr) {
+      mm_pool_free(pool_of_[id], ptr_[id]);
+    } else {
+      mm_free(ptr_[id]);
+    }
+    ptr_[id] = nullptr;
+  }
+
+  std::size_t size_of(mm_pool_t *pool, void *p) {
+    for (auto &it : pools_) {
+      if (it.second == pool) {
+        return it.first;
+      }
+    }
+    return mm_malloc_usable_size(p);
+  }
+
+  const trace &t_;
+  std::map<std::size_t, mm_pool_t *> pools_;
+  std::vector<void *> ptr_;
+  std::vector<mm_pool_t *> pool_of_;
+};
+
+/* Sizes making up at least a tenth of the allocations */
+std::vector<std::size_t> dominant_sizes(const trace &t) {
+  std::map<std::size_t, int> count;
+  int total = 0;
+  for (const op &o : t.ops) {
+    if (o.type == 'a') {
+      count[o.size]++;
+      total++;
+    }
+  }
+  std::vector<std::size_t> sizes;
+  for (auto &c : count) {
+    if (c.second * 10 >= total) {
+      sizes.push_back(c.first);
+    }
+  }
+  return sizes;
+}
+
+void fresh_heap() {
+  mem_reset_brk();
+  if (!mm_init()) {
+    std::fprintf(stderr, "mm_init failed\n");
+    std::exit(1);
+  }
+}
+
+void run(const char *name, const trace &t,
+         const std::vector<std::size_t> &pooled, bool reset) {
+  fresh_heap();
+  auto start = std::chrono::steady_clock::now();
+  {
+    replayer r(t, pooled);
+    for (int i = 0; i < rounds; i++) {
+      r.round(reset);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  std::printf("  %-14s %10.1f ms %10zu bytes peak\n", name, ms,
+              mem_peak_heapsize());
+}
+
+/* A node of a decision diagram, 24 bytes */
+struct node {
+  node *lo;
+  node *hi;
+  std::uint32_t var;
+  std::uint32_t ref;
+};
+
+/* Nodes created and dropped at random, then all dropped at once */
+template <bool pooled> void node_churn() {
+  constexpr int live = 1 << 16;
+  std::vector<node *> nodes(live);
+  fresh_heap();
+  auto start = std::chrono::steady_clock::now();
+  {
+    mm_pool<node> pool;
+    std::uint64_t state = 1;
+    for (int i = 0; i < rounds; i++) {
+      for (int j = 0; j < 16 * live; j++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int k = static_cast<int>(state >> 48);
+        node *lo = nodes[(k + 1) % live];
+        node *hi = nodes[(k + 2) % live];
+        if (pooled) {
+          pool.destroy(nodes[k]);
+          nodes[k] = pool.create(node{lo, hi, std::uint32_t(j), 1});
+        } else {
+          mm_delete(nodes[k]);
+          nodes[k] = mm_new<node>(node{lo, hi, std::uint32_t(j), 1});
+        }
+      }
+      if (pooled) {
+        pool.reset();
+      } else {
+        for (node *&n : nodes) {
+          mm_delete(n);
+        }
+      }
+      std::fill(nodes.begin(), nodes.end(), nullptr);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  std::printf("  %-14s %10.1f ms %10zu bytes peak\n",
+              pooled ? "mm_pool<node>" : "mm_new<node>", ms,
+              mem_peak_heapsize());
+}
+
+/* Requests allocating objects of mixed sizes, all dropped at the end */
+template <bool arena> void request_churn() {
+  constexpr int per_request = 4096;
+  std::vector<void *> objs(per_request);
+  fresh_heap();
+  auto start = std::chrono::steady_clock::now();
+  {
+    mm_arena_t *a = arena ? mm_arena_create() : nullptr;
+    std::uint64_t state = 1;
+    for (int i = 0; i < rounds * 64; i++) {
+      for (void *&p : objs) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        std::size_t size = 8 + (state >> 56);
+        p = arena ? mm_arena_alloc(a, size) : mm_malloc(size);
+        if (p == nullptr) {
+          std::fprintf(stderr, "out of memory\n");
+          std::exit(1);
+        }
+        std::memset(p, i, size);
+      }
+      if (arena) {
+        mm_arena_reset(a);
+      } else {
+        for (void *p : objs) {
+          mm_free(p);
+        }
+      }
+    }
+    mm_arena_destroy(a);
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(end - start).count();
+  std::printf("  %-14s %10.1f ms %10zu bytes peak\n",
+              arena ? "mm_arena" : "mm_malloc", ms, mem_peak_heapsize());
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc, argv, "r:h")) != -1) {
+    switch (c) {
+    case 'r':
+      rounds = std::atoi(optarg);
+      break;
+    default:
+      std::fprintf(stderr, "usage: %s [-r <rounds>] [tracefile...]\n",
+                   argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if (files.empty()) {
+    for (const char *name :
+         {"bdd-aa4.rep", "bdd-aa32.rep", "bdd-ma4.rep", "bdd-nq7.rep"}) {
+      files.push_back(std::string(TRACEDIR) + name);
+    }
+  }
+
+  mem_init(false);
+  for (const std::string &file : files) {
+    trace t;
+    if (!read_trace(file.c_str(), t)) {
+      return 1;
+    }
+    std::vector<std::size_t> pooled = dominant_sizes(t);
+    std::printf("%s (%d rounds, pooled sizes:", file.c_str(), rounds);
+    for (std::size_t size : pooled) {
+      std::printf(" %zu", size);
+    }
+    std::printf(")\n");
+    run("mm_malloc", t, {}, false);
+    run("mm_pool", t, pooled, false);
+    run("mm_pool+reset", t, pooled, true);
+  }
+  std::printf("node churn (%d rounds)\n", rounds);
+  node_churn<false>();
+  node_churn<true>();
+  std::printf("request churn (%d rounds)\n", rounds * 64);
+  request_churn<false>();
+  request_churn<true>();
+  return 0;
+}